@@ -0,0 +1,250 @@
+// Times the hot paths of the filesystem on generated TeslaCam images.
+//
+// Images are sparse files, so even the largest ones only take the space of
+// their metadata, and clips read as zeros from the page cache.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_split.h"
+#include "argparse/argparse.hpp"
+#include "fat32.h"
+#include "spdlog/cfg/env.h"
+#include "spdlog/fmt/fmt.h"
+#include "spdlog/spdlog.h"
+#include "teslacam_image.h"
+
+namespace {
+
+// Largest read the kernel sends to a FUSE filesystem.
+constexpr uint32_t kRandomReadSize = 128 << 10;
+
+// Runs `op` in growing batches until a batch takes at least `min_time`
+// seconds, then prints its time per call. `op` returns the bytes it
+// processed, if that makes sense.
+void Run(const std::string& image, const std::string& name, double min_time,
+         const std::function<uint64_t()>& op) {
+  using Clock = std::chrono::steady_clock;
+  for (uint64_t iterations = 1;; iterations *= 2) {
+    uint64_t bytes = 0;
+    const Clock::time_point start = Clock::now();
+    for (uint64_t i = 0; i < iterations; i++) {
+      bytes += op();
+    }
+    const double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    if (elapsed < min_time) {
+      continue;
+    }
+
+    std::string throughput;
+    if (bytes > 0) {
+      throughput = fmt::format("{:10.1f} MB/s", bytes / elapsed / 1e6);
+    }
+    fmt::print("{:<8} {:<24} {:>10} {:>14.0f} ns/op {}\n", image, name,
+               iterations, elapsed * 1e9 / iterations, throughput);
+    return;
+  }
+}
+
+// Where the first FAT starts, how long each FAT is, and the first free
+// cluster, read from the boot sector and the FSInfo sector.
+bool ReadFatLayout(int fd, uint64_t* address, uint64_t* size,
+                   uint32_t* free_cluster) {
+  uint8_t sectors[1024];
+  if (pread(fd, sectors, sizeof(sectors), 0) != sizeof(sectors)) {
+    return false;
+  }
+  uint16_t bytes_per_sector;
+  uint16_t reserved_sectors;
+  uint32_t sectors_per_fat;
+  memcpy(&bytes_per_sector, sectors + 11, 2);
+  memcpy(&reserved_sectors, sectors + 14, 2);
+  memcpy(&sectors_per_fat, sectors + 36, 4);
+  memcpy(free_cluster, sectors + 512 + 492, 4);
+  *address = static_cast<uint64_t>(reserved_sectors) * bytes_per_sector;
+  *size = static_cast<uint64_t>(sectors_per_fat) * bytes_per_sector;
+  return true;
+}
+
+bool Benchmark(const std::string& image_path, const std::string& image_name,
+               const fat32::TeslaCamImageOptions& image_options,
+               fat32::BlockDeviceType device_type, double min_time) {
+  fat32::TeslaCamImage image;
+  auto start = std::chrono::steady_clock::now();
+  if (!fat32::WriteTeslaCamImage(image_path, image_options, &image)) {
+    std::cerr << "failed to write " << image_path << std::endl;
+    return false;
+  }
+  spdlog::info("{}: {} directories, {} clips, written in {:.1f} s",
+               image_name, image.directories.size(), image.clips.size(),
+               std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start)
+                   .count());
+
+  fat32::FileSystem fs(image_path, device_type);
+  if (!fs.IsValid()) {
+    std::cerr << "invalid image " << image_path << std::endl;
+    return false;
+  }
+
+  const std::string recent_clips = "TeslaCam/RecentClips";
+  std::vector<std::string> recent_names;
+  std::vector<fat32::FileLayout> layouts;
+  for (const std::string& clip : image.clips) {
+    if (clip.rfind(recent_clips + "/", 0) == 0) {
+      recent_names.push_back(clip.substr(recent_clips.size() + 1));
+    }
+    if (!fs.GetFileLayout(clip, &layouts.emplace_back())) {
+      std::cerr << "missing clip " << clip << std::endl;
+      return false;
+    }
+  }
+  if (recent_names.empty()) {
+    std::cerr << "no clips in " << image_name << std::endl;
+    return false;
+  }
+
+  std::mt19937_64 rng(image_options.seed);
+  uint64_t i = 0;
+
+  // Alternates between all the directories, so that each call changes.
+  Run(image_name, "ChangeDirectory", min_time, [&] {
+    fs.ChangeDirectory(image.directories[i++ % image.directories.size()]);
+    return 0;
+  });
+
+  fs.ChangeDirectory(recent_clips);
+  Run(image_name, "FindDirectoryEntry", min_time, [&] {
+    if (fs.FindDirectoryEntry(recent_names[rng() % recent_names.size()]) ==
+        nullptr) {
+      spdlog::error("entry not found");
+    }
+    return 0;
+  });
+
+  std::string content;
+  Run(image_name, "ReadFile", min_time, [&] {
+    fs.ReadFile(recent_names[i++ % recent_names.size()], &content);
+    return content.size();
+  });
+
+  std::vector<char> buffer(kRandomReadSize);
+  Run(image_name, "ReadFile random 128K", min_time, [&] {
+    const fat32::FileLayout& layout = layouts[rng() % layouts.size()];
+    const uint32_t offset = rng() % layout.entry.size;
+    return fs.ReadFile(layout, offset, kRandomReadSize, buffer.data());
+  });
+
+  Run(image_name, "Refresh unchanged", min_time, [&] {
+    fs.Refresh();
+    return 0;
+  });
+
+  // Allocates and frees the first free cluster in turn, as the car does
+  // when it starts a clip, so that each refresh finds a change.
+  const int fd = open(image_path.c_str(), O_RDWR | O_CLOEXEC);
+  uint64_t fat_address;
+  uint64_t fat_size;
+  uint32_t free_cluster;
+  if (fd < 0 ||
+      !ReadFatLayout(fd, &fat_address, &fat_size, &free_cluster)) {
+    std::cerr << "failed to open " << image_path << std::endl;
+    return false;
+  }
+  const uint64_t entry_address = fat_address + uint64_t{free_cluster} * 4;
+  Run(image_name, "Refresh changed", min_time, [&] {
+    const uint32_t value = i++ % 2 == 0 ? 0x0FFFFFFF : 0;
+    for (uint64_t fat = 0; fat < 2; fat++) {
+      if (pwrite(fd, &value, sizeof(value), entry_address + fat * fat_size) !=
+          sizeof(value)) {
+        spdlog::error("failed to write FAT");
+      }
+    }
+    fs.Refresh();
+    return 0;
+  });
+  close(fd);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  spdlog::cfg::load_env_levels();
+
+  argparse::ArgumentParser program("fat32_benchmark");
+  program.add_argument("--sizes-gb")
+      .help("comma separated logical sizes of the images, in GiB")
+      .default_value(std::string{"1,8,32,128"});
+  program.add_argument("--cluster-kb")
+      .help("cluster size, 0 for the default of mkfs.fat for the size")
+      .default_value(0)
+      .scan<'i', int>();
+  program.add_argument("--fragmentation")
+      .help("probability that a clip continues elsewhere after a cluster")
+      .default_value(0.0)
+      .scan<'g', double>();
+  program.add_argument("--clip-mb")
+      .help("size of the clip of one camera for one minute")
+      .default_value(32)
+      .scan<'i', int>();
+  program.add_argument("--block-device")
+      .help("how to read the image file: mmap, pread, io_uring")
+      .default_value(std::string{"mmap"})
+      .choices("mmap", "pread", "io_uring");
+  program.add_argument("--min-time")
+      .help("seconds each benchmark runs at least")
+      .default_value(0.5)
+      .scan<'g', double>();
+  program.add_argument("--dir")
+      .help("directory to write the images in")
+      .default_value(std::string{"/tmp"});
+
+  try {
+    program.parse_args(argc, argv);
+  } catch (const std::exception& err) {
+    std::cerr << err.what() << std::endl;
+    return 1;
+  }
+
+  fat32::BlockDeviceType device_type;
+  if (!fat32::ParseBlockDeviceType(program.get("block-device"),
+                                   &device_type)) {
+    std::cerr << "unknown block device" << std::endl;
+    return 1;
+  }
+
+  fat32::TeslaCamImageOptions options;
+  options.cluster_size = program.get<int>("cluster-kb") * 1024;
+  options.fragmentation = program.get<double>("fragmentation");
+  options.clip_size = static_cast<uint64_t>(program.get<int>("clip-mb")) << 20;
+  const double min_time = program.get<double>("min-time");
+
+  for (absl::string_view size : absl::StrSplit(program.get("sizes-gb"), ',')) {
+    uint64_t size_gb;
+    if (!absl::SimpleAtoi(size, &size_gb) || size_gb == 0) {
+      std::cerr << "invalid image size '" << size << "'" << std::endl;
+      return 1;
+    }
+    options.size = size_gb << 30;
+    const std::string name = fmt::format("{}G", size_gb);
+    const std::string path =
+        fmt::format("{}/fat32-benchmark-{}.img", program.get("dir"), name);
+    const bool succeed = Benchmark(path, name, options, device_type, min_time);
+    unlink(path.c_str());
+    if (!succeed) {
+      return 1;
+    }
+  }
+  return 0;
+}
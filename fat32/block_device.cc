@@ -0,0 +1,219 @@
+#include "block_device.h"
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+#ifdef FAT32_WITH_IO_URING
+#include "io_uring_block_device.h"
+#endif
+
+namespace fat32 {
+
+namespace {
+
+class PreadBlockDevice : public BlockDevice {
+ public:
+  PreadBlockDevice(int fd, uint64_t size, bool writable)
+      : BlockDevice(fd, size, writable) {}
+
+  bool Read(uint64_t offset, uint64_t size, char *out) const override {
+    if (!IsInRange(offset, size)) {
+      spdlog::error("read out of range: 0x{:X}+{}", offset, size);
+      return false;
+    }
+    RecordRead(offset, size);
+
+    while (size > 0) {
+      const ssize_t n = pread(fd(), out, size, offset);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        spdlog::error("pread failed at 0x{:X}: {}", offset, strerror(errno));
+        return false;
+      }
+      if (n == 0) {
+        spdlog::error("unexpected end of image at 0x{:X}", offset);
+        return false;
+      }
+      out += n;
+      offset += n;
+      size -= n;
+    }
+    return true;
+  }
+};
+
+class MmapBlockDevice : public BlockDevice {
+ public:
+  MmapBlockDevice(int fd, uint64_t size, bool writable, const char *data)
+      : BlockDevice(fd, size, writable), data_(data) {}
+
+  ~MmapBlockDevice() override {
+    munmap(const_cast<char *>(data_), Size());
+  }
+
+  bool Read(uint64_t offset, uint64_t size, char *out) const override {
+    if (!IsInRange(offset, size)) {
+      spdlog::error("read out of range: 0x{:X}+{}", offset, size);
+      return false;
+    }
+    RecordRead(offset, size);
+    memcpy(out, data_ + offset, size);
+    return true;
+  }
+
+  const char *Data() const override { return data_; }
+
+ private:
+  const char *data_;
+};
+
+}  // namespace
+
+BlockDevice::~BlockDevice() { close(fd_); }
+
+void BlockDevice::RecordRead(uint64_t offset, uint64_t size) const {
+  reads_.fetch_add(1, std::memory_order_relaxed);
+  bytes_read_.fetch_add(size, std::memory_order_relaxed);
+  // Concurrent readers interleave, which counts as seeking as it does for
+  // the storage.
+  if (next_offset_.exchange(offset + size, std::memory_order_relaxed) !=
+      offset) {
+    seeks_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+bool BlockDevice::Write(uint64_t offset, uint64_t size, const char *data) {
+  if (!writable_) {
+    spdlog::error("write to a read-only image at 0x{:X}", offset);
+    return false;
+  }
+  if (!IsInRange(offset, size)) {
+    spdlog::error("write out of range: 0x{:X}+{}", offset, size);
+    return false;
+  }
+
+  // A shared mapping of the image sees the page cache, so plain writes are
+  // coherent with every backend.
+  while (size > 0) {
+    const ssize_t n = pwrite(fd_, data, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      spdlog::error("pwrite failed at 0x{:X}: {}", offset, strerror(errno));
+      return false;
+    }
+    data += n;
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool BlockDevice::Sync() {
+  if (fdatasync(fd_) != 0) {
+    spdlog::error("fdatasync failed: {}", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+BlockDeviceStats BlockDevice::Stats() const {
+  BlockDeviceStats stats;
+  stats.reads = reads_.load(std::memory_order_relaxed);
+  stats.bytes_read = bytes_read_.load(std::memory_order_relaxed);
+  stats.seeks = seeks_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+bool BlockDevice::ReadBatch(const std::vector<ReadRequest> &requests) const {
+  for (const ReadRequest &request : requests) {
+    if (!Read(request.offset, request.size, request.out)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::unique_ptr<BlockDevice> OpenBlockDevice(const std::string &image_file,
+                                             BlockDeviceType type,
+                                             bool writable) {
+  const int fd =
+      open(image_file.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+  if (fd < 0) {
+    spdlog::error("failed to open {}: {}", image_file, strerror(errno));
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    spdlog::error("failed to stat {}: {}", image_file, strerror(errno));
+    close(fd);
+    return nullptr;
+  }
+  uint64_t size = st.st_size;
+  // Block devices, such as the partition given to the USB gadget, have no
+  // size of their own.
+  if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) != 0) {
+    spdlog::error("failed to get the size of {}: {}", image_file,
+                  strerror(errno));
+    close(fd);
+    return nullptr;
+  }
+
+  switch (type) {
+    case BlockDeviceType::kPread:
+      return std::make_unique<PreadBlockDevice>(fd, size, writable);
+    case BlockDeviceType::kMmap: {
+      void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (data == MAP_FAILED) {
+        spdlog::error("failed to mmap {}: {}", image_file, strerror(errno));
+        close(fd);
+        return nullptr;
+      }
+      return std::make_unique<MmapBlockDevice>(
+          fd, size, writable, static_cast<const char *>(data));
+    }
+    case BlockDeviceType::kIoUring: {
+#ifdef FAT32_WITH_IO_URING
+      std::unique_ptr<BlockDevice> device =
+          OpenIoUringBlockDevice(fd, size, writable);
+      if (device != nullptr) {
+        return device;
+      }
+#else
+      spdlog::error("built without io_uring support");
+#endif
+      break;
+    }
+  }
+
+  close(fd);
+  return nullptr;
+}
+
+bool ParseBlockDeviceType(absl::string_view name, BlockDeviceType *type) {
+  if (name == "pread") {
+    *type = BlockDeviceType::kPread;
+  } else if (name == "mmap") {
+    *type = BlockDeviceType::kMmap;
+  } else if (name == "io_uring") {
+    *type = BlockDeviceType::kIoUring;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace fat32
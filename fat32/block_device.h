@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace fat32 {
+
+enum class BlockDeviceType {
+  kPread,
+  kMmap,
+  kIoUring,  // only when built with liburing
+};
+
+// One read of a batch.
+struct ReadRequest {
+  uint64_t offset;
+  uint64_t size;
+  char* out;
+};
+
+// What was read from an image.
+struct BlockDeviceStats {
+  uint64_t reads = 0;
+  uint64_t bytes_read = 0;
+  // Reads not starting where the previous one ended.
+  uint64_t seeks = 0;
+};
+
+// Random access to the bytes of an image file.
+//
+// Reads are positional and keep no state between calls, so a device can be
+// shared by concurrent readers. Writes go through the page cache of the
+// image file, which every backend reads through, also the memory mapped
+// one.
+class BlockDevice {
+ public:
+  virtual ~BlockDevice();
+
+  // Reads exactly `size` bytes at `offset` into `out`. Returns false on I/O
+  // error or if the range is past the end of the image.
+  virtual bool Read(uint64_t offset, uint64_t size, char* out) const = 0;
+
+  // Reads all of `requests`, which the device may serve concurrently and in
+  // any order. Returns false if any of them failed.
+  virtual bool ReadBatch(const std::vector<ReadRequest>& requests) const;
+
+  // Returns the whole image mapped in memory, or nullptr if the device is
+  // not memory mapped.
+  virtual const char* Data() const { return nullptr; }
+
+  // Writes exactly `size` bytes of `data` at `offset`. Returns false on I/O
+  // error, if the range is past the end of the image or if the device is
+  // read-only.
+  bool Write(uint64_t offset, uint64_t size, const char* data);
+
+  // Waits for the writes to reach the storage.
+  bool Sync();
+
+  bool Writable() const { return writable_; }
+
+  uint64_t Size() const { return size_; }
+
+  int fd() const { return fd_; }
+
+  // Accounts for a read of the image. Devices account for their own reads,
+  // this is for reads done by other means, in place through Data() or
+  // spliced from fd().
+  void RecordRead(uint64_t offset, uint64_t size) const;
+
+  BlockDeviceStats Stats() const;
+
+ protected:
+  BlockDevice(int fd, uint64_t size, bool writable = false)
+      : fd_(fd), size_(size), writable_(writable) {}
+
+  bool IsInRange(uint64_t offset, uint64_t size) const {
+    return offset <= size_ && size <= size_ - offset;
+  }
+
+ private:
+  const int fd_;
+  const uint64_t size_;
+  const bool writable_;
+
+  mutable std::atomic<uint64_t> reads_{0};
+  mutable std::atomic<uint64_t> bytes_read_{0};
+  mutable std::atomic<uint64_t> seeks_{0};
+  // Where the last read ended.
+  mutable std::atomic<uint64_t> next_offset_{0};
+};
+
+// Opens `image_file` with the given backend, read-only unless `writable`.
+// Returns nullptr on failure.
+std::unique_ptr<BlockDevice> OpenBlockDevice(const std::string& image_file,
+                                             BlockDeviceType type,
+                                             bool writable = false);
+
+bool ParseBlockDeviceType(absl::string_view name, BlockDeviceType* type);
+
+}  // namespace fat32
@@ -0,0 +1,369 @@
+#include "clip_index.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <tuple>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "json.h"
+#include "spdlog/spdlog.h"
+
+namespace fat32 {
+
+namespace {
+
+constexpr char kMagic[8] = {'F', 'A', 'T', '3', '2', 'C', 'L', 'P'};
+constexpr uint32_t kVersion = 1;
+// Length of 2024-04-19_08-46-12.
+constexpr size_t kTimeLength = 19;
+
+// Parses the `size` digits at `text`.
+bool ParseDigits(absl::string_view text, size_t size, int *value) {
+  if (text.size() < size) {
+    return false;
+  }
+  *value = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (!absl::ascii_isdigit(text[i])) {
+      return false;
+    }
+    *value = *value * 10 + (text[i] - '0');
+  }
+  return true;
+}
+
+// Offset of each table of an index, after the header.
+struct Layout {
+  uint64_t clips;
+  uint64_t extents;
+  uint64_t string_offsets;
+  uint64_t strings;
+  uint64_t size;
+};
+
+Layout GetLayout(const ClipIndexHeader &header) {
+  Layout layout;
+  layout.clips = sizeof(ClipIndexHeader);
+  layout.extents =
+      layout.clips + static_cast<uint64_t>(header.clip_count) *
+                         sizeof(ClipRecord);
+  layout.string_offsets =
+      layout.extents + static_cast<uint64_t>(header.extent_count) *
+                           sizeof(ImageRange);
+  layout.strings = layout.string_offsets +
+                   static_cast<uint64_t>(header.string_count) *
+                       sizeof(uint64_t);
+  layout.size = layout.strings + header.string_size;
+  return layout;
+}
+
+}  // namespace
+
+bool ParseClipTime(absl::string_view time, int64_t *timestamp) {
+  // 2024-04-19_08-46-12
+  static constexpr char kSeparators[] = "--_--";
+  static constexpr size_t kFieldSizes[] = {4, 2, 2, 2, 2, 2};
+  if (time.size() != kTimeLength) {
+    return false;
+  }
+  int fields[6];
+  size_t pos = 0;
+  for (size_t i = 0; i < 6; i++) {
+    if (!ParseDigits(time.substr(pos), kFieldSizes[i], &fields[i])) {
+      return false;
+    }
+    pos += kFieldSizes[i];
+    if (i < 5) {
+      if (time[pos] != kSeparators[i]) {
+        return false;
+      }
+      pos++;
+    }
+  }
+
+  struct tm tm = {};
+  tm.tm_year = fields[0] - 1900;
+  tm.tm_mon = fields[1] - 1;
+  tm.tm_mday = fields[2];
+  tm.tm_hour = fields[3];
+  tm.tm_min = fields[4];
+  tm.tm_sec = fields[5];
+  if (tm.tm_mon < 0 || tm.tm_mon > 11 || tm.tm_mday < 1 || tm.tm_mday > 31 ||
+      tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60) {
+    return false;
+  }
+  *timestamp = timegm(&tm);
+  return true;
+}
+
+bool ParseClipName(absl::string_view name, ClipName *clip) {
+  // 2024-04-19_08-46-12-front.mp4
+  constexpr absl::string_view kExtension = ".mp4";
+  if (name.size() < kTimeLength + 1 + kExtension.size() + 1 ||
+      !absl::EndsWith(name, kExtension) || name[kTimeLength] != '-' ||
+      !ParseClipTime(name.substr(0, kTimeLength), &clip->timestamp)) {
+    return false;
+  }
+  const absl::string_view camera = name.substr(
+      kTimeLength + 1, name.size() - kTimeLength - 1 - kExtension.size());
+  for (const char c : camera) {
+    if (!absl::ascii_islower(c) && c != '_') {
+      return false;
+    }
+  }
+  clip->camera = std::string(camera);
+  return true;
+}
+
+bool ClipIndexBuilder::Update(const FileSystem &fs) {
+  TreeSnapshot snapshot;
+  if (!fs.Snapshot(root_, &snapshot)) {
+    return false;
+  }
+
+  absl::flat_hash_map<std::string, ClipDirectory> directories;
+  size_t listed = 0;
+  for (const auto &[path, directory] : snapshot.directories) {
+    const auto it = directories_.find(path);
+    if (it != directories_.end() && it->second.directory == directory) {
+      directories.emplace(path, std::move(it->second));
+      continue;
+    }
+
+    listed++;
+    ClipDirectory clips{directory, {}};
+    for (const DirectoryEntry &entry : directory->Entries()) {
+      Clip clip;
+      if (entry.IsDirectory() || !ParseClipName(entry.name, &clip.parsed)) {
+        continue;
+      }
+      FileLayout layout;
+      if (!fs.GetFileLayout(absl::StrCat(path, "/", entry.name), &layout)) {
+        // Removed since the snapshot, the next update will tell.
+        continue;
+      }
+      clip.name = entry.name;
+      clip.size = layout.entry.size;
+      std::shared_ptr<const BlockDevice> device;
+      fs.MapFile(layout, 0, layout.entry.size, &clip.ranges, &device);
+      clips.clips.push_back(std::move(clip));
+    }
+    directories.emplace(path, std::move(clips));
+  }
+
+  spdlog::debug("clip index: listed {} of {} directories", listed,
+                directories.size());
+  directories_ = std::move(directories);
+  generation_ = snapshot.generation;
+  return true;
+}
+
+std::string ClipIndexBuilder::Serialize() const {
+  struct Entry {
+    const std::string *directory;
+    const Clip *clip;
+  };
+  std::vector<Entry> entries;
+  for (const auto &[path, directory] : directories_) {
+    for (const Clip &clip : directory.clips) {
+      entries.push_back({&path, &clip});
+    }
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) {
+              return std::tie(a.clip->parsed.timestamp, *a.directory,
+                              a.clip->parsed.camera, a.clip->name) <
+                     std::tie(b.clip->parsed.timestamp, *b.directory,
+                              b.clip->parsed.camera, b.clip->name);
+            });
+
+  std::vector<ClipRecord> clips;
+  std::vector<ImageRange> extents;
+  std::vector<uint64_t> string_offsets;
+  std::string strings;
+  absl::flat_hash_map<absl::string_view, uint32_t> string_indexes;
+  const auto intern = [&](absl::string_view s) {
+    const auto [it, inserted] =
+        string_indexes.emplace(s, string_offsets.size());
+    if (inserted) {
+      string_offsets.push_back(strings.size());
+      strings.append(s.data(), s.size());
+      strings.push_back('\0');
+    }
+    return it->second;
+  };
+  clips.reserve(entries.size());
+  for (const Entry &entry : entries) {
+    ClipRecord record = {};
+    record.timestamp = entry.clip->parsed.timestamp;
+    record.size = entry.clip->size;
+    record.directory = intern(*entry.directory);
+    record.name = intern(entry.clip->name);
+    record.camera = intern(entry.clip->parsed.camera);
+    record.first_extent = extents.size();
+    record.extent_count = entry.clip->ranges.size();
+    extents.insert(extents.end(), entry.clip->ranges.begin(),
+                   entry.clip->ranges.end());
+    clips.push_back(record);
+  }
+
+  ClipIndexHeader header = {};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.clip_count = clips.size();
+  header.generation = generation_;
+  header.extent_count = extents.size();
+  header.string_count = string_offsets.size();
+  header.string_size = strings.size();
+
+  std::string out;
+  out.reserve(GetLayout(header).size);
+  out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.append(reinterpret_cast<const char *>(clips.data()),
+             clips.size() * sizeof(ClipRecord));
+  out.append(reinterpret_cast<const char *>(extents.data()),
+             extents.size() * sizeof(ImageRange));
+  out.append(reinterpret_cast<const char *>(string_offsets.data()),
+             string_offsets.size() * sizeof(uint64_t));
+  out.append(strings);
+  return out;
+}
+
+bool ClipIndexBuilder::Write(const std::string &path) const {
+  const std::string temporary_path = path + ".tmp";
+  const std::string content = Serialize();
+  {
+    std::ofstream ofs(temporary_path, std::ios::binary | std::ios::trunc);
+    ofs.write(content.data(), content.size());
+    if (!ofs.good()) {
+      spdlog::error("failed to write {}", temporary_path);
+      return false;
+    }
+  }
+  if (rename(temporary_path.c_str(), path.c_str()) != 0) {
+    spdlog::error("failed to rename {} to {}: {}", temporary_path, path,
+                  strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+ClipIndex::ClipIndex(const char *data, uint64_t size)
+    : data_(data), size_(size) {
+  const Layout layout = GetLayout(Header());
+  clips_ = {reinterpret_cast<const ClipRecord *>(data_ + layout.clips),
+            Header().clip_count};
+  extents_ = {reinterpret_cast<const ImageRange *>(data_ + layout.extents),
+              Header().extent_count};
+  string_offsets_ = {
+      reinterpret_cast<const uint64_t *>(data_ + layout.string_offsets),
+      Header().string_count};
+  strings_ = data_ + layout.strings;
+}
+
+ClipIndex::~ClipIndex() { munmap(const_cast<char *>(data_), size_); }
+
+std::span<const ClipRecord> ClipIndex::Find(int64_t begin,
+                                            int64_t end) const {
+  const auto first = std::lower_bound(
+      clips_.begin(), clips_.end(), begin,
+      [](const ClipRecord &clip, int64_t t) { return clip.timestamp < t; });
+  const auto last = std::lower_bound(
+      first, clips_.end(), end,
+      [](const ClipRecord &clip, int64_t t) { return clip.timestamp < t; });
+  return {first, last};
+}
+
+absl::string_view ClipIndex::String(uint32_t index) const {
+  return strings_ + string_offsets_[index];
+}
+
+std::string ClipIndex::Path(const ClipRecord &clip) const {
+  const absl::string_view directory = String(clip.directory);
+  return directory.empty() ? std::string(String(clip.name))
+                           : absl::StrCat(directory, "/", String(clip.name));
+}
+
+std::string FormatClipJson(const ClipIndex &index, const ClipRecord &clip) {
+  std::string out = absl::StrCat("{\"timestamp\":", clip.timestamp,
+                                 ",\"camera\":");
+  AppendJsonString(index.String(clip.camera), &out);
+  absl::StrAppend(&out, ",\"path\":");
+  AppendJsonString(index.Path(clip), &out);
+  absl::StrAppend(&out, ",\"size\":", clip.size, ",\"extents\":[");
+  const std::span<const ImageRange> extents = index.Extents(clip);
+  for (size_t i = 0; i < extents.size(); i++) {
+    absl::StrAppend(&out, i == 0 ? "" : ",", "[", extents[i].offset, ",",
+                    extents[i].size, "]");
+  }
+  out.append("]}");
+  return out;
+}
+
+std::unique_ptr<ClipIndex> OpenClipIndex(const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    spdlog::error("failed to open {}: {}", path, strerror(errno));
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      static_cast<uint64_t>(st.st_size) < sizeof(ClipIndexHeader)) {
+    spdlog::error("invalid clip index {}", path);
+    close(fd);
+    return nullptr;
+  }
+  const uint64_t size = st.st_size;
+  void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    spdlog::error("failed to mmap {}: {}", path, strerror(errno));
+    return nullptr;
+  }
+
+  // Checked once here, so that the accessors need not.
+  const char *bytes = static_cast<const char *>(data);
+  const auto &header = *reinterpret_cast<const ClipIndexHeader *>(bytes);
+  const Layout layout = GetLayout(header);
+  bool valid = memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+               header.version == kVersion &&
+               header.string_size <= size && layout.size == size &&
+               (header.string_size == 0 || bytes[size - 1] == '\0');
+  if (valid) {
+    const auto *clips =
+        reinterpret_cast<const ClipRecord *>(bytes + layout.clips);
+    for (uint32_t i = 0; valid && i < header.clip_count; i++) {
+      const ClipRecord &clip = clips[i];
+      valid = clip.directory < header.string_count &&
+              clip.name < header.string_count &&
+              clip.camera < header.string_count &&
+              clip.first_extent <= header.extent_count &&
+              clip.extent_count <= header.extent_count - clip.first_extent &&
+              (i == 0 || clips[i - 1].timestamp <= clip.timestamp);
+    }
+    const auto *string_offsets =
+        reinterpret_cast<const uint64_t *>(bytes + layout.string_offsets);
+    for (uint32_t i = 0; valid && i < header.string_count; i++) {
+      valid = string_offsets[i] < header.string_size;
+    }
+  }
+  if (!valid) {
+    spdlog::error("invalid clip index {}", path);
+    munmap(data, size);
+    return nullptr;
+  }
+  return std::make_unique<ClipIndex>(bytes, size);
+}
+
+}  // namespace fat32
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "fat32.h"
+
+namespace fat32 {
+
+// Time and camera of a TeslaCam clip, from a name such as
+// 2024-04-19_08-46-12-front.mp4. The time is the local time of the car,
+// as seconds since the epoch as if it was UTC.
+struct ClipName {
+  int64_t timestamp;
+  std::string camera;
+};
+
+bool ParseClipName(absl::string_view name, ClipName* clip);
+
+// Parses a time in the format of clip names, 2024-04-19_08-46-12.
+bool ParseClipTime(absl::string_view time, int64_t* timestamp);
+
+// A clip in the index file. Strings are indexes in the string table.
+struct ClipRecord {
+  int64_t timestamp;
+  uint32_t size;
+  uint32_t directory;
+  uint32_t name;
+  uint32_t camera;
+  // The ranges of the image holding the clip, in the extent table.
+  uint32_t first_extent;
+  uint32_t extent_count;
+};
+
+// The index file starts with this header, followed by the clips sorted by
+// time, then directory and camera, the extents, the offsets of the strings
+// and the NUL terminated strings. Every table is aligned for its type, so
+// the file can be used as mapped. Integers are in host byte order.
+struct ClipIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t clip_count;
+  uint64_t generation;
+  uint32_t extent_count;
+  uint32_t string_count;
+  uint64_t string_size;
+};
+
+// Keeps the clips found below a directory of the file system, TeslaCam
+// usually, up to date. Only the directories that changed since the last
+// update, as told by their snapshots, are listed again.
+class ClipIndexBuilder {
+ public:
+  explicit ClipIndexBuilder(std::string root = "TeslaCam")
+      : root_(std::move(root)) {}
+
+  // Updates the clips from the file system, which should have been
+  // refreshed. Returns false if the root cannot be read.
+  bool Update(const FileSystem& fs);
+
+  const std::string& Root() const { return root_; }
+
+  // FileSystem::Generation() as of the last update.
+  uint64_t Generation() const { return generation_; }
+
+  std::string Serialize() const;
+
+  // Writes the index to a temporary file renamed to `path`, so that
+  // readers see either the old or the new index.
+  bool Write(const std::string& path) const;
+
+ private:
+  struct Clip {
+    std::string name;
+    ClipName parsed;
+    uint32_t size;
+    std::vector<ImageRange> ranges;
+  };
+
+  struct ClipDirectory {
+    std::shared_ptr<const Directory> directory;
+    std::vector<Clip> clips;
+  };
+
+  const std::string root_;
+  uint64_t generation_ = 0;
+  absl::flat_hash_map<std::string, ClipDirectory> directories_;
+};
+
+// A clip index file, mapped.
+class ClipIndex {
+ public:
+  // Takes ownership of the mapping of `size` bytes at `data`, which must
+  // have been validated.
+  ClipIndex(const char* data, uint64_t size);
+  ~ClipIndex();
+
+  ClipIndex(const ClipIndex&) = delete;
+  ClipIndex& operator=(const ClipIndex&) = delete;
+
+  uint64_t Generation() const { return Header().generation; }
+
+  std::span<const ClipRecord> Clips() const { return clips_; }
+
+  // Clips recorded in [begin, end), in order.
+  std::span<const ClipRecord> Find(int64_t begin, int64_t end) const;
+
+  std::span<const ImageRange> Extents(const ClipRecord& clip) const {
+    return extents_.subspan(clip.first_extent, clip.extent_count);
+  }
+
+  absl::string_view String(uint32_t index) const;
+
+  // Path of `clip` relative to the root of the file system.
+  std::string Path(const ClipRecord& clip) const;
+
+ private:
+  const ClipIndexHeader& Header() const {
+    return *reinterpret_cast<const ClipIndexHeader*>(data_);
+  }
+
+  const char* data_;
+  uint64_t size_;
+  std::span<const ClipRecord> clips_;
+  std::span<const ImageRange> extents_;
+  std::span<const uint64_t> string_offsets_;
+  const char* strings_;
+};
+
+// Formats `clip` as a JSON object on a single line, without the newline.
+std::string FormatClipJson(const ClipIndex& index, const ClipRecord& clip);
+
+// Maps the index file at `path`. Returns nullptr if it cannot be read or
+// is not a valid index.
+std::unique_ptr<ClipIndex> OpenClipIndex(const std::string& path);
+
+}  // namespace fat32
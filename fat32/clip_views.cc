@@ -0,0 +1,242 @@
+#include "clip_views.h"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/strip.h"
+#include "clip_index.h"
+#include "spdlog/spdlog.h"
+#include "tree_diff.h"
+
+namespace fat32 {
+
+namespace {
+
+// The view directories of a clip named like 2024-04-19_08-46-12-front.mp4.
+std::string ByTimePath(absl::string_view name) {
+  return absl::StrCat(kClipsByTime, "/", name.substr(0, 10), "/",
+                      name.substr(11, 5));
+}
+
+std::string ByCameraPath(absl::string_view camera) {
+  return absl::StrCat(kClipsByCamera, "/", camera);
+}
+
+}  // namespace
+
+const ClipViewDirectory *ClipViews::FindDirectory(
+    absl::string_view path) const {
+  const auto it = directories_.find(path);
+  return it == directories_.end() ? nullptr : it->second.get();
+}
+
+const ClipViewFile *ClipViews::FindFile(absl::string_view path) const {
+  const size_t slash = path.rfind('/');
+  if (slash == absl::string_view::npos) {
+    return nullptr;
+  }
+  const ClipViewDirectory *directory = FindDirectory(path.substr(0, slash));
+  if (directory == nullptr) {
+    return nullptr;
+  }
+  const absl::string_view name = path.substr(slash + 1);
+  const auto it = std::lower_bound(
+      directory->files.begin(), directory->files.end(), name,
+      [](const ClipViewFile &file, absl::string_view name) {
+        return file.name < name;
+      });
+  return it != directory->files.end() && it->name == name ? &*it : nullptr;
+}
+
+bool IsClipViewPath(absl::string_view path) {
+  for (const absl::string_view view : {kClipsByTime, kClipsByCamera}) {
+    if (absl::StartsWith(path, view) &&
+        (path.size() == view.size() || path[view.size()] == '/')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+ClipViewsBuilder::ClipViewsBuilder(std::string root)
+    : root_(std::move(root)) {
+  Reset();
+}
+
+std::shared_ptr<const ClipViews> ClipViewsBuilder::Update(
+    const FileSystem &fs) {
+  auto views = std::make_shared<ClipViews>();
+  TreeSnapshot snapshot;
+  size_t listed = 0;
+  if (fs.Snapshot(root_, &snapshot)) {
+    views->generation_ = snapshot.generation;
+    absl::flat_hash_map<std::string, ClipDirectory> clip_directories;
+    for (const auto &[path, directory] : snapshot.directories) {
+      const auto it = clip_directories_.find(path);
+      if (it != clip_directories_.end()) {
+        if (it->second.directory == directory) {
+          clip_directories.emplace(path, std::move(it->second));
+          clip_directories_.erase(it);
+          continue;
+        }
+        for (const Clip &clip : it->second.clips) {
+          RemoveClip(path, clip);
+        }
+        clip_directories_.erase(it);
+      }
+
+      listed++;
+      ClipDirectory clips{directory, {}};
+      for (const DirectoryEntry &entry : directory->Entries()) {
+        ClipName name;
+        if (entry.IsDirectory() || !ParseClipName(entry.name, &name)) {
+          continue;
+        }
+        Clip clip{entry.name, std::move(name.camera)};
+        AddClip(path, entry, clip);
+        clips.clips.push_back(std::move(clip));
+      }
+      clip_directories.emplace(path, std::move(clips));
+    }
+    // What is left is gone from the file system.
+    for (const auto &[path, directory] : clip_directories_) {
+      for (const Clip &clip : directory.clips) {
+        RemoveClip(path, clip);
+      }
+    }
+    clip_directories_ = std::move(clip_directories);
+  } else {
+    spdlog::debug("no clips in {}", root_);
+    views->generation_ = fs.Generation();
+    Reset();
+  }
+
+  const size_t built = changed_.size();
+  while (!changed_.empty()) {
+    // Last in order, so that subdirectories come before their parent,
+    // which they may change.
+    const auto last = std::prev(changed_.end());
+    const std::string path = *last;
+    changed_.erase(last);
+    BuildDirectory(path);
+  }
+  views->directories_ = directories_;
+  spdlog::debug(
+      "clip views: listed {} of {} directories, built {} of {} views",
+      listed, clip_directories_.size(), built, directories_.size());
+  return views;
+}
+
+void ClipViewsBuilder::Reset() {
+  clip_directories_.clear();
+  files_.clear();
+  subdirectories_.clear();
+  changed_.clear();
+  directories_.clear();
+  for (const char *view : {kClipsByTime, kClipsByCamera}) {
+    subdirectories_[view];
+    changed_.insert(view);
+  }
+}
+
+void ClipViewsBuilder::AddClip(const std::string &path,
+                               const DirectoryEntry &entry,
+                               const Clip &clip) {
+  const std::string file_path = absl::StrCat(path, "/", clip.name);
+  AddFile(ByTimePath(clip.name),
+          {absl::StrCat(clip.camera, ".mp4"), file_path, entry});
+  AddFile(ByCameraPath(clip.camera), {clip.name, file_path, entry});
+}
+
+void ClipViewsBuilder::RemoveClip(const std::string &path, const Clip &clip) {
+  const std::string file_path = absl::StrCat(path, "/", clip.name);
+  RemoveFile(ByTimePath(clip.name), file_path);
+  RemoveFile(ByCameraPath(clip.camera), file_path);
+}
+
+void ClipViewsBuilder::AddFile(const std::string &directory,
+                               ClipViewFile file) {
+  const auto [it, inserted] = files_.try_emplace(directory);
+  std::string path = file.path;
+  it->second.insert_or_assign(std::move(path), std::move(file));
+  changed_.insert(directory);
+  if (inserted) {
+    AddSubdirectory(directory);
+  }
+}
+
+void ClipViewsBuilder::RemoveFile(const std::string &directory,
+                                  const std::string &path) {
+  const auto it = files_.find(directory);
+  if (it == files_.end()) {
+    return;
+  }
+  it->second.erase(path);
+  changed_.insert(directory);
+  if (it->second.empty()) {
+    files_.erase(it);
+    RemoveSubdirectory(directory);
+  }
+}
+
+void ClipViewsBuilder::AddSubdirectory(const std::string &path) {
+  const size_t slash = path.rfind('/');
+  const std::string parent = path.substr(0, slash);
+  if (subdirectories_.try_emplace(parent).second) {
+    AddSubdirectory(parent);
+  }
+  subdirectories_[parent].insert(path.substr(slash + 1));
+  changed_.insert(parent);
+}
+
+void ClipViewsBuilder::RemoveSubdirectory(const std::string &path) {
+  const size_t slash = path.rfind('/');
+  const std::string parent = path.substr(0, slash);
+  const auto it = subdirectories_.find(parent);
+  if (it == subdirectories_.end()) {
+    return;
+  }
+  it->second.erase(path.substr(slash + 1));
+  changed_.insert(parent);
+  // The views themselves stay when empty.
+  if (it->second.empty() && parent.find('/') != std::string::npos) {
+    subdirectories_.erase(it);
+    RemoveSubdirectory(parent);
+  }
+}
+
+void ClipViewsBuilder::BuildDirectory(const std::string &path) {
+  auto directory = std::make_shared<ClipViewDirectory>();
+  const auto files = files_.find(path);
+  const auto subdirectories = subdirectories_.find(path);
+  if (files != files_.end()) {
+    // Clips of the same name are suffixed -2, -3... in the order of their
+    // paths.
+    absl::flat_hash_set<std::string> taken;
+    for (const auto &[file_path, file] : files->second) {
+      ClipViewFile named = file;
+      const absl::string_view stem = absl::StripSuffix(file.name, ".mp4");
+      for (int n = 2; !taken.insert(named.name).second; n++) {
+        named.name = absl::StrCat(stem, "-", n, ".mp4");
+      }
+      directory->files.push_back(std::move(named));
+    }
+    std::sort(directory->files.begin(), directory->files.end(),
+              [](const ClipViewFile &a, const ClipViewFile &b) {
+                return a.name < b.name;
+              });
+  } else if (subdirectories != subdirectories_.end()) {
+    directory->directories.assign(subdirectories->second.begin(),
+                                  subdirectories->second.end());
+  } else {
+    directories_.erase(path);
+    return;
+  }
+  directories_[path] = std::move(directory);
+}
+
+}  // namespace fat32
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "fat32.h"
+
+namespace fat32 {
+
+// Names of the views in the root of the file system.
+inline constexpr char kClipsByTime[] = ".by-time";
+inline constexpr char kClipsByCamera[] = ".by-camera";
+
+// A file of a view, standing for a clip of the file system.
+struct ClipViewFile {
+  std::string name;
+  // Relative to the root of the file system.
+  std::string path;
+  DirectoryEntry entry;
+};
+
+// A directory of a view. Subdirectories are names, sorted, and files are
+// sorted by name.
+struct ClipViewDirectory {
+  std::vector<std::string> directories;
+  std::vector<ClipViewFile> files;
+};
+
+// Virtual directories grouping the clips found below a directory of the
+// file system, TeslaCam usually, so that they do not have to be matched by
+// name every time:
+//
+//   .by-time/2024-04-19/08-46/front.mp4
+//   .by-camera/front/2024-04-19_08-46-12-front.mp4
+//
+// Clips of the same minute and camera, or of the same name, from different
+// directories are told apart by a -2, -3... suffix, in the order of their
+// paths. Files only refer to the entries of the clips, nothing is copied.
+//
+// Views are built for one generation of the file system and never change,
+// so that readers may hold them across refreshes. Directories unchanged
+// between generations are shared.
+class ClipViews {
+ public:
+  uint64_t Generation() const { return generation_; }
+
+  // The directory of a view at `path`, such as ".by-time/2024-04-19", or
+  // nullptr.
+  const ClipViewDirectory* FindDirectory(absl::string_view path) const;
+
+  const ClipViewFile* FindFile(absl::string_view path) const;
+
+ private:
+  friend class ClipViewsBuilder;
+
+  uint64_t generation_ = 0;
+  absl::flat_hash_map<std::string, std::shared_ptr<const ClipViewDirectory>>
+      directories_;
+};
+
+// Whether `path` is in one of the views, or is one.
+bool IsClipViewPath(absl::string_view path);
+
+// Keeps the views of the clips below `root` up to date. Like
+// ClipIndexBuilder, only the directories of the file system that changed
+// since the last update, as told by their snapshots, are listed again, and
+// only the view directories holding their clips are built again.
+class ClipViewsBuilder {
+ public:
+  explicit ClipViewsBuilder(std::string root = "TeslaCam");
+
+  // Updates the views from the file system and returns them. The views are
+  // empty if the root cannot be read.
+  std::shared_ptr<const ClipViews> Update(const FileSystem& fs);
+
+ private:
+  // A clip of a directory of the file system.
+  struct Clip {
+    std::string name;
+    std::string camera;
+  };
+
+  struct ClipDirectory {
+    std::shared_ptr<const Directory> directory;
+    std::vector<Clip> clips;
+  };
+
+  void Reset();
+
+  // Adds or removes `clip` of the directory at `path` in the views.
+  void AddClip(const std::string& path, const DirectoryEntry& entry,
+               const Clip& clip);
+  void RemoveClip(const std::string& path, const Clip& clip);
+
+  // Adds or removes the file at `path` in the view directory `directory`,
+  // marking it as changed.
+  void AddFile(const std::string& directory, ClipViewFile file);
+  void RemoveFile(const std::string& directory, const std::string& path);
+
+  // Adds or removes the view directory at `path` in its parent, and the
+  // parent in its own once it has a first or no more subdirectory.
+  void AddSubdirectory(const std::string& path);
+  void RemoveSubdirectory(const std::string& path);
+
+  // Builds the view directory at `path` again, or drops it if empty.
+  void BuildDirectory(const std::string& path);
+
+  const std::string root_;
+  absl::flat_hash_map<std::string, ClipDirectory> clip_directories_;
+  // The clips of the view directories holding files, each with its name
+  // before any suffix, by path so that suffixes follow the order of the
+  // paths.
+  absl::flat_hash_map<std::string, std::map<std::string, ClipViewFile>>
+      files_;
+  // The subdirectories of the other view directories.
+  absl::flat_hash_map<std::string, std::set<std::string>> subdirectories_;
+  // Paths of the view directories to build again.
+  std::set<std::string> changed_;
+  absl::flat_hash_map<std::string, std::shared_ptr<const ClipViewDirectory>>
+      directories_;
+};
+
+}  // namespace fat32
@@ -0,0 +1,122 @@
+#include "cluster_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace fat32 {
+
+bool ClusterCache::Get(uint32_t cluster, char *out) {
+  std::lock_guard lock(mutex_);
+  const auto it = index_.find(cluster);
+  if (it == index_.end()) {
+    misses_++;
+    return false;
+  }
+  hits_++;
+  Lru &list = List(it->second->kind);
+  list.splice(list.begin(), list, it->second);
+  memcpy(out, it->second->data.get(), it->second->size);
+  return true;
+}
+
+void ClusterCache::Put(uint32_t cluster, ClusterKind kind, const char *data,
+                       uint32_t size) {
+  if (size > capacity_) {
+    return;
+  }
+
+  std::lock_guard lock(mutex_);
+  const auto it = index_.find(cluster);
+  if (it != index_.end()) {
+    EraseLocked(it);
+  }
+
+  if (kind == ClusterKind::kData && metadata_size_ + size > capacity_) {
+    return;
+  }
+
+  while (size_ + size > capacity_) {
+    Lru &victims = data_.empty() ? metadata_ : data_;
+    EraseLocked(index_.find(victims.back().cluster));
+    evictions_++;
+  }
+
+  Lru &list = List(kind);
+  list.push_front({cluster, kind, std::make_unique<char[]>(size), size});
+  memcpy(list.front().data.get(), data, size);
+  index_.emplace(cluster, list.begin());
+  size_ += size;
+  if (kind == ClusterKind::kMetadata) {
+    metadata_size_ += size;
+  }
+}
+
+void ClusterCache::Erase(const std::vector<ClusterRange> &ranges) {
+  if (ranges.empty()) {
+    return;
+  }
+  std::lock_guard lock(mutex_);
+  for (const ClusterRange &range : ranges) {
+    if (range.end - range.begin > index_.size()) {
+      absl::erase_if(index_, [this, &range](const auto &item) {
+        if (item.first < range.begin || item.first >= range.end) {
+          return false;
+        }
+        Unlink(item.second);
+        return true;
+      });
+      continue;
+    }
+    for (uint32_t cluster = range.begin; cluster < range.end; cluster++) {
+      const auto it = index_.find(cluster);
+      if (it != index_.end()) {
+        EraseLocked(it);
+      }
+    }
+  }
+}
+
+void ClusterCache::EraseData() {
+  std::lock_guard lock(mutex_);
+  for (const Node &node : data_) {
+    index_.erase(node.cluster);
+    size_ -= node.size;
+  }
+  data_.clear();
+}
+
+void ClusterCache::Clear() {
+  std::lock_guard lock(mutex_);
+  metadata_.clear();
+  data_.clear();
+  index_.clear();
+  size_ = 0;
+  metadata_size_ = 0;
+}
+
+ClusterCacheStats ClusterCache::Stats() const {
+  std::lock_guard lock(mutex_);
+  ClusterCacheStats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.evictions = evictions_;
+  stats.size = size_;
+  stats.capacity = capacity_;
+  return stats;
+}
+
+void ClusterCache::EraseLocked(
+    absl::flat_hash_map<uint32_t, Lru::iterator>::iterator it) {
+  Unlink(it->second);
+  index_.erase(it);
+}
+
+void ClusterCache::Unlink(Lru::iterator node) {
+  size_ -= node->size;
+  if (node->kind == ClusterKind::kMetadata) {
+    metadata_size_ -= node->size;
+  }
+  List(node->kind).erase(node);
+}
+
+}  // namespace fat32
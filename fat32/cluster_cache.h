@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "file_allocation_table.h"
+
+namespace fat32 {
+
+enum class ClusterKind {
+  kMetadata,  // directory clusters
+  kData,      // file clusters
+};
+
+struct ClusterCacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  uint64_t size = 0;  // in bytes
+  uint64_t capacity = 0;
+};
+
+// A LRU cache of cluster contents with a strict memory budget.
+//
+// Metadata clusters are preferred: data clusters are evicted first, and a
+// data cluster is never cached at the expense of a metadata one. Safe to
+// use concurrently.
+class ClusterCache {
+ public:
+  // `capacity` is in bytes, 0 disables the cache.
+  explicit ClusterCache(uint64_t capacity) : capacity_(capacity) {}
+
+  bool Enabled() const { return capacity_ > 0; }
+
+  // Copies the cached `cluster` into `out`, which must hold a cluster.
+  bool Get(uint32_t cluster, char* out);
+
+  void Put(uint32_t cluster, ClusterKind kind, const char* data,
+           uint32_t size);
+
+  // Drops the clusters in `ranges`.
+  void Erase(const std::vector<ClusterRange>& ranges);
+
+  // Drops all the data clusters.
+  void EraseData();
+
+  void Clear();
+
+  ClusterCacheStats Stats() const;
+
+ private:
+  struct Node {
+    uint32_t cluster;
+    ClusterKind kind;
+    std::unique_ptr<char[]> data;
+    uint32_t size;
+  };
+  using Lru = std::list<Node>;  // most recently used first
+
+  Lru& List(ClusterKind kind) {
+    return kind == ClusterKind::kMetadata ? metadata_ : data_;
+  }
+
+  void EraseLocked(absl::flat_hash_map<uint32_t, Lru::iterator>::iterator it);
+
+  // Removes `node` from its list, but not from the index.
+  void Unlink(Lru::iterator node);
+
+  const uint64_t capacity_;
+
+  mutable std::mutex mutex_;
+  // Guarded by mutex_.
+  Lru metadata_;
+  Lru data_;
+  absl::flat_hash_map<uint32_t, Lru::iterator> index_;
+  uint64_t size_ = 0;
+  uint64_t metadata_size_ = 0;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+  uint64_t evictions_ = 0;
+};
+
+}  // namespace fat32
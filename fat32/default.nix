@@ -6,6 +6,7 @@
 , argparse
 , abseil-cpp
 , fuse3
+, liburing
 , spdlog
 , pkg-config
 }:
@@ -26,6 +27,7 @@ llvmPackages_12.stdenv.mkDerivation rec {
     abseil-cpp
     argparse
     fuse3
+    liburing
     spdlog
   ];
 
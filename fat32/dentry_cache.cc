@@ -0,0 +1,179 @@
+#include "dentry_cache.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace fat32 {
+
+namespace {
+
+size_t Depth(absl::string_view path) {
+  return path.empty() ? 0 : std::count(path.begin(), path.end(), '/') + 1;
+}
+
+absl::string_view Parent(absl::string_view path) {
+  const auto pos = path.find_last_of('/');
+  return pos != absl::string_view::npos ? path.substr(0, pos) : "";
+}
+
+}  // namespace
+
+Directory::Directory(std::vector<DirectoryEntry> entries,
+                     uint32_t first_cluster, std::vector<Extent> extents,
+                     size_t checksum)
+    : entries_(std::move(entries)),
+      first_cluster_(first_cluster),
+      extents_(std::move(extents)),
+      checksum_(checksum) {
+  index_.reserve(entries_.size());
+  for (size_t i = 0; i < entries_.size(); i++) {
+    // Keep the first one if a corrupted directory has duplicated names.
+    index_.emplace(entries_[i].name, i);
+  }
+}
+
+const DirectoryEntry *Directory::Find(absl::string_view name) const {
+  const auto it = index_.find(name);
+  if (it == index_.end()) {
+    return nullptr;
+  }
+  return &entries_[it->second];
+}
+
+std::shared_ptr<const Directory> DentryCache::GetDirectory(
+    absl::string_view path) const {
+  std::lock_guard lock(mutex_);
+  const auto it = directories_.find(path);
+  if (it == directories_.end()) {
+    return nullptr;
+  }
+  std::shared_ptr<const Directory> directory = it->second.directory;
+  TouchLocked(path);
+  return directory;
+}
+
+void DentryCache::PutDirectory(absl::string_view path,
+                               std::shared_ptr<const Directory> directory) {
+  std::lock_guard lock(mutex_);
+  directories_.insert_or_assign(std::string(path),
+                                CachedDirectory{std::move(directory), 0});
+  TouchLocked(path);
+  if (directories_.size() > max_directories_) {
+    EvictLocked();
+  }
+}
+
+void DentryCache::TouchLocked(absl::string_view path) const {
+  const uint64_t now = ++clock_;
+  while (true) {
+    const auto it = directories_.find(path);
+    if (it != directories_.end()) {
+      it->second.last_use = now;
+    }
+    if (path.empty()) {
+      return;
+    }
+    path = Parent(path);
+  }
+}
+
+void DentryCache::EvictLocked() {
+  // Oldest first and, as parents are used whenever their subdirectories
+  // are, deepest first among those used at the same time.
+  std::vector<std::pair<uint64_t, const std::string *>> candidates;
+  candidates.reserve(directories_.size());
+  for (const auto &[path, cached] : directories_) {
+    if (!path.empty()) {
+      candidates.emplace_back(cached.last_use, &path);
+    }
+  }
+  std::sort(candidates.begin(), candidates.end(),
+            [](const auto &a, const auto &b) {
+              return a.first != b.first
+                         ? a.first < b.first
+                         : Depth(*a.second) > Depth(*b.second);
+            });
+
+  const size_t target = max_directories_ - max_directories_ / 8;
+  absl::flat_hash_set<std::string> evicted;
+  for (const auto &[last_use, path] : candidates) {
+    if (directories_.size() - evicted.size() <= target) {
+      break;
+    }
+    evicted.insert(*path);
+  }
+  for (const std::string &path : evicted) {
+    directories_.erase(path);
+  }
+  EraseEntriesLocked(evicted);
+}
+
+bool DentryCache::GetEntry(absl::string_view path,
+                           DirectoryEntry *entry) const {
+  std::lock_guard lock(mutex_);
+  const auto it = entries_.find(path);
+  if (it == entries_.end()) {
+    return false;
+  }
+  *entry = it->second;
+  return true;
+}
+
+void DentryCache::PutEntry(absl::string_view path,
+                           const DirectoryEntry &entry) {
+  std::lock_guard lock(mutex_);
+  entries_.insert_or_assign(std::string(path), entry);
+}
+
+std::vector<std::pair<std::string, std::shared_ptr<const Directory>>>
+DentryCache::Directories() const {
+  std::vector<std::pair<std::string, std::shared_ptr<const Directory>>>
+      directories;
+  {
+    std::lock_guard lock(mutex_);
+    directories.reserve(directories_.size());
+    for (const auto &[path, cached] : directories_) {
+      directories.emplace_back(path, cached.directory);
+    }
+  }
+  std::sort(directories.begin(), directories.end(),
+            [](const auto &a, const auto &b) {
+              const size_t depth_a = Depth(a.first);
+              const size_t depth_b = Depth(b.first);
+              return depth_a != depth_b ? depth_a < depth_b
+                                        : a.first < b.first;
+            });
+  return directories;
+}
+
+void DentryCache::EraseDirectory(absl::string_view path) {
+  std::lock_guard lock(mutex_);
+  const auto it = directories_.find(path);
+  if (it != directories_.end()) {
+    directories_.erase(it);
+  }
+}
+
+void DentryCache::EraseEntries(
+    const absl::flat_hash_set<std::string> &parents) {
+  std::lock_guard lock(mutex_);
+  EraseEntriesLocked(parents);
+}
+
+void DentryCache::EraseEntriesLocked(
+    const absl::flat_hash_set<std::string> &parents) {
+  if (parents.empty()) {
+    return;
+  }
+  absl::erase_if(entries_, [&parents](const auto &item) {
+    return parents.contains(Parent(item.first));
+  });
+}
+
+void DentryCache::Clear() {
+  std::lock_guard lock(mutex_);
+  directories_.clear();
+  entries_.clear();
+}
+
+}  // namespace fat32
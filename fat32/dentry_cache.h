@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/string_view.h"
+#include "file_allocation_table.h"
+#include "types.h"
+
+namespace fat32 {
+
+// The parsed entries of a directory, indexed by name.
+//
+// The directory also remembers where it was read from and a checksum of
+// its raw content, so that a refresh can tell whether it has to be parsed
+// again.
+class Directory {
+ public:
+  Directory(std::vector<DirectoryEntry> entries, uint32_t first_cluster,
+            std::vector<Extent> extents, size_t checksum);
+
+  const std::vector<DirectoryEntry>& Entries() const { return entries_; }
+
+  const DirectoryEntry* Find(absl::string_view name) const;
+
+  uint32_t FirstCluster() const { return first_cluster_; }
+
+  const std::vector<Extent>& Extents() const { return extents_; }
+
+  size_t Checksum() const { return checksum_; }
+
+ private:
+  std::vector<DirectoryEntry> entries_;
+  absl::flat_hash_map<std::string, size_t> index_;
+  uint32_t first_cluster_;
+  std::vector<Extent> extents_;
+  size_t checksum_;
+};
+
+// Maps full paths, relative to the root, to parsed directories and to
+// directory entries, so that resolving a path already seen costs a hash
+// lookup and no I/O. Safe to use concurrently.
+//
+// A refresh reads every cached directory again, so the number of
+// directories is bounded: past the limit, the least recently used ones are
+// dropped with their entries. Using a directory counts as using its
+// parents, so a directory is never dropped before its subdirectories, and
+// the root is never dropped.
+class DentryCache {
+ public:
+  static constexpr size_t kDefaultMaxDirectories = 1024;
+
+  explicit DentryCache(size_t max_directories = kDefaultMaxDirectories)
+      : max_directories_(max_directories) {}
+
+  std::shared_ptr<const Directory> GetDirectory(absl::string_view path) const;
+
+  void PutDirectory(absl::string_view path,
+                    std::shared_ptr<const Directory> directory);
+
+  bool GetEntry(absl::string_view path, DirectoryEntry* entry) const;
+
+  void PutEntry(absl::string_view path, const DirectoryEntry& entry);
+
+  // Returns all cached directories, parents before their children.
+  std::vector<std::pair<std::string, std::shared_ptr<const Directory>>>
+  Directories() const;
+
+  void EraseDirectory(absl::string_view path);
+
+  // Drops the cached entries whose parent directory is in `parents`.
+  void EraseEntries(const absl::flat_hash_set<std::string>& parents);
+
+  void Clear();
+
+ private:
+  struct CachedDirectory {
+    std::shared_ptr<const Directory> directory;
+    uint64_t last_use;
+  };
+
+  // Marks the directory at `path` and its parents as used.
+  void TouchLocked(absl::string_view path) const;
+
+  // Drops the least recently used directories, and their entries, down to
+  // 7/8 of the limit so that this is not done on every insertion.
+  void EvictLocked();
+
+  void EraseEntriesLocked(const absl::flat_hash_set<std::string>& parents);
+
+  const size_t max_directories_;
+  mutable std::mutex mutex_;
+  mutable absl::flat_hash_map<std::string, CachedDirectory> directories_;
+  mutable uint64_t clock_ = 0;
+  absl::flat_hash_map<std::string, DirectoryEntry> entries_;
+};
+
+}  // namespace fat32
@@ -0,0 +1,510 @@
+#include "directory_parser.h"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "absl/strings/str_cat.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace fat32 {
+
+namespace {
+
+constexpr uint8_t kFreeEntryIndicator = 0xE5;
+constexpr uint8_t kEndOfEntriesIndicator = 0x00;
+constexpr uint8_t kAttrLongName = 0x0F;  // read only, hidden, system, volume
+constexpr uint8_t kAttrLongNameMask = 0x3F;
+// Offset of the attributes in an entry.
+constexpr uint64_t kAttrOffset = 11;
+// Entries classified at once, a 512 bytes sector.
+constexpr uint64_t kBlockEntries = 16;
+
+// Kinds of the entries of a block, bit i for entry i.
+struct EntryMasks {
+  uint32_t end = 0;
+  uint32_t free = 0;
+  uint32_t long_name = 0;
+};
+
+EntryMasks ClassifyEntries(const uint8_t *data, uint64_t count) {
+  EntryMasks masks;
+  for (uint64_t i = 0; i < count; i++) {
+    const uint8_t *entry = data + i * kDirectoryEntrySize;
+    masks.end |= (entry[0] == kEndOfEntriesIndicator) << i;
+    masks.free |= (entry[0] == kFreeEntryIndicator) << i;
+    masks.long_name |=
+        ((entry[kAttrOffset] & kAttrLongNameMask) == kAttrLongName) << i;
+  }
+  return masks;
+}
+
+#if defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+
+#if defined(__SSE2__)
+using Vec = __m128i;
+Vec Load(const uint8_t *p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
+Vec ZipLo8(Vec a, Vec b) { return _mm_unpacklo_epi8(a, b); }
+Vec ZipHi8(Vec a, Vec b) { return _mm_unpackhi_epi8(a, b); }
+Vec ZipLo16(Vec a, Vec b) { return _mm_unpacklo_epi16(a, b); }
+Vec ZipLo32(Vec a, Vec b) { return _mm_unpacklo_epi32(a, b); }
+Vec ZipHi32(Vec a, Vec b) { return _mm_unpackhi_epi32(a, b); }
+Vec ZipLo64(Vec a, Vec b) { return _mm_unpacklo_epi64(a, b); }
+Vec ZipHi64(Vec a, Vec b) { return _mm_unpackhi_epi64(a, b); }
+Vec And(Vec a, uint8_t b) { return _mm_and_si128(a, _mm_set1_epi8(b)); }
+uint32_t MaskEq(Vec a, uint8_t b) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_set1_epi8(b)));
+}
+#else
+using Vec = uint8x16_t;
+Vec Load(const uint8_t *p) { return vld1q_u8(p); }
+Vec ZipLo8(Vec a, Vec b) { return vzip1q_u8(a, b); }
+Vec ZipHi8(Vec a, Vec b) { return vzip2q_u8(a, b); }
+Vec ZipLo16(Vec a, Vec b) {
+  return vreinterpretq_u8_u16(
+      vzip1q_u16(vreinterpretq_u16_u8(a), vreinterpretq_u16_u8(b)));
+}
+Vec ZipLo32(Vec a, Vec b) {
+  return vreinterpretq_u8_u32(
+      vzip1q_u32(vreinterpretq_u32_u8(a), vreinterpretq_u32_u8(b)));
+}
+Vec ZipHi32(Vec a, Vec b) {
+  return vreinterpretq_u8_u32(
+      vzip2q_u32(vreinterpretq_u32_u8(a), vreinterpretq_u32_u8(b)));
+}
+Vec ZipLo64(Vec a, Vec b) {
+  return vreinterpretq_u8_u64(
+      vzip1q_u64(vreinterpretq_u64_u8(a), vreinterpretq_u64_u8(b)));
+}
+Vec ZipHi64(Vec a, Vec b) {
+  return vreinterpretq_u8_u64(
+      vzip2q_u64(vreinterpretq_u64_u8(a), vreinterpretq_u64_u8(b)));
+}
+Vec And(Vec a, uint8_t b) { return vandq_u8(a, vdupq_n_u8(b)); }
+uint32_t MaskEq(Vec a, uint8_t b) {
+  // No movemask on NEON, weight each lane by its bit and add them up.
+  static const uint8_t kWeights[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                       1, 2, 4, 8, 16, 32, 64, 128};
+  const Vec bits = vandq_u8(vceqq_u8(a, vdupq_n_u8(b)), vld1q_u8(kWeights));
+  return vaddv_u8(vget_low_u8(bits)) |
+         (static_cast<uint32_t>(vaddv_u8(vget_high_u8(bits))) << 8);
+}
+#endif
+
+// Classifies a whole block. The first 16 bytes of the 16 entries are
+// transposed, so that the first bytes and the attributes of all entries
+// are compared at once.
+EntryMasks ClassifyBlock(const uint8_t *data) {
+  Vec v[kBlockEntries];
+  for (uint64_t i = 0; i < kBlockEntries; i++) {
+    v[i] = Load(data + i * kDirectoryEntrySize);
+  }
+
+  // Byte 0 (first byte) is in the low half, byte 11 (attributes) in the
+  // high half. Interleave pairs, then quads, then octets of entries.
+  Vec lo8[8];
+  Vec hi8[8];
+  for (int i = 0; i < 8; i++) {
+    lo8[i] = ZipLo8(v[2 * i], v[2 * i + 1]);
+    hi8[i] = ZipHi8(v[2 * i], v[2 * i + 1]);
+  }
+  // Lane 0 of lo16 holds byte 0, lane 3 of hi16 byte 11, of 4 entries.
+  Vec lo16[4];
+  Vec hi16[4];
+  for (int i = 0; i < 4; i++) {
+    lo16[i] = ZipLo16(lo8[2 * i], lo8[2 * i + 1]);
+    hi16[i] = ZipLo16(hi8[2 * i], hi8[2 * i + 1]);
+  }
+  // Lane 0 of lo32 holds byte 0, lane 1 of hi32 byte 11, of 8 entries.
+  const Vec lo32[2] = {ZipLo32(lo16[0], lo16[1]), ZipLo32(lo16[2], lo16[3])};
+  const Vec hi32[2] = {ZipHi32(hi16[0], hi16[1]), ZipHi32(hi16[2], hi16[3])};
+  const Vec first = ZipLo64(lo32[0], lo32[1]);
+  const Vec attributes = ZipHi64(hi32[0], hi32[1]);
+
+  EntryMasks masks;
+  masks.end = MaskEq(first, kEndOfEntriesIndicator);
+  masks.free = MaskEq(first, kFreeEntryIndicator);
+  masks.long_name = MaskEq(And(attributes, kAttrLongNameMask), kAttrLongName);
+  return masks;
+}
+
+#else
+
+EntryMasks ClassifyBlock(const uint8_t *data) {
+  return ClassifyEntries(data, kBlockEntries);
+}
+
+#endif
+
+uint16_t Load16(const uint8_t *p) {
+  uint16_t value;
+  memcpy(&value, p, sizeof(value));
+  return le16toh(value);
+}
+
+uint32_t Load32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return le32toh(value);
+}
+
+void Store16(uint16_t value, char *p) {
+  value = htole16(value);
+  memcpy(p, &value, sizeof(value));
+}
+
+void Store32(uint32_t value, char *p) {
+  value = htole32(value);
+  memcpy(p, &value, sizeof(value));
+}
+
+// Characters of the short names made here. The code page dependent ones
+// are left out, they are kept in the long filename.
+bool IsShortNameCharacter(char c) {
+  return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+         absl::string_view("!#$%&'()-@^_`{}~").find(c) !=
+             absl::string_view::npos;
+}
+
+uint8_t ShortNameChecksum(const char *short_name) {
+  uint8_t sum = 0;
+  for (int i = 0; i < 11; i++) {
+    sum = ((sum & 1) << 7) + (sum >> 1) + static_cast<uint8_t>(short_name[i]);
+  }
+  return sum;
+}
+
+// Appends the UTF-16 code units of the name in a long filename entry. Each
+// of the three parts of the name stops at a 0x0000 or 0xFFFF terminator.
+void AppendLongFilename(const uint8_t *entry, std::u16string *units) {
+  static constexpr uint8_t kParts[][2] = {{1, 5}, {14, 6}, {28, 2}};
+  for (const auto &[offset, length] : kParts) {
+    for (int i = 0; i < length; i++) {
+      const char16_t c = Load16(entry + offset + 2 * i);
+      if (c == 0x0000 || c == 0xFFFF) {
+        break;
+      }
+      units->push_back(c);
+    }
+  }
+}
+
+void AppendUtf8(uint32_t code_point, std::string *out) {
+  if (code_point < 0x80) {
+    out->push_back(static_cast<char>(code_point));
+  } else if (code_point < 0x800) {
+    out->push_back(static_cast<char>(0xC0 | (code_point >> 6)));
+    out->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  } else if (code_point < 0x10000) {
+    out->push_back(static_cast<char>(0xE0 | (code_point >> 12)));
+    out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+    out->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  } else {
+    out->push_back(static_cast<char>(0xF0 | (code_point >> 18)));
+    out->push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3F)));
+    out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+    out->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  }
+}
+
+// Appends UTF-16 `units` to `out` as UTF-8. Unpaired surrogates become
+// U+FFFD.
+void AppendUtf16AsUtf8(std::u16string_view units, std::string *out) {
+  for (size_t i = 0; i < units.size(); i++) {
+    uint32_t c = units[i];
+    if (c < 0x80) {
+      out->push_back(static_cast<char>(c));
+      continue;
+    }
+    if (c >= 0xD800 && c <= 0xDFFF) {
+      if (c <= 0xDBFF && i + 1 < units.size() && units[i + 1] >= 0xDC00 &&
+          units[i + 1] <= 0xDFFF) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (units[i + 1] - 0xDC00);
+        i++;
+      } else {
+        c = 0xFFFD;
+      }
+    }
+    AppendUtf8(c, out);
+  }
+}
+
+// Returns `name`, valid UTF-8, as UTF-16.
+std::u16string ToUtf16(absl::string_view name) {
+  std::u16string units;
+  units.reserve(name.size());
+  while (!name.empty()) {
+    uint32_t c;
+    size_t size = DecodeUtf8(name, &c);
+    if (size == 0) {
+      c = 0xFFFD;
+      size = 1;
+    }
+    if (c >= 0x10000) {
+      units.push_back(static_cast<char16_t>(0xD800 + ((c - 0x10000) >> 10)));
+      units.push_back(static_cast<char16_t>(0xDC00 + ((c - 0x10000) & 0x3FF)));
+    } else {
+      units.push_back(static_cast<char16_t>(c));
+    }
+    name.remove_prefix(size);
+  }
+  return units;
+}
+
+void DecodeEntry(const uint8_t *data, DirectoryEntry *entry) {
+  memcpy(entry->filename, data, 11);
+  entry->filename[11] = '\0';
+  entry->attributes = data[11];
+  // data[12] is DIR_NTRes, reserved.
+  entry->creationTimeHS = data[13];
+  entry->creationTime = Load16(data + 14);
+  entry->creationDate = Load16(data + 16);
+  entry->lastAccessedDate = Load16(data + 18);
+  entry->firstClusterHigh = Load16(data + 20);
+  entry->lastModificationTime = Load16(data + 22);
+  entry->lastModificationDate = Load16(data + 24);
+  entry->firstClusterLow = Load16(data + 26);
+  entry->size = Load32(data + 28);
+}
+
+}  // namespace
+
+void ParseDirectory(const char *data, uint64_t size,
+                    std::vector<DirectoryEntry> *entries) {
+  const auto *bytes = reinterpret_cast<const uint8_t *>(data);
+  const uint64_t count = size / kDirectoryEntrySize;
+
+  // The entries holding the pending long filename, in on-disk order, which
+  // is the reverse of the name order.
+  std::vector<const uint8_t *> long_name_entries;
+  std::u16string units;
+
+  for (uint64_t block = 0; block < count; block += kBlockEntries) {
+    const uint64_t n = std::min(kBlockEntries, count - block);
+    const uint8_t *block_data = bytes + block * kDirectoryEntrySize;
+    const EntryMasks masks = n == kBlockEntries
+                                 ? ClassifyBlock(block_data)
+                                 : ClassifyEntries(block_data, n);
+
+    uint32_t live = ~masks.free & ((1u << n) - 1);
+    if (masks.end != 0) {
+      live &= (1u << __builtin_ctz(masks.end)) - 1;
+    }
+    while (live != 0) {
+      const int i = __builtin_ctz(live);
+      live &= live - 1;
+      const uint8_t *entry = block_data + i * kDirectoryEntrySize;
+
+      if ((masks.long_name >> i) & 1) {
+        if ((entry[0] & 0x40) != 0) {
+          // There may be multiple "last" long entries, which should be
+          // dropped except the last one.
+          long_name_entries.clear();
+        }
+        long_name_entries.push_back(entry);
+        continue;
+      }
+
+      DirectoryEntry &result = entries->emplace_back();
+      DecodeEntry(entry, &result);
+      result.location = entry - bytes;
+      if (!long_name_entries.empty()) {
+        units.clear();
+        for (auto it = long_name_entries.crbegin();
+             it != long_name_entries.crend(); ++it) {
+          AppendLongFilename(*it, &units);
+        }
+        result.longFilename.reserve(units.size());
+        AppendUtf16AsUtf8(units, &result.longFilename);
+        long_name_entries.clear();
+      }
+
+      const std::string_view name = !result.longFilename.empty()
+                                        ? std::string_view(result.longFilename)
+                                        : std::string_view(result.filename);
+      // Drop the trailing spaces of short names.
+      const auto end =
+          std::find_if(name.rbegin(), name.rend(),
+                       [](unsigned char c) { return !std::isspace(c); })
+              .base();
+      result.name.assign(name.begin(), end);
+    }
+
+    if (masks.end != 0) {
+      return;
+    }
+  }
+}
+
+void EncodeDirectoryEntry(const DirectoryEntry &entry, char *out) {
+  memcpy(out, entry.filename, 11);
+  out[11] = entry.attributes;
+  out[12] = 0;  // DIR_NTRes, reserved.
+  out[13] = entry.creationTimeHS;
+  Store16(entry.creationTime, out + 14);
+  Store16(entry.creationDate, out + 16);
+  Store16(entry.lastAccessedDate, out + 18);
+  Store16(entry.firstClusterHigh, out + 20);
+  Store16(entry.lastModificationTime, out + 22);
+  Store16(entry.lastModificationDate, out + 24);
+  Store16(entry.firstClusterLow, out + 26);
+  Store32(entry.size, out + 28);
+}
+
+size_t DecodeUtf8(absl::string_view s, uint32_t *code_point) {
+  if (s.empty()) {
+    return 0;
+  }
+  const auto lead = static_cast<uint8_t>(s[0]);
+  size_t size;
+  uint32_t c;
+  uint32_t min;
+  if (lead < 0x80) {
+    *code_point = lead;
+    return 1;
+  } else if ((lead & 0xE0) == 0xC0) {
+    size = 2;
+    c = lead & 0x1F;
+    min = 0x80;
+  } else if ((lead & 0xF0) == 0xE0) {
+    size = 3;
+    c = lead & 0x0F;
+    min = 0x800;
+  } else if ((lead & 0xF8) == 0xF0) {
+    size = 4;
+    c = lead & 0x07;
+    min = 0x10000;
+  } else {
+    return 0;
+  }
+  if (s.size() < size) {
+    return 0;
+  }
+  for (size_t i = 1; i < size; i++) {
+    const auto byte = static_cast<uint8_t>(s[i]);
+    if ((byte & 0xC0) != 0x80) {
+      return 0;
+    }
+    c = (c << 6) | (byte & 0x3F);
+  }
+  if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+    return 0;
+  }
+  *code_point = c;
+  return size;
+}
+
+bool IsValidLongFilename(absl::string_view name) {
+  // Covers "." and "..".
+  if (name.empty() || name.back() == '.' || name.back() == ' ') {
+    return false;
+  }
+  size_t units = 0;
+  while (!name.empty()) {
+    uint32_t c;
+    const size_t size = DecodeUtf8(name, &c);
+    if (size == 0 || c < 0x20 ||
+        (c < 0x80 && absl::string_view("\\/:*?\"<>|").find(
+                         static_cast<char>(c)) != absl::string_view::npos)) {
+      return false;
+    }
+    units += c >= 0x10000 ? 2 : 1;
+    name.remove_prefix(size);
+  }
+  return units <= 255;
+}
+
+bool MakeShortName(absl::string_view name, uint32_t n, char *short_name) {
+  memset(short_name, ' ', 11);
+  const size_t dot = name.find_last_of('.');
+  const absl::string_view base =
+      dot != absl::string_view::npos ? name.substr(0, dot) : name;
+  const absl::string_view extension =
+      dot != absl::string_view::npos ? name.substr(dot + 1)
+                                     : absl::string_view();
+
+  if (n == 0) {
+    if (base.empty() || base.size() > 8 || extension.size() > 3 ||
+        (dot != absl::string_view::npos && extension.empty()) ||
+        !std::all_of(base.begin(), base.end(), IsShortNameCharacter) ||
+        !std::all_of(extension.begin(), extension.end(),
+                     IsShortNameCharacter)) {
+      return false;
+    }
+    memcpy(short_name, base.data(), base.size());
+    memcpy(short_name + 8, extension.data(), extension.size());
+    return true;
+  }
+
+  // Upper case, without spaces and dots, and the other characters replaced
+  // by '_'.
+  auto basis = [](absl::string_view part, size_t max_size) {
+    std::string result;
+    for (char c : part) {
+      if (result.size() == max_size) {
+        break;
+      }
+      // One '_' for a character of several bytes.
+      if (c == ' ' || c == '.' || (static_cast<uint8_t>(c) & 0xC0) == 0x80) {
+        continue;
+      }
+      c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+      result.push_back(IsShortNameCharacter(c) ? c : '_');
+    }
+    return result;
+  };
+  const std::string tail = absl::StrCat("~", n);
+  std::string short_base = basis(base, 8 - tail.size());
+  if (short_base.empty()) {
+    short_base = "_";
+  }
+  absl::StrAppend(&short_base, tail);
+  const std::string short_extension = basis(extension, 3);
+  memcpy(short_name, short_base.data(), short_base.size());
+  memcpy(short_name + 8, short_extension.data(), short_extension.size());
+  return true;
+}
+
+std::string EncodeLongFilename(absl::string_view name,
+                               const char *short_name) {
+  static constexpr uint8_t kCharacterOffsets[13] = {1,  3,  5,  7,  9,  14, 16,
+                                                    18, 20, 22, 24, 28, 30};
+  const std::u16string units = ToUtf16(name);
+  const size_t count = (units.size() + 12) / 13;
+  const uint8_t checksum = ShortNameChecksum(short_name);
+
+  std::string entries(count * kDirectoryEntrySize, '\0');
+  for (size_t i = 0; i < count; i++) {
+    // The last part of the name comes first.
+    const size_t order = count - i;
+    char *entry = entries.data() + i * kDirectoryEntrySize;
+    entry[0] = static_cast<char>(order | (i == 0 ? 0x40 : 0));
+    entry[kAttrOffset] = kAttrLongName;
+    entry[13] = static_cast<char>(checksum);
+    for (size_t j = 0; j < 13; j++) {
+      const size_t pos = (order - 1) * 13 + j;
+      // The name is terminated by 0x0000 and padded with 0xFFFF.
+      uint16_t c = 0xFFFF;
+      if (pos < units.size()) {
+        c = units[pos];
+      } else if (pos == units.size()) {
+        c = 0;
+      }
+      Store16(c, entry + kCharacterOffsets[j]);
+    }
+  }
+  return entries;
+}
+
+}  // namespace fat32
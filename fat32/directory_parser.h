@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "types.h"
+
+namespace fat32 {
+
+// Size of a directory entry on disk.
+constexpr uint64_t kDirectoryEntrySize = 32;
+
+// Parses the raw content of a directory, its whole cluster chain read in
+// memory, so that long filename entries may span clusters. Free entries
+// are skipped and parsing stops at the end of directory marker. The
+// location of each entry is set to its offset in `data`.
+void ParseDirectory(const char* data, uint64_t size,
+                    std::vector<DirectoryEntry>* entries);
+
+// Encodes the short entry of `entry` into the kDirectoryEntrySize bytes at
+// `out`.
+void EncodeDirectoryEntry(const DirectoryEntry& entry, char* out);
+
+// Decodes the UTF-8 character at the start of `s` into `code_point`.
+// Returns its size in bytes, or 0 if it is not valid UTF-8: truncated,
+// overlong, a surrogate or past U+10FFFF.
+size_t DecodeUtf8(absl::string_view s, uint32_t* code_point);
+
+// Whether `name` may be stored as a long filename: valid UTF-8 of 1 to 255
+// UTF-16 code units, none of them below 0x20 nor one of
+// \ / : * ? " < > |, not ending with a dot or a space, and not "." or "..".
+bool IsValidLongFilename(absl::string_view name);
+
+// Sets the 11 characters `short_name` of `name`. With `n` 0, the short name
+// is `name` itself, and false is returned if it is not a valid short name.
+// Otherwise it is the basis name of `name` with the numeric tail `~n`.
+bool MakeShortName(absl::string_view name, uint32_t n, char* short_name);
+
+// Encodes the long filename entries of `name`, valid UTF-8, for the short
+// entry named `short_name`, in on-disk order. Long filenames are UTF-16 on
+// disk and UTF-8 once parsed.
+std::string EncodeLongFilename(absl::string_view name,
+                               const char* short_name);
+
+}  // namespace fat32
@@ -2,22 +2,45 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <ctime>
 #include <fstream>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/hash/hash.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/strip.h"
+#include "directory_parser.h"
 #include "spdlog/spdlog.h"
 
 namespace fat32 {
 
 namespace {
 
-// End Of Cluster Chain value
-constexpr uint32_t kEocc = 0x0FFFFFF8;
-// Bad Cluster value
-constexpr uint32_t kBadCluster = 0x0FFFFFF7;
+// Size of the buffer used to stream file data out of the image.
+constexpr uint64_t kReadChunkSize = 1 << 20;
+// The BPB and EBPB share the boot sector.
+constexpr uint64_t kBootSectorSize = 512;
+// Files up to this size, such as event.json and thumb.png, are read
+// through the cluster cache.
+constexpr uint32_t kMaxCachedFileSize = 256 << 10;
+// FSInfo signatures, and offsets of the fields updated after allocating.
+constexpr uint32_t kFsInfoLeadSignature = 0x41615252;
+constexpr uint32_t kFsInfoStructSignature = 0x61417272;
+constexpr uint64_t kFsInfoFreeClustersOffset = 488;
+constexpr uint64_t kFsInfoNextFreeOffset = 492;
+// A directory has at most 65536 entries.
+constexpr uint64_t kMaxDirectorySize = 65536 * kDirectoryEntrySize;
+constexpr uint8_t kAttrDirectory = 0x10;
+constexpr uint8_t kAttrArchive = 0x20;
+constexpr uint8_t kAttrLongName = 0x0F;
+constexpr char kFreeEntry = static_cast<char>(0xE5);
 
 uint32_t ComposeCluster(uint16_t clusterHigh, uint16_t clusterLow) {
   return (static_cast<uint32_t>(clusterHigh) << 16) |
@@ -96,15 +119,14 @@ void DebugPrintEBPBInfo(const ExtendedBiosParameterBlock &ebpb) {
 
 void DebugPrintFSInfo(const FileSystemInformation &fsInfo) {
   DebugPrintTitle("FSInfo");
-  constexpr uint32_t kLeadSignature = 0x41615252;
-  constexpr uint32_t kStructSignature = 0x61417272;
   constexpr uint32_t kTrailSignature = 0xAA550000;
-  spdlog::debug("Top signature {}", fsInfo.leadSignature == kLeadSignature
+  spdlog::debug("Top signature {}", fsInfo.leadSignature == kFsInfoLeadSignature
                                         ? "matches!"
                                         : "doesn't match!");
   spdlog::debug("Middle signature {}",
-                fsInfo.structSignature == kStructSignature ? "matches!"
-                                                           : "doesn't match!");
+                fsInfo.structSignature == kFsInfoStructSignature
+                    ? "matches!"
+                    : "doesn't match!");
   spdlog::debug("Last known free cluster count: {}", fsInfo.freeClusters);
   spdlog::debug("Available clusters start: 0x{:X}",
                 fsInfo.availableClusterStart);
@@ -113,30 +135,57 @@ void DebugPrintFSInfo(const FileSystemInformation &fsInfo) {
                                                           : "doesn't match!"));
 }
 
-inline void rtrim(std::string &s) {
-  s.erase(std::find_if(s.rbegin(), s.rend(),
-                       [](unsigned char ch) { return !std::isspace(ch); })
-              .base(),
-          s.end());
-}
+// A istream-like cursor over bytes already read from the image. Reading
+// past the end yields zeros.
+class BufferReader {
+ public:
+  BufferReader(const char *data, uint64_t size) : data_(data), size_(size) {}
+
+  void read(char *out, uint64_t n) {
+    const uint64_t available = pos_ < size_ ? size_ - pos_ : 0;
+    memcpy(out, data_ + pos_, std::min(n, available));
+    if (n > available) {
+      memset(out + available, 0, n - available);
+    }
+    pos_ += n;
+  }
+
+  // Like std::istream::ignore, a negative count extracts nothing.
+  void ignore(int64_t n = 1) {
+    if (n > 0) {
+      pos_ += n;
+    }
+  }
+
+  uint64_t tellg() const { return pos_; }
+
+  void seekg(uint64_t pos) { pos_ = pos; }
+
+  uint64_t remaining() const { return pos_ < size_ ? size_ - pos_ : 0; }
+
+ private:
+  const char *data_;
+  uint64_t size_;
+  uint64_t pos_ = 0;
+};
 
 template <class T>
-void ReadSized(T *result, std::ifstream &in);
+void ReadSized(T *result, BufferReader &in);
 
 template <>
-void ReadSized(uint8_t *result, std::ifstream &in) {
+void ReadSized(uint8_t *result, BufferReader &in) {
   in.read(reinterpret_cast<char *>(result), 1);
 }
 
 template <>
-void ReadSized<>(uint16_t *result, std::ifstream &in) {
+void ReadSized<>(uint16_t *result, BufferReader &in) {
   uint16_t little_endian_data;
   in.read(reinterpret_cast<char *>(&little_endian_data), 2);
   *result = le16toh(little_endian_data);
 }
 
 template <>
-void ReadSized(uint32_t *result, std::ifstream &in) {
+void ReadSized(uint32_t *result, BufferReader &in) {
   uint32_t little_endian_data;
   in.read(reinterpret_cast<char *>(&little_endian_data), 4);
   *result = le32toh(little_endian_data);
@@ -144,11 +193,11 @@ void ReadSized(uint32_t *result, std::ifstream &in) {
 
 // Convert little-endian to host byte order.
 template <class T>
-void Read(T *result, std::ifstream &in) {
+void Read(T *result, BufferReader &in) {
   ReadSized(result, in);
 }
 
-void ReadBPB(BiosParameterBlock *bpb, std::ifstream &in) {
+void ReadBPB(BiosParameterBlock *bpb, BufferReader &in) {
   in.read((char *)bpb->jmp, 3);
   in.read((char *)bpb->oem, 8);
   bpb->oem[8] = '\0';
@@ -166,19 +215,6 @@ void ReadBPB(BiosParameterBlock *bpb, std::ifstream &in) {
   Read(&bpb->sectorsCount32, in);
 }
 
-uint32_t GetNextCluster(std::ifstream &in, const BiosParameterBlock &bpb,
-                        uint32_t cluster) {
-  const uint64_t firstFATSector = bpb.reservedSectors;
-  // Each cluster address is 4 bytes in FAT32.
-  const uint64_t offset = static_cast<uint64_t>(cluster) * 4;
-  uint32_t result;
-
-  in.seekg(firstFATSector * static_cast<uint64_t>(bpb.bytesPerSector) + offset);
-  Read(&result, in);
-
-  return result & 0x0FFFFFFF;  // only 28 bits are used
-}
-
 uint64_t GetClusterAddress(const BiosParameterBlock &bpb,
                            const ExtendedBiosParameterBlock &ebpb,
                            const uint32_t cluster) {
@@ -190,210 +226,312 @@ uint64_t GetClusterAddress(const BiosParameterBlock &bpb,
          static_cast<uint64_t>(bpb.bytesPerSector);
 }
 
-// return size of read data.
-uint32_t ReadFile(const BiosParameterBlock &bpb,
-                  const ExtendedBiosParameterBlock &ebpb,
-                  const DirectoryEntry &entry, std::ifstream &in,
-                  const uint32_t offset, const uint32_t size,
-                  std::ostream &out_stream) {
-  if (offset > entry.size) {
-    return 0;
+// Address in the image of `offset` in the cluster chain of `extents`.
+uint64_t GetChainAddress(const BiosParameterBlock &bpb,
+                         const ExtendedBiosParameterBlock &ebpb,
+                         const std::vector<Extent> &extents, uint64_t offset) {
+  const uint64_t bytes_per_cluster =
+      static_cast<uint64_t>(bpb.sectorsPerCluster) * bpb.bytesPerSector;
+  for (const Extent &extent : extents) {
+    const uint64_t extent_size = extent.length * bytes_per_cluster;
+    if (offset < extent_size) {
+      return GetClusterAddress(bpb, ebpb, extent.start_cluster) + offset;
+    }
+    offset -= extent_size;
   }
+  return 0;
+}
 
-  DebugPrintDirectoryEntryInfo(entry);
-  const uint32_t first_cluster =
-      ComposeCluster(entry.firstClusterHigh, entry.firstClusterLow);
-  const uint32_t bytes_per_cluster = bpb.sectorsPerCluster * bpb.bytesPerSector;
+std::vector<ClusterRange> ToClusterRanges(const std::vector<Extent> &extents) {
+  std::vector<ClusterRange> ranges;
+  ranges.reserve(extents.size());
+  for (const Extent &extent : extents) {
+    ranges.push_back(
+        {extent.start_cluster, extent.start_cluster + extent.length});
+  }
+  return ranges;
+}
 
-  uint32_t current_cluster = first_cluster;
-  uint32_t bytes_to_read = std::min(size, entry.size - offset);
-  uint32_t size_read = 0;
-  uint32_t pos = 0;
-
-  while (true) {
-    in.seekg(GetClusterAddress(bpb, ebpb, current_cluster));
-    if (pos + bytes_per_cluster > offset) {
-      uint32_t size_to_read;
-      if (pos < offset) {
-        // on first reading, the head address of the cluster may be
-        // smaller than offset.
-        in.ignore(offset - pos);
-        size_to_read =
-            std::min(bytes_to_read, bytes_per_cluster - (offset - pos));
-      } else {
-        size_to_read = std::min(bytes_to_read, bytes_per_cluster);
-      }
-      std::vector<char> buffer(size_to_read);
-      in.read(buffer.data(), size_to_read);
-      out_stream.write(buffer.data(), size_to_read);
-      bytes_to_read -= size_to_read;
-      size_read += size_to_read;
-      // assert(in.is_open());
-    }
-    pos += bytes_per_cluster;
+// Sets a FAT date and time to `timestamp`, in UTC like ToTimestamp.
+void EncodeDatetime(time_t timestamp, uint16_t *date, uint16_t *time) {
+  struct tm tm;
+  gmtime_r(&timestamp, &tm);
+  const int year = std::clamp(tm.tm_year + 1900 - 1980, 0, 127);
+  *date = (year << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+  *time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+}
 
-    if (bytes_to_read == 0) {
-      spdlog::debug("[EOF] read all data");
-      break;
-    }
+// Splits `path` into its parent directory and name.
+void SplitPath(absl::string_view path, absl::string_view *parent,
+               absl::string_view *name) {
+  const auto pos = path.find_last_of('/');
+  *parent = pos != absl::string_view::npos ? path.substr(0, pos) : "";
+  *name = pos != absl::string_view::npos ? path.substr(pos + 1) : path;
+}
 
-    uint32_t next_cluster = GetNextCluster(in, bpb, current_cluster);
-    if (next_cluster >= kEocc) {
-      spdlog::debug("[EOF] end of cluster");
-      break;
-    } else if (next_cluster == kBadCluster) {
-      spdlog::warn("[EOF] bad cluster - stopping");
-      break;
-    }
-    current_cluster = next_cluster;
+// Resolves the cluster chain of `entry` and where each of its extents
+// starts in the file.
+void BuildFileLayout(const BiosParameterBlock &bpb,
+                     const FileAllocationTable &fat,
+                     const DirectoryEntry &entry, FileLayout *layout) {
+  const uint64_t bytes_per_cluster =
+      static_cast<uint64_t>(bpb.sectorsPerCluster) * bpb.bytesPerSector;
+
+  layout->entry = entry;
+  layout->extents = fat.GetExtents(
+      ComposeCluster(entry.firstClusterHigh, entry.firstClusterLow));
+  layout->extent_offsets.clear();
+  layout->extent_offsets.reserve(layout->extents.size());
+  uint64_t pos = 0;
+  for (const Extent &extent : layout->extents) {
+    layout->extent_offsets.push_back(pos);
+    pos += extent.length * bytes_per_cluster;
   }
-  return size_read;
 }
 
-void ReadLongFilename(std::ifstream &in, std::string &buffer, int length) {
-  int i = 0;
-  for (; i < length / 2; i++) {
-    unsigned char c;
-    Read(&c, in);
-    if (c == 0x00 || c == 0xFF) {
+// Appends the ranges of the image holding [offset, offset + size) of the
+// file to `ranges`, return size of mapped data.
+uint32_t MapFile(const BiosParameterBlock &bpb,
+                 const ExtendedBiosParameterBlock &ebpb,
+                 const FileLayout &layout, const uint32_t offset,
+                 const uint32_t size, std::vector<ImageRange> *ranges) {
+  const uint32_t file_size = layout.entry.size;
+  if (offset > file_size) {
+    return 0;
+  }
+
+  const uint64_t bytes_per_cluster =
+      static_cast<uint64_t>(bpb.sectorsPerCluster) * bpb.bytesPerSector;
+  const std::vector<Extent> &extents = layout.extents;
+  const std::vector<uint64_t> &extent_offsets = layout.extent_offsets;
+
+  uint32_t bytes_to_map = std::min(size, file_size - offset);
+  uint32_t size_mapped = 0;
+
+  // Binary search the extent holding offset, the first extent starts at 0.
+  size_t i = std::upper_bound(extent_offsets.begin(), extent_offsets.end(),
+                              offset) -
+             extent_offsets.begin();
+  for (i = i > 0 ? i - 1 : 0; i < extents.size() && bytes_to_map > 0; i++) {
+    const uint64_t extent_size = extents[i].length * bytes_per_cluster;
+    // on first reading, the head address of the extent may be smaller
+    // than offset.
+    const uint64_t skip =
+        static_cast<uint64_t>(offset) + size_mapped - extent_offsets[i];
+    if (skip >= extent_size) {
       break;
-    };
-    buffer.push_back(c);
-    in.ignore();
-  }
-
-  // On name terminated before reading all the bytes, ignore the rest.
-  in.ignore(length - i * 2 - 1);
-}
-
-bool ReadDirectoryEntry(std::ifstream &in,
-                        std::vector<DirectoryEntry> &result) {
-  constexpr uint8_t ATTR_READ_ONLY = 0x01;
-  constexpr uint8_t ATTR_HIDDEN = 0x02;
-  constexpr uint8_t ATTR_SYSTEM = 0x04;
-  constexpr uint8_t ATTR_VOLUME_ID = 0x08;
-  constexpr uint8_t ATTR_DIRECTORY = 0x10;
-  constexpr uint8_t ATTR_ARCHIVE = 0x20;
-  constexpr uint8_t ATTR_LONG_NAME =
-      ATTR_READ_ONLY | ATTR_HIDDEN | ATTR_SYSTEM | ATTR_VOLUME_ID;
-  constexpr uint8_t ATTR_LONG_NAME_MASK = ATTR_READ_ONLY | ATTR_HIDDEN |
-                                          ATTR_SYSTEM | ATTR_VOLUME_ID |
-                                          ATTR_DIRECTORY | ATTR_ARCHIVE;
-  constexpr uint8_t kFreeEntryIndicator = 0xE5;
-  constexpr uint8_t kEndOfEntriesIndicator = 0x00;
-
-  std::vector<std::string> longNameEntries;
-
-  // First, assume starting with long filename directory entry.
-  while (true) {
-    uint64_t origin = in.tellg();
-
-    unsigned char first_byte;
-    Read(&first_byte, in);
-    if (first_byte == kEndOfEntriesIndicator) {
-      return false;
-    };
-    if (first_byte == kFreeEntryIndicator) {
-      in.seekg(origin + 32L);
-      continue;
     }
+    const uint32_t size_to_map =
+        std::min<uint64_t>(bytes_to_map, extent_size - skip);
+    ranges->push_back(
+        {GetClusterAddress(bpb, ebpb, extents[i].start_cluster) + skip,
+         size_to_map});
+    bytes_to_map -= size_to_map;
+    size_mapped += size_to_map;
+  }
 
-    std::string long_filename;
-    // LDIR_Name1
-    ReadLongFilename(in, long_filename, 10);
-
-    unsigned char attr;
-    Read(&attr, in);
-
-    if ((attr & ATTR_LONG_NAME_MASK) == ATTR_LONG_NAME) {
-      LongFileNameDirectoryEntry entry;
-      entry.order = first_byte;
-      in.ignore();  // LDIR_Type must be zero
-      Read(&entry.checksum, in);
-      // LDIR_Name2
-      ReadLongFilename(in, long_filename, 12);
-      in.ignore(2);  // LDIR_FstClusLO must be zero
-      // LDIR_Name2
-      ReadLongFilename(in, long_filename, 4);
-
-      const bool is_last_long_entry = (entry.order & 0x40) == 0x40;
-      if (is_last_long_entry) {
-        // There may be multiple "last" long entries, which should be
-        // dropped except the last one.
-        longNameEntries.clear();
-      }
+  if (bytes_to_map == 0) {
+    spdlog::debug("[EOF] read all data");
+  } else {
+    spdlog::debug("[EOF] end of cluster chain");
+  }
+  return size_mapped;
+}
 
-      longNameEntries.push_back(long_filename);
-    } else {
-      // End of long filename directory entry.
-      in.seekg(origin);  // go back to read the data again as directory entry.
+// return size of read data.
+uint32_t ReadFile(const BiosParameterBlock &bpb,
+                  const ExtendedBiosParameterBlock &ebpb,
+                  const FileLayout &layout, const BlockDevice &device,
+                  const uint32_t offset, const uint32_t size, char *out) {
+  std::vector<ImageRange> ranges;
+  const uint32_t size_read = MapFile(bpb, ebpb, layout, offset, size, &ranges);
+
+  // One read per extent, submitted together.
+  std::vector<ReadRequest> requests;
+  requests.reserve(ranges.size());
+  for (const ImageRange &range : ranges) {
+    requests.push_back({range.offset, range.size, out});
+    out += range.size;
+  }
+  if (!device.ReadBatch(requests)) {
+    return 0;
+  }
+  return size_read;
+}
+
+// Streams the whole file through a bounded buffer, return size of read
+// data.
+uint32_t ReadFile(const BiosParameterBlock &bpb,
+                  const ExtendedBiosParameterBlock &ebpb,
+                  const FileAllocationTable &fat, const DirectoryEntry &entry,
+                  const BlockDevice &device, std::ostream &out_stream) {
+  DebugPrintDirectoryEntryInfo(entry);
+  FileLayout layout;
+  BuildFileLayout(bpb, fat, entry, &layout);
+  std::vector<char> buffer(std::min<uint64_t>(entry.size, kReadChunkSize));
+  uint32_t size_read = 0;
+  while (size_read < entry.size) {
+    const uint32_t n = ReadFile(bpb, ebpb, layout, device, size_read,
+                                buffer.size(), buffer.data());
+    if (n == 0) {
       break;
     }
+    out_stream.write(buffer.data(), n);
+    size_read += n;
   }
+  return size_read;
+}
 
-  // Second, read the actual directory entry.
-  DirectoryEntry entry;
-  in.read(entry.filename, 11);
+// Reads all the clusters of `extents` into `buffer`.
+bool ReadClusters(const BlockDevice &device, const BiosParameterBlock &bpb,
+                  const ExtendedBiosParameterBlock &ebpb,
+                  const std::vector<Extent> &extents,
+                  std::vector<char> &buffer) {
+  const uint64_t bytes_per_cluster =
+      static_cast<uint64_t>(bpb.sectorsPerCluster) * bpb.bytesPerSector;
+
+  uint64_t size = 0;
+  for (const Extent &extent : extents) {
+    size += extent.length * bytes_per_cluster;
+  }
 
-  entry.filename[11] = '\0';
-  Read(&entry.attributes, in);
-  in.ignore();  // Reserved DIR_NTRes, must be 0.
-  Read(&entry.creationTimeHS, in);
-  Read(&entry.creationTime, in);
-  Read(&entry.creationDate, in);
-  Read(&entry.lastAccessedDate, in);
-  Read(&entry.firstClusterHigh, in);
-  Read(&entry.lastModificationTime, in);
-  Read(&entry.lastModificationDate, in);
-  Read(&entry.firstClusterLow, in);
-  Read(&entry.size, in);
+  buffer.resize(size);
+  std::vector<ReadRequest> requests;
+  requests.reserve(extents.size());
+  uint64_t pos = 0;
+  for (const Extent &extent : extents) {
+    const uint64_t extent_size = extent.length * bytes_per_cluster;
+    requests.push_back({GetClusterAddress(bpb, ebpb, extent.start_cluster),
+                        extent_size, buffer.data() + pos});
+    pos += extent_size;
+  }
+  if (!device.ReadBatch(requests)) {
+    spdlog::error("failed to read clusters from 0x{:X}",
+                  extents.front().start_cluster);
+    return false;
+  }
+  return true;
+}
 
-  if (!longNameEntries.empty()) {
-    // iterate through the entries backwards and add them to string
-    std::string filename;
+// Like ReadClusters, but takes the clusters held by `cache` from there and
+// adds the other ones to it.
+bool ReadClustersCached(const BlockDevice &device,
+                        const BiosParameterBlock &bpb,
+                        const ExtendedBiosParameterBlock &ebpb,
+                        const std::vector<Extent> &extents, ClusterKind kind,
+                        ClusterCache &cache, std::vector<char> &buffer) {
+  const uint64_t bytes_per_cluster =
+      static_cast<uint64_t>(bpb.sectorsPerCluster) * bpb.bytesPerSector;
+
+  uint64_t size = 0;
+  for (const Extent &extent : extents) {
+    size += extent.length * bytes_per_cluster;
+  }
 
-    for (auto it = longNameEntries.crbegin(); it != longNameEntries.crend();
-         ++it) {
-      filename += *it;
+  buffer.resize(size);
+  char *out = buffer.data();
+  // Runs of missing clusters, each read at once and all submitted
+  // together.
+  std::vector<Extent> runs;
+  std::vector<ReadRequest> requests;
+  for (const Extent &extent : extents) {
+    uint32_t missing = 0;
+    for (uint32_t i = 0; i <= extent.length; i++) {
+      const uint32_t cluster = extent.start_cluster + i;
+      if (i < extent.length &&
+          !cache.Get(cluster, out + i * bytes_per_cluster)) {
+        continue;
+      }
+      if (missing < i) {
+        runs.push_back({extent.start_cluster + missing, i - missing});
+        requests.push_back(
+            {GetClusterAddress(bpb, ebpb, extent.start_cluster + missing),
+             (i - missing) * bytes_per_cluster,
+             out + missing * bytes_per_cluster});
+      }
+      missing = i + 1;
     }
-
-    entry.longFilename = filename;
+    out += extent.length * bytes_per_cluster;
   }
 
-  entry.name = !entry.longFilename.empty() ? entry.longFilename
-                                           : std::string(entry.filename);
-  rtrim(entry.name);
-
-  result.push_back(entry);
-
+  if (!device.ReadBatch(requests)) {
+    spdlog::error("failed to read clusters from 0x{:X}",
+                  extents.front().start_cluster);
+    return false;
+  }
+  for (size_t i = 0; i < runs.size(); i++) {
+    const char *data = requests[i].out;
+    for (uint32_t j = 0; j < runs[i].length; j++) {
+      cache.Put(runs[i].start_cluster + j, kind, data, bytes_per_cluster);
+      data += bytes_per_cluster;
+    }
+  }
   return true;
 }
 
-void ReadDirectory(std::ifstream &in, const BiosParameterBlock &bpb,
-                   const ExtendedBiosParameterBlock &ebpb, uint32_t cluster,
-                   std::vector<DirectoryEntry> &entries) {
-  uint64_t cluster_addr = GetClusterAddress(bpb, ebpb, cluster);
-  in.seekg(cluster_addr);
+// Adds the clusters of `extents`, read into `buffer`, to `cache`.
+void PutClusters(const BiosParameterBlock &bpb,
+                 const std::vector<Extent> &extents,
+                 const std::vector<char> &buffer, ClusterKind kind,
+                 ClusterCache &cache) {
+  const uint64_t bytes_per_cluster =
+      static_cast<uint64_t>(bpb.sectorsPerCluster) * bpb.bytesPerSector;
+  const char *data = buffer.data();
+  for (const Extent &extent : extents) {
+    for (uint32_t i = 0; i < extent.length; i++) {
+      cache.Put(extent.start_cluster + i, kind, data, bytes_per_cluster);
+      data += bytes_per_cluster;
+    }
+  }
+}
 
-  while (true) {
-    bool has_next_entry = ReadDirectoryEntry(in, entries);
-    if (!has_next_entry) {
-      break;
-    };
+// Like ReadFile(bpb, ebpb, layout, ...), through the cluster cache.
+uint32_t ReadCachedFile(const BiosParameterBlock &bpb,
+                        const ExtendedBiosParameterBlock &ebpb,
+                        const FileLayout &layout, const BlockDevice &device,
+                        ClusterCache &cache, const uint32_t offset,
+                        const uint32_t size, char *out) {
+  const uint32_t file_size = layout.entry.size;
+  if (offset >= file_size || size == 0) {
+    return 0;
+  }
 
-    // If we read the whole cluster, go on to the next.
-    if (static_cast<uint64_t>(in.tellg()) - cluster_addr >=
-        bpb.sectorsPerCluster * bpb.bytesPerSector) {
-      cluster = GetNextCluster(in, bpb, cluster);
-      cluster_addr = GetClusterAddress(bpb, ebpb, cluster);
-      in.seekg(cluster_addr);
-      spdlog::debug("go on next cluster: {:X}, addr: {:X}", cluster,
-                    cluster_addr);
+  const uint64_t bytes_per_cluster =
+      static_cast<uint64_t>(bpb.sectorsPerCluster) * bpb.bytesPerSector;
+  const uint32_t bytes_to_read = std::min(size, file_size - offset);
+  const uint64_t first = offset / bytes_per_cluster;
+  const uint64_t last = (offset + bytes_to_read - 1) / bytes_per_cluster;
+
+  // The parts of the extents holding clusters [first, last] of the file.
+  std::vector<Extent> slice;
+  uint64_t index = 0;
+  for (const Extent &extent : layout.extents) {
+    const uint64_t begin = std::max(first, index);
+    const uint64_t end = std::min(last + 1, index + extent.length);
+    if (begin < end) {
+      slice.push_back({static_cast<uint32_t>(extent.start_cluster +
+                                             (begin - index)),
+                       static_cast<uint32_t>(end - begin)});
     }
+    index += extent.length;
   }
+
+  std::vector<char> buffer;
+  if (!ReadClustersCached(device, bpb, ebpb, slice, ClusterKind::kData,
+                          cache, buffer)) {
+    return 0;
+  }
+  const uint64_t skip = offset % bytes_per_cluster;
+  if (skip >= buffer.size()) {
+    return 0;
+  }
+  const uint32_t size_read =
+      std::min<uint64_t>(bytes_to_read, buffer.size() - skip);
+  memcpy(out, buffer.data() + skip, size_read);
+  return size_read;
 }
 
-void ReadEBPB(ExtendedBiosParameterBlock *ebpb, std::ifstream &in) {
+void ReadEBPB(ExtendedBiosParameterBlock *ebpb, BufferReader &in) {
   Read(&ebpb->sectorsPerFAT, in);
   Read(&ebpb->flags, in);
   Read(&ebpb->FATVersion, in);
@@ -413,11 +551,7 @@ void ReadEBPB(ExtendedBiosParameterBlock *ebpb, std::ifstream &in) {
   in.ignore(2);    // Bootable partition signature (0xAA55)
 }
 
-void ReadFSInfo(const BiosParameterBlock &bpb,
-                const ExtendedBiosParameterBlock &ebpb,
-                FileSystemInformation *fsInfo, std::ifstream &in) {
-  in.seekg(ebpb.FSInfoSector *
-           bpb.bytesPerSector);  // seek to FSInfo start location
+void ReadFSInfo(FileSystemInformation *fsInfo, BufferReader &in) {
   Read(&fsInfo->leadSignature, in);
   in.ignore(480);  // Reserved
   Read(&fsInfo->structSignature, in);
@@ -441,55 +575,56 @@ bool IsEbpbValid(const BiosParameterBlock &bpb,
   return totalClusters >= 65525;
 }
 
-bool GetSubDirectories(std::vector<DirectoryEntry> &current_dir_entries,
-                       const absl::string_view &sub_dir_name, std::ifstream &in,
-                       const BiosParameterBlock &bpb,
-                       const ExtendedBiosParameterBlock &ebpb) {
-  for (const DirectoryEntry &entry : current_dir_entries) {
-    if (entry.name != sub_dir_name) {
-      continue;
-    }
-
-    if (!entry.IsDirectory()) {
-      return false;
-    }
-
-    DebugPrintDirectoryEntryInfo(entry);
-    const uint32_t first_cluster =
-        ComposeCluster(entry.firstClusterHigh, entry.firstClusterLow);
-    current_dir_entries.clear();
-    ReadDirectory(in, bpb, ebpb, first_cluster, current_dir_entries);
-    return true;
-  }
-
-  return false;
-}
-
-template <typename CharT, typename TraitsT = std::char_traits<CharT> >
-class CharArrayBuffer : public std::basic_streambuf<CharT, TraitsT> {
- public:
-  CharArrayBuffer(CharT *base, uint32_t size) { this->setp(base, base + size); }
-};
-
 }  // namespace
 
-FileSystem::FileSystem(const std::string &image_file)
-    : image_file_(image_file) {
+FileSystem::FileSystem(const std::string &image_file,
+                       BlockDeviceType device_type,
+                       uint64_t cluster_cache_size, bool writable)
+    : image_file_(image_file),
+      device_type_(device_type),
+      writable_(writable),
+      cluster_cache_(cluster_cache_size) {
   Initialize(image_file);
 }
 
 bool FileSystem::Refresh() {
-  in_.close();
-
+  std::unique_lock lock(mutex_);
   spdlog::debug("refreshing");
 
+  // The image is compared with what is in memory, which has to be written
+  // first.
+  if (valid_ && !FlushLocked()) {
+    // Reading the image again would undo the allocations not written
+    // yet, keep everything for the next flush.
+    spdlog::warn("failed to write back changes, not refreshing");
+    return false;
+  }
+
+  if (valid_ && RefreshIncrementally()) {
+    return true;
+  }
+
+  spdlog::debug("reinitializing");
+  if (device_ != nullptr) {
+    const BlockDeviceStats stats = device_->Stats();
+    closed_device_stats_.reads += stats.reads;
+    closed_device_stats_.bytes_read += stats.bytes_read;
+    closed_device_stats_.seeks += stats.seeks;
+  }
+  device_.reset();
+  generation_++;
+
   valid_ = false;
   current_path_.clear();
   bpb_ = BiosParameterBlock();
   ebpb_ = ExtendedBiosParameterBlock();
   fs_info_ = FileSystemInformation();
+  fat_.Clear();
+  dirty_entries_.clear();
   root_dir_entries_.clear();
   current_dir_entries_.clear();
+  dentry_cache_.Clear();
+  cluster_cache_.Clear();
 
   Initialize(image_file_);
 
@@ -500,15 +635,154 @@ bool FileSystem::Refresh() {
   return valid_;
 }
 
+bool FileSystem::RefreshIncrementally() {
+  char boot_sector[kBootSectorSize];
+  if (!device_->Read(0, kBootSectorSize, boot_sector)) {
+    return false;
+  }
+  if (memcmp(boot_sector, boot_sector_, kBootSectorSize) != 0) {
+    spdlog::debug("boot sector changed");
+    return false;
+  }
+
+  std::vector<char> fs_info_sector(bpb_.bytesPerSector);
+  if (!device_->Read(static_cast<uint64_t>(ebpb_.FSInfoSector) *
+                         bpb_.bytesPerSector,
+                     fs_info_sector.size(), fs_info_sector.data())) {
+    return false;
+  }
+  BufferReader fs_info_in(fs_info_sector.data(), fs_info_sector.size());
+  ReadFSInfo(&fs_info_, fs_info_in);
+
+  std::vector<ClusterRange> changed_clusters;
+  if (!fat_.Reload(*device_, bpb_, ebpb_, &changed_clusters)) {
+    return false;
+  }
+  cluster_cache_.Erase(changed_clusters);
+
+  // Walk the cached directories from the root down, so that the entry of a
+  // directory is looked up in its already refreshed parent.
+  absl::flat_hash_map<std::string, std::shared_ptr<const Directory>>
+      refreshed;
+  absl::flat_hash_set<std::string> changed_directories;
+  for (auto &[path, directory] : dentry_cache_.Directories()) {
+    uint32_t first_cluster = ebpb_.rootDirCluster;
+    if (!path.empty()) {
+      const auto pos = path.find_last_of('/');
+      const std::string parent =
+          pos != std::string::npos ? path.substr(0, pos) : "";
+      const std::string name =
+          pos != std::string::npos ? path.substr(pos + 1) : path;
+      const auto it = refreshed.find(parent);
+      const DirectoryEntry *entry =
+          it != refreshed.end() ? it->second->Find(name) : nullptr;
+      if (entry == nullptr || !entry->IsDirectory()) {
+        spdlog::debug("directory {} is gone", path);
+        dentry_cache_.EraseDirectory(path);
+        changed_directories.insert(path);
+        continue;
+      }
+      first_cluster =
+          ComposeCluster(entry->firstClusterHigh, entry->firstClusterLow);
+    }
+
+    std::shared_ptr<const Directory> updated =
+        LoadDirectoryLocked(first_cluster, directory, changed_clusters);
+    if (updated == nullptr) {
+      return false;
+    }
+    if (updated != directory) {
+      spdlog::debug("directory {} changed", path);
+      dentry_cache_.PutDirectory(path, updated);
+      changed_directories.insert(path);
+    }
+    refreshed.emplace(path, std::move(updated));
+  }
+  dentry_cache_.EraseEntries(changed_directories);
+
+  if (changed_directories.contains("")) {
+    root_dir_entries_ = refreshed[""]->Entries();
+  }
+  current_path_ = "";
+  current_dir_entries_ = root_dir_entries_;
+
+  if (!changed_clusters.empty() || !changed_directories.empty()) {
+    // Small files may have been rewritten in place.
+    cluster_cache_.EraseData();
+    generation_++;
+  }
+  spdlog::debug("refreshed: {} FAT ranges and {} directories changed",
+                changed_clusters.size(), changed_directories.size());
+  return true;
+}
+
+std::shared_ptr<const Directory> FileSystem::LoadDirectoryLocked(
+    uint32_t first_cluster, const std::shared_ptr<const Directory> &cached,
+    const std::vector<ClusterRange> &changed_clusters) const {
+  const bool same_chain = cached != nullptr &&
+                          cached->FirstCluster() == first_cluster &&
+                          !Intersects(changed_clusters, cached->Extents());
+  std::vector<Extent> extents =
+      same_chain ? cached->Extents() : fat_.GetExtents(first_cluster);
+
+  // A refresh has to see what is on the image, and updates the cache.
+  std::vector<char> buffer;
+  if (cached != nullptr
+          ? !ReadClusters(*device_, bpb_, ebpb_, extents, buffer)
+          : !ReadClustersCached(*device_, bpb_, ebpb_, extents,
+                                ClusterKind::kMetadata, cluster_cache_,
+                                buffer)) {
+    return nullptr;
+  }
+  const size_t checksum = absl::Hash<absl::string_view>{}(
+      absl::string_view(buffer.data(), buffer.size()));
+  if (cached != nullptr && cached->FirstCluster() == first_cluster &&
+      cached->Extents() == extents && cached->Checksum() == checksum) {
+    return cached;
+  }
+  if (cached != nullptr) {
+    PutClusters(bpb_, extents, buffer, ClusterKind::kMetadata,
+                cluster_cache_);
+  }
+
+  std::vector<DirectoryEntry> entries;
+  ParseDirectory(buffer.data(), buffer.size(), &entries);
+
+  // Turn the offsets of the entries in the buffer into their address in
+  // the image.
+  const uint64_t bytes_per_cluster =
+      static_cast<uint64_t>(bpb_.sectorsPerCluster) * bpb_.bytesPerSector;
+  size_t i = 0;
+  uint64_t extent_offset = 0;
+  for (DirectoryEntry &entry : entries) {
+    while (entry.location >=
+           extent_offset + extents[i].length * bytes_per_cluster) {
+      extent_offset += extents[i].length * bytes_per_cluster;
+      i++;
+    }
+    entry.location = GetClusterAddress(bpb_, ebpb_, extents[i].start_cluster) +
+                     entry.location - extent_offset;
+  }
+  return std::make_shared<Directory>(std::move(entries), first_cluster,
+                                     std::move(extents), checksum);
+}
+
 void FileSystem::Initialize(const std::string &image_file) {
-  in_.open(image_file, std::ios::binary);
-  if (!in_) {
+  device_ = OpenBlockDevice(image_file, device_type_, writable_);
+  if (device_ == nullptr) {
     spdlog::error("failed to read fat32 image file {}", image_file);
     valid_ = false;
     return;
   }
 
-  ReadBPB(&bpb_, in_);
+  if (!device_->Read(0, kBootSectorSize, boot_sector_)) {
+    spdlog::error("failed to read boot sector");
+    valid_ = false;
+    return;
+  }
+  BufferReader in(boot_sector_, kBootSectorSize);
+
+  ReadBPB(&bpb_, in);
   DebugPrintBPBInfo(bpb_);
   if (bpb_.jmp[0] == 0xEB && bpb_.jmp[2] == 0x90) {
     spdlog::debug("FAT image detected (by JMP signature)");
@@ -525,7 +799,7 @@ void FileSystem::Initialize(const std::string &image_file) {
     return;
   }
 
-  ReadEBPB(&ebpb_, in_);
+  ReadEBPB(&ebpb_, in);
   DebugPrintEBPBInfo(ebpb_);
   if (!IsEbpbValid(bpb_, ebpb_)) {
     spdlog::error("invalid EBPB");
@@ -533,16 +807,156 @@ void FileSystem::Initialize(const std::string &image_file) {
     return;
   }
 
-  ReadFSInfo(bpb_, ebpb_, &fs_info_, in_);
+  std::vector<char> fs_info_sector(bpb_.bytesPerSector);
+  if (!device_->Read(static_cast<uint64_t>(ebpb_.FSInfoSector) *
+                         bpb_.bytesPerSector,
+                     fs_info_sector.size(), fs_info_sector.data())) {
+    spdlog::error("failed to read FSInfo");
+    valid_ = false;
+    return;
+  }
+  BufferReader fs_info_in(fs_info_sector.data(), fs_info_sector.size());
+  ReadFSInfo(&fs_info_, fs_info_in);
   DebugPrintFSInfo(fs_info_);
 
-  ReadDirectory(in_, bpb_, ebpb_, ebpb_.rootDirCluster, root_dir_entries_);
+  if (!fat_.Load(*device_, bpb_, ebpb_)) {
+    spdlog::error("failed to load FAT");
+    valid_ = false;
+    return;
+  }
+  if (fs_info_.leadSignature == kFsInfoLeadSignature &&
+      fs_info_.structSignature == kFsInfoStructSignature) {
+    fat_.SetNextFree(fs_info_.availableClusterStart);
+  }
+
+  std::shared_ptr<const Directory> root =
+      LoadDirectoryLocked(ebpb_.rootDirCluster, nullptr, {});
+  if (root == nullptr) {
+    valid_ = false;
+    return;
+  }
+  dentry_cache_.PutDirectory("", root);
+  root_dir_entries_ = root->Entries();
   current_dir_entries_ = root_dir_entries_;
   current_path_ = "";
 
   valid_ = true;
 }
 
+bool FileSystem::ListDirectory(absl::string_view path,
+                               std::vector<DirectoryEntry> *entries) const {
+  std::shared_ptr<const Directory> directory = OpenDirectory(path);
+  if (directory == nullptr) {
+    return false;
+  }
+  *entries = directory->Entries();
+  return true;
+}
+
+std::shared_ptr<const Directory> FileSystem::OpenDirectory(
+    absl::string_view path) const {
+  std::shared_lock lock(mutex_);
+  return OpenDirectoryLocked(path);
+}
+
+bool FileSystem::Snapshot(absl::string_view path,
+                          TreeSnapshot *snapshot) const {
+  std::shared_lock lock(mutex_);
+  snapshot->root = std::string(path);
+  snapshot->generation = generation_;
+  snapshot->directories.clear();
+
+  std::vector<std::string> pending = {snapshot->root};
+  while (!pending.empty()) {
+    const std::string directory_path = std::move(pending.back());
+    pending.pop_back();
+    std::shared_ptr<const Directory> directory =
+        OpenDirectoryLocked(directory_path);
+    if (directory == nullptr) {
+      return false;
+    }
+    for (const DirectoryEntry &entry : directory->Entries()) {
+      if (entry.IsDirectory() && entry.name != "." && entry.name != "..") {
+        pending.push_back(directory_path.empty()
+                              ? entry.name
+                              : absl::StrCat(directory_path, "/", entry.name));
+      }
+    }
+    snapshot->directories.emplace(directory_path, std::move(directory));
+  }
+  return true;
+}
+
+bool FileSystem::GetEntry(absl::string_view path,
+                          DirectoryEntry *entry) const {
+  std::shared_lock lock(mutex_);
+  return GetEntryLocked(path, entry);
+}
+
+std::shared_ptr<const Directory> FileSystem::OpenDirectoryLocked(
+    absl::string_view path) const {
+  if (!valid_) {
+    return nullptr;
+  }
+
+  std::shared_ptr<const Directory> directory =
+      dentry_cache_.GetDirectory(path);
+  if (directory != nullptr) {
+    return directory;
+  }
+
+  // The root directory is always cached.
+  DirectoryEntry entry;
+  if (path.empty() || !GetEntryLocked(path, &entry) || !entry.IsDirectory()) {
+    spdlog::debug("not dir {}", path);
+    return nullptr;
+  }
+
+  directory = LoadDirectoryLocked(
+      ComposeCluster(entry.firstClusterHigh, entry.firstClusterLow), nullptr,
+      {});
+  if (directory == nullptr) {
+    return nullptr;
+  }
+
+  dentry_cache_.PutDirectory(path, directory);
+  return directory;
+}
+
+bool FileSystem::GetEntryLocked(absl::string_view path,
+                                DirectoryEntry *entry) const {
+  if (!valid_) {
+    return false;
+  }
+
+  if (!dentry_cache_.GetEntry(path, entry)) {
+    absl::string_view parent;
+    absl::string_view filename;
+    SplitPath(path, &parent, &filename);
+
+    std::shared_ptr<const Directory> directory = OpenDirectoryLocked(parent);
+    if (directory == nullptr) {
+      return false;
+    }
+    const DirectoryEntry *found = directory->Find(filename);
+    if (found == nullptr) {
+      return false;
+    }
+
+    *entry = *found;
+    dentry_cache_.PutEntry(path, *found);
+  }
+
+  // Files being written are ahead of their directory.
+  if (!dirty_entries_.empty()) {
+    const auto it = dirty_entries_.find(entry->location);
+    if (it != dirty_entries_.end()) {
+      *entry = it->second.entry;
+    }
+  }
+  return true;
+}
+
 bool FileSystem::ExportFile(absl::string_view path,
                             const std::string &export_path) {
   std::ofstream ofs(export_path, std::ios::binary);
@@ -557,9 +971,8 @@ bool FileSystem::ReadFile(absl::string_view path, std::string *content) {
   }
 
   content->resize(dir_entry->size);
-  CharArrayBuffer buf(content->data(), dir_entry->size);
-  std::ostream os(&buf);
-  return ReadFile(*dir_entry, os);
+  return ReadFile(*dir_entry, 0, dir_entry->size, content->data()) ==
+         dir_entry->size;
 }
 
 bool FileSystem::ReadFile(absl::string_view path, std::ostream &os) {
@@ -573,15 +986,94 @@ bool FileSystem::ReadFile(absl::string_view path, std::ostream &os) {
 }
 
 uint32_t FileSystem::ReadFile(const DirectoryEntry &entry, uint32_t offset,
-                              uint32_t size, char *out) {
-  CharArrayBuffer buf(out, size);
-  std::ostream os(&buf);
-  return fat32::ReadFile(bpb_, ebpb_, entry, in_, offset, size, os);
+                              uint32_t size, char *out) const {
+  std::shared_lock lock(mutex_);
+  if (!valid_) {
+    return 0;
+  }
+  FileLayout layout;
+  BuildFileLayout(bpb_, fat_, entry, &layout);
+  return ReadFileLocked(layout, offset, size, out);
+}
+
+bool FileSystem::GetFileLayout(absl::string_view path,
+                               FileLayout *layout) const {
+  std::shared_lock lock(mutex_);
+  DirectoryEntry entry;
+  if (!GetEntryLocked(path, &entry) || entry.IsDirectory()) {
+    return false;
+  }
+  BuildFileLayout(bpb_, fat_, entry, layout);
+  layout->path = std::string(path);
+  layout->generation = generation_;
+  return true;
+}
+
+uint32_t FileSystem::ReadFile(const FileLayout &layout, uint32_t offset,
+                              uint32_t size, char *out) const {
+  std::shared_lock lock(mutex_);
+  if (!valid_) {
+    return 0;
+  }
+  return ReadFileLocked(layout, offset, size, out);
+}
+
+uint32_t FileSystem::ReadFileLocked(const FileLayout &layout, uint32_t offset,
+                                    uint32_t size, char *out) const {
+  if (cluster_cache_.Enabled() && layout.entry.size <= kMaxCachedFileSize) {
+    return ReadCachedFile(bpb_, ebpb_, layout, *device_, cluster_cache_,
+                          offset, size, out);
+  }
+  return fat32::ReadFile(bpb_, ebpb_, layout, *device_, offset, size, out);
+}
+
+BlockDeviceStats FileSystem::GetBlockDeviceStats() const {
+  std::shared_lock lock(mutex_);
+  BlockDeviceStats stats = closed_device_stats_;
+  if (device_ != nullptr) {
+    const BlockDeviceStats current = device_->Stats();
+    stats.reads += current.reads;
+    stats.bytes_read += current.bytes_read;
+    stats.seeks += current.seeks;
+  }
+  return stats;
+}
+
+SpaceStats FileSystem::GetSpaceStats() const {
+  std::shared_lock lock(mutex_);
+  SpaceStats stats;
+  if (!valid_) {
+    return stats;
+  }
+  stats.cluster_size =
+      static_cast<uint64_t>(bpb_.sectorsPerCluster) * bpb_.bytesPerSector;
+  stats.clusters = fat_.Size() - 2;
+  stats.free_clusters = fat_.FreeCount();
+  return stats;
+}
+
+std::vector<Extent> FileSystem::GetFreeExtents() const {
+  std::shared_lock lock(mutex_);
+  if (!valid_) {
+    return {};
+  }
+  return fat_.GetFreeExtents();
+}
+
+uint32_t FileSystem::MapFile(const FileLayout &layout, uint32_t offset,
+                             uint32_t size, std::vector<ImageRange> *ranges,
+                             std::shared_ptr<const BlockDevice> *device) const {
+  std::shared_lock lock(mutex_);
+  if (!valid_) {
+    return 0;
+  }
+  *device = device_;
+  return fat32::MapFile(bpb_, ebpb_, layout, offset, size, ranges);
 }
 
 bool FileSystem::ReadFile(const DirectoryEntry &entry, std::ostream &os) {
-  return fat32::ReadFile(bpb_, ebpb_, entry, in_, 0, entry.size, os) ==
-         entry.size;
+  std::shared_lock lock(mutex_);
+  return fat32::ReadFile(bpb_, ebpb_, fat_, entry, *device_, os) == entry.size;
 }
 
 bool FileSystem::ChangeDirectory(absl::string_view path, bool parent) {
@@ -608,17 +1100,14 @@ bool FileSystem::ChangeDirectory(absl::string_view path, bool parent) {
     return true;
   }
 
-  std::vector<absl::string_view> path_segments =
-      absl::StrSplit(path, kPathDelimeter);
-  current_dir_entries_ = root_dir_entries_;
-  for (const std::string_view &dir_name : path_segments) {
-    if (!GetSubDirectories(current_dir_entries_, dir_name, in_, bpb_, ebpb_)) {
-      spdlog::debug("not dir {} under {}", dir_name, current_path_);
-      current_path_ = "";
-      current_dir_entries_ = root_dir_entries_;
-      return false;
-    }
+  std::vector<DirectoryEntry> entries;
+  if (!ListDirectory(path, &entries)) {
+    spdlog::debug("failed to change directory to {}", path);
+    current_path_ = "";
+    current_dir_entries_ = root_dir_entries_;
+    return false;
   }
+  current_dir_entries_ = std::move(entries);
   current_path_ = path;
   return true;
 }
@@ -639,4 +1128,600 @@ const DirectoryEntry *FileSystem::FindDirectoryEntry(
   return &(*it);
 }
 
+bool FileSystem::CreateFile(absl::string_view path) {
+  std::unique_lock lock(mutex_);
+  if (!valid_ || !writable_ || !FlushLocked()) {
+    return false;
+  }
+
+  absl::string_view parent;
+  absl::string_view name;
+  SplitPath(path, &parent, &name);
+  DirectoryEntry entry{};
+  entry.attributes = kAttrArchive;
+  return AddEntryLocked(parent, name, &entry) && FlushLocked();
+}
+
+bool FileSystem::MakeDirectory(absl::string_view path) {
+  std::unique_lock lock(mutex_);
+  if (!valid_ || !writable_ || !FlushLocked()) {
+    return false;
+  }
+
+  absl::string_view parent;
+  absl::string_view name;
+  SplitPath(path, &parent, &name);
+  if (!IsValidLongFilename(name)) {
+    return false;
+  }
+  DirectoryEntry parent_entry;
+  if (!parent.empty() &&
+      (!GetEntryLocked(parent, &parent_entry) || !parent_entry.IsDirectory())) {
+    return false;
+  }
+
+  std::vector<Extent> extents;
+  if (!fat_.Allocate(1, 0, &extents)) {
+    spdlog::warn("no space left for directory {}", path);
+    return false;
+  }
+  const uint32_t cluster = extents.front().start_cluster;
+  cluster_cache_.Erase(ToClusterRanges(extents));
+
+  DirectoryEntry entry{};
+  entry.attributes = kAttrDirectory;
+  entry.firstClusterHigh = cluster >> 16;
+  entry.firstClusterLow = cluster & 0xFFFF;
+  EncodeDatetime(time(nullptr), &entry.creationDate, &entry.creationTime);
+  entry.lastModificationDate = entry.creationDate;
+  entry.lastModificationTime = entry.creationTime;
+  entry.lastAccessedDate = entry.creationDate;
+
+  // The "." and ".." entries, ".." of a child of the root points to
+  // cluster 0.
+  std::vector<char> data(
+      static_cast<uint64_t>(bpb_.sectorsPerCluster) * bpb_.bytesPerSector, 0);
+  DirectoryEntry dot = entry;
+  memcpy(dot.filename, ".          ", 11);
+  EncodeDirectoryEntry(dot, data.data());
+  DirectoryEntry dot_dot = entry;
+  memcpy(dot_dot.filename, "..         ", 11);
+  dot_dot.firstClusterHigh = parent.empty() ? 0 : parent_entry.firstClusterHigh;
+  dot_dot.firstClusterLow = parent.empty() ? 0 : parent_entry.firstClusterLow;
+  EncodeDirectoryEntry(dot_dot, data.data() + kDirectoryEntrySize);
+
+  std::vector<ClusterRange> freed;
+  if (!device_->Write(GetClusterAddress(bpb_, ebpb_, cluster), data.size(),
+                      data.data()) ||
+      !AddEntryLocked(parent, name, &entry)) {
+    fat_.FreeChain(cluster, &freed);
+    return false;
+  }
+  return FlushLocked();
+}
+
+bool FileSystem::SetModificationTime(absl::string_view path,
+                                     time_t timestamp) {
+  std::unique_lock lock(mutex_);
+  if (!valid_ || !writable_ || path.empty()) {
+    return false;
+  }
+
+  FileLayout layout;
+  if (!GetEntryLocked(path, &layout.entry)) {
+    return false;
+  }
+  layout.path = std::string(path);
+  UpdateEntryLocked(layout, timestamp);
+  return true;
+}
+
+bool FileSystem::Unlink(absl::string_view path) {
+  std::unique_lock lock(mutex_);
+  if (!valid_ || !writable_ || !FlushLocked()) {
+    return false;
+  }
+
+  DirectoryEntry entry;
+  if (!GetEntryLocked(path, &entry) || entry.IsDirectory()) {
+    return false;
+  }
+  absl::string_view parent;
+  absl::string_view name;
+  SplitPath(path, &parent, &name);
+  std::shared_ptr<const Directory> directory = OpenDirectoryLocked(parent);
+  if (directory == nullptr) {
+    return false;
+  }
+  std::vector<char> buffer;
+  if (!ReadClusters(*device_, bpb_, ebpb_, directory->Extents(), buffer)) {
+    return false;
+  }
+
+  // Free the short entry and the long filename entries before it, up to
+  // the one flagged as the last.
+  uint64_t offset = 0;
+  while (offset < buffer.size() &&
+         GetChainAddress(bpb_, ebpb_, directory->Extents(), offset) !=
+             entry.location) {
+    offset += kDirectoryEntrySize;
+  }
+  if (offset == buffer.size()) {
+    spdlog::error("entry of {} not found", path);
+    return false;
+  }
+  uint64_t first = offset;
+  while (first > 0) {
+    const char *previous = buffer.data() + first - kDirectoryEntrySize;
+    if (previous[11] != kAttrLongName || previous[0] == kFreeEntry) {
+      break;
+    }
+    first -= kDirectoryEntrySize;
+    if ((previous[0] & 0x40) != 0) {
+      break;
+    }
+  }
+  for (; first <= offset; first += kDirectoryEntrySize) {
+    if (!device_->Write(
+            GetChainAddress(bpb_, ebpb_, directory->Extents(), first), 1,
+            &kFreeEntry)) {
+      return false;
+    }
+  }
+
+  std::vector<ClusterRange> freed;
+  fat_.FreeChain(ComposeCluster(entry.firstClusterHigh, entry.firstClusterLow),
+                 &freed);
+  cluster_cache_.Erase(freed);
+  generation_++;
+  return ReloadDirectoryLocked(std::string(parent)) && FlushLocked();
+}
+
+bool FileSystem::Truncate(absl::string_view path, uint32_t size) {
+  std::unique_lock lock(mutex_);
+  if (!valid_ || !writable_) {
+    return false;
+  }
+
+  FileLayout layout;
+  if (!GetEntryLocked(path, &layout.entry) || layout.entry.IsDirectory()) {
+    return false;
+  }
+  BuildFileLayout(bpb_, fat_, layout.entry, &layout);
+  layout.path = std::string(path);
+
+  if (size > layout.entry.size) {
+    if (!ReserveLocked(&layout, size) ||
+        !WriteRangeLocked(&layout, layout.entry.size,
+                          size - layout.entry.size, nullptr)) {
+      return false;
+    }
+  } else if (size < layout.entry.size) {
+    const uint64_t bytes_per_cluster =
+        static_cast<uint64_t>(bpb_.sectorsPerCluster) * bpb_.bytesPerSector;
+    const uint64_t keep = (size + bytes_per_cluster - 1) / bytes_per_cluster;
+    std::vector<ClusterRange> freed;
+    if (keep == 0) {
+      fat_.FreeChain(ComposeCluster(layout.entry.firstClusterHigh,
+                                    layout.entry.firstClusterLow),
+                     &freed);
+      layout.entry.firstClusterHigh = 0;
+      layout.entry.firstClusterLow = 0;
+    } else {
+      // The last cluster kept ends the chain. Nothing is freed if the
+      // chain is shorter than what is kept.
+      uint64_t index = 0;
+      for (const Extent &extent : layout.extents) {
+        if (keep <= index + extent.length) {
+          fat_.CutChain(extent.start_cluster + (keep - index - 1), &freed);
+          break;
+        }
+        index += extent.length;
+      }
+    }
+    cluster_cache_.Erase(freed);
+    layout.entry.size = size;
+  }
+
+  UpdateEntryLocked(layout, time(nullptr));
+  return true;
+}
+
+uint32_t FileSystem::WriteFile(FileLayout *layout, uint32_t offset,
+                               uint32_t size, const char *data) {
+  std::unique_lock lock(mutex_);
+  if (!valid_ || !writable_) {
+    return 0;
+  }
+  // Files are at most 4 GiB - 1 bytes.
+  size = std::min<uint64_t>(size, UINT32_MAX - uint64_t{offset});
+  if (size == 0) {
+    return 0;
+  }
+
+  if (layout->generation != generation_) {
+    // The file may have been truncated since.
+    DirectoryEntry entry;
+    if (!GetEntryLocked(layout->path, &entry) || entry.IsDirectory()) {
+      return 0;
+    }
+    BuildFileLayout(bpb_, fat_, entry, layout);
+  } else if (const auto dirty = dirty_entries_.find(layout->entry.location);
+             dirty != dirty_entries_.end()) {
+    // Writes through other layouts changed the size without a new
+    // generation.
+    layout->entry = dirty->second.entry;
+  }
+
+  const uint64_t end = static_cast<uint64_t>(offset) + size;
+  if (!ReserveLocked(layout, end)) {
+    return 0;
+  }
+  if (offset > layout->entry.size &&
+      !WriteRangeLocked(layout, layout->entry.size,
+                        offset - layout->entry.size, nullptr)) {
+    return 0;
+  }
+  if (!WriteRangeLocked(layout, offset, size, data)) {
+    return 0;
+  }
+  UpdateEntryLocked(*layout, time(nullptr));
+  layout->generation = generation_;
+  return size;
+}
+
+bool FileSystem::Flush(bool sync) {
+  std::unique_lock lock(mutex_);
+  if (!valid_ || !writable_) {
+    return valid_;
+  }
+  return FlushLocked() && (!sync || device_->Sync());
+}
+
+bool FileSystem::FlushLocked() {
+  if (!writable_) {
+    return true;
+  }
+
+  // An entry must never point at clusters free on the image, which the
+  // host would allocate again.
+  if (!FlushFatLocked()) {
+    return false;
+  }
+
+  absl::flat_hash_set<std::string> parents;
+  bool written = true;
+  while (!dirty_entries_.empty()) {
+    const auto it = dirty_entries_.begin();
+    char data[kDirectoryEntrySize];
+    EncodeDirectoryEntry(it->second.entry, data);
+    if (!device_->Write(it->first, sizeof(data), data)) {
+      written = false;
+      break;
+    }
+    parents.insert(std::move(it->second.parent));
+    dirty_entries_.erase(it);
+  }
+  if (!parents.empty()) {
+    // Readers see the new sizes from now on.
+    generation_++;
+  }
+  for (const std::string &parent : parents) {
+    if (!ReloadDirectoryLocked(parent)) {
+      return false;
+    }
+  }
+  if (!written) {
+    return false;
+  }
+
+  return !fat_.ReleaseFreed() || FlushFatLocked();
+}
+
+bool FileSystem::FlushFatLocked() {
+  return !fat_.IsDirty() ||
+         (fat_.Flush(*device_, bpb_, ebpb_) && WriteFsInfoLocked());
+}
+
+bool FileSystem::WriteFsInfoLocked() {
+  if (fs_info_.leadSignature != kFsInfoLeadSignature ||
+      fs_info_.structSignature != kFsInfoStructSignature) {
+    return true;
+  }
+  fs_info_.freeClusters = fat_.FreeCount();
+  fs_info_.availableClusterStart = fat_.NextFree();
+
+  const uint32_t fields[2] = {htole32(fs_info_.freeClusters),
+                              htole32(fs_info_.availableClusterStart)};
+  static_assert(kFsInfoNextFreeOffset == kFsInfoFreeClustersOffset + 4);
+  return device_->Write(
+      static_cast<uint64_t>(ebpb_.FSInfoSector) * bpb_.bytesPerSector +
+          kFsInfoFreeClustersOffset,
+      sizeof(fields), reinterpret_cast<const char *>(fields));
+}
+
+bool FileSystem::ReloadDirectoryLocked(const std::string &path) {
+  uint32_t first_cluster = ebpb_.rootDirCluster;
+  if (!path.empty()) {
+    DirectoryEntry entry;
+    if (!GetEntryLocked(path, &entry)) {
+      return false;
+    }
+    first_cluster =
+        ComposeCluster(entry.firstClusterHigh, entry.firstClusterLow);
+  }
+
+  cluster_cache_.Erase(ToClusterRanges(fat_.GetExtents(first_cluster)));
+  std::shared_ptr<const Directory> directory =
+      LoadDirectoryLocked(first_cluster, nullptr, {});
+  if (directory == nullptr) {
+    return false;
+  }
+  dentry_cache_.PutDirectory(path, directory);
+  dentry_cache_.EraseEntries({path});
+  if (path.empty()) {
+    root_dir_entries_ = directory->Entries();
+  }
+  if (current_path_ == path) {
+    current_dir_entries_ = directory->Entries();
+  }
+  return true;
+}
+
+bool FileSystem::AddEntryLocked(absl::string_view parent,
+                                absl::string_view name,
+                                DirectoryEntry *entry) {
+  if (!IsValidLongFilename(name)) {
+    return false;
+  }
+  std::shared_ptr<const Directory> directory = OpenDirectoryLocked(parent);
+  if (directory == nullptr) {
+    return false;
+  }
+
+  absl::flat_hash_set<absl::string_view> short_names;
+  for (const DirectoryEntry &existing : directory->Entries()) {
+    if (absl::EqualsIgnoreCase(existing.name, name)) {
+      return false;
+    }
+    short_names.insert(absl::string_view(existing.filename, 11));
+  }
+
+  // The name itself if it is a valid short name, else a unique basis name
+  // with a numeric tail. The long filename is always written, as short
+  // names are listed without their dot.
+  char short_name[11];
+  bool unique = MakeShortName(name, 0, short_name) &&
+                !short_names.contains(absl::string_view(short_name, 11));
+  for (uint32_t n = 1; !unique; n++) {
+    if (n > 999999) {
+      return false;
+    }
+    MakeShortName(name, n, short_name);
+    unique = !short_names.contains(absl::string_view(short_name, 11));
+  }
+
+  memcpy(entry->filename, short_name, 11);
+  entry->filename[11] = '\0';
+  if (entry->creationDate == 0) {
+    EncodeDatetime(time(nullptr), &entry->creationDate, &entry->creationTime);
+    entry->lastModificationDate = entry->creationDate;
+    entry->lastModificationTime = entry->creationTime;
+    entry->lastAccessedDate = entry->creationDate;
+  }
+  std::string data = EncodeLongFilename(name, short_name);
+  data.resize(data.size() + kDirectoryEntrySize);
+  EncodeDirectoryEntry(*entry, data.data() + data.size() - kDirectoryEntrySize);
+  const uint64_t slots = data.size() / kDirectoryEntrySize;
+
+  std::vector<char> buffer;
+  if (!ReadClusters(*device_, bpb_, ebpb_, directory->Extents(), buffer)) {
+    return false;
+  }
+
+  // A run of free entries, all of them are free past the end marker.
+  uint64_t run_start = 0;
+  uint64_t run = 0;
+  bool end = false;
+  for (uint64_t offset = 0; offset < buffer.size() && run < slots;
+       offset += kDirectoryEntrySize) {
+    end = end || buffer[offset] == 0x00;
+    if (end || buffer[offset] == kFreeEntry) {
+      run_start = run == 0 ? offset : run_start;
+      run++;
+    } else {
+      run = 0;
+    }
+  }
+
+  std::vector<Extent> extents = directory->Extents();
+  if (run < slots) {
+    // Grow the directory by zeroed clusters, continuing the run at its
+    // end.
+    const uint64_t bytes_per_cluster =
+        static_cast<uint64_t>(bpb_.sectorsPerCluster) * bpb_.bytesPerSector;
+    if (run == 0) {
+      run_start = buffer.size();
+    }
+    const uint64_t size = run_start + data.size();
+    const uint64_t count =
+        (size - buffer.size() + bytes_per_cluster - 1) / bytes_per_cluster;
+    if (size > kMaxDirectorySize) {
+      spdlog::warn("directory {} is full", parent);
+      return false;
+    }
+    const Extent &last = extents.back();
+    std::vector<Extent> added;
+    if (!fat_.Allocate(count, last.start_cluster + last.length - 1, &added)) {
+      spdlog::warn("no space left to grow directory {}", parent);
+      return false;
+    }
+    const std::vector<char> zeros(bytes_per_cluster, 0);
+    for (const Extent &extent : added) {
+      for (uint32_t i = 0; i < extent.length; i++) {
+        if (!device_->Write(
+                GetClusterAddress(bpb_, ebpb_, extent.start_cluster + i),
+                zeros.size(), zeros.data())) {
+          return false;
+        }
+      }
+    }
+    extents = fat_.GetExtents(directory->FirstCluster());
+    cluster_cache_.Erase(ToClusterRanges(added));
+    buffer.resize(buffer.size() + count * bytes_per_cluster, 0);
+  }
+
+  // The clusters of the entry, and those the directory grew by, are
+  // allocated on the image before the entry points at them.
+  if (!FlushFatLocked()) {
+    return false;
+  }
+  for (uint64_t i = 0; i < slots; i++) {
+    const uint64_t offset = run_start + i * kDirectoryEntrySize;
+    if (!device_->Write(GetChainAddress(bpb_, ebpb_, extents, offset),
+                        kDirectoryEntrySize,
+                        data.data() + i * kDirectoryEntrySize)) {
+      return false;
+    }
+  }
+  // Entries past the end marker may hold garbage, keep the marker after the
+  // new ones.
+  const uint64_t next = run_start + data.size();
+  if (end && next < buffer.size() && buffer[next] != 0x00) {
+    const char marker = 0x00;
+    if (!device_->Write(GetChainAddress(bpb_, ebpb_, extents, next), 1,
+                        &marker)) {
+      return false;
+    }
+  }
+
+  generation_++;
+  const std::string parent_path(parent);
+  if (!ReloadDirectoryLocked(parent_path)) {
+    return false;
+  }
+  entry->location =
+      GetChainAddress(bpb_, ebpb_, extents, next - kDirectoryEntrySize);
+  return true;
+}
+
+bool FileSystem::ReserveLocked(FileLayout *layout, uint64_t size) {
+  const uint64_t bytes_per_cluster =
+      static_cast<uint64_t>(bpb_.sectorsPerCluster) * bpb_.bytesPerSector;
+  uint64_t allocated = 0;
+  for (const Extent &extent : layout->extents) {
+    allocated += extent.length;
+  }
+  const uint64_t needed = (size + bytes_per_cluster - 1) / bytes_per_cluster;
+  if (needed <= allocated) {
+    return true;
+  }
+
+  const uint32_t last = !layout->extents.empty()
+                            ? layout->extents.back().start_cluster +
+                                  layout->extents.back().length - 1
+                            : 0;
+  std::vector<Extent> added;
+  if (!fat_.Allocate(needed - allocated, last, &added)) {
+    spdlog::warn("no space left for {}", layout->path);
+    return false;
+  }
+  cluster_cache_.Erase(ToClusterRanges(added));
+  // Layouts of the file miss the new clusters.
+  generation_++;
+
+  for (const Extent &extent : added) {
+    if (!layout->extents.empty() && layout->extents.back().start_cluster +
+                                            layout->extents.back().length ==
+                                        extent.start_cluster) {
+      layout->extents.back().length += extent.length;
+      continue;
+    }
+    layout->extent_offsets.push_back(
+        layout->extents.empty()
+            ? 0
+            : layout->extent_offsets.back() +
+                  layout->extents.back().length * bytes_per_cluster);
+    layout->extents.push_back(extent);
+  }
+  const uint32_t first = layout->extents.front().start_cluster;
+  layout->entry.firstClusterHigh = first >> 16;
+  layout->entry.firstClusterLow = first & 0xFFFF;
+  return true;
+}
+
+bool FileSystem::WriteRangeLocked(FileLayout *layout, uint64_t offset,
+                                  uint32_t size, const char *data) {
+  // Small files may be in the cluster cache.
+  if (layout->entry.size <= kMaxCachedFileSize) {
+    cluster_cache_.Erase(ToClusterRanges(layout->extents));
+  }
+  layout->entry.size =
+      std::max<uint64_t>(layout->entry.size, offset + size);
+
+  std::vector<ImageRange> ranges;
+  if (fat32::MapFile(bpb_, ebpb_, *layout, offset, size, &ranges) != size) {
+    spdlog::error("clusters of {} not allocated", layout->path);
+    return false;
+  }
+  const std::vector<char> zeros(
+      data == nullptr ? std::min<uint64_t>(size, kReadChunkSize) : 0, 0);
+  for (const ImageRange &range : ranges) {
+    for (uint64_t done = 0; done < range.size;) {
+      const uint64_t n = data != nullptr
+                             ? range.size - done
+                             : std::min<uint64_t>(range.size - done,
+                                                  zeros.size());
+      if (!device_->Write(range.offset + done, n,
+                          data != nullptr ? data : zeros.data())) {
+        return false;
+      }
+      if (data != nullptr) {
+        data += n;
+      }
+      done += n;
+    }
+  }
+  return true;
+}
+
+void FileSystem::UpdateEntryLocked(const FileLayout &layout,
+                                   time_t modified) {
+  DirectoryEntry entry = layout.entry;
+  EncodeDatetime(modified, &entry.lastModificationDate,
+                 &entry.lastModificationTime);
+  entry.lastAccessedDate = entry.lastModificationDate;
+  if (!entry.IsDirectory()) {
+    entry.attributes |= kAttrArchive;
+  }
+
+  // Layouts resolved before a shrink would read past the new end, or
+  // clusters freed since.
+  DirectoryEntry previous;
+  if (GetEntryLocked(layout.path, &previous) && entry.size < previous.size) {
+    generation_++;
+  }
+
+  absl::string_view parent;
+  absl::string_view name;
+  SplitPath(layout.path, &parent, &name);
+  dirty_entries_[entry.location] = {std::string(parent), entry};
+  dentry_cache_.PutEntry(layout.path, entry);
+}
+
+bool Refresher::Refresh(LatencyHistogram *latency) {
+  std::lock_guard lock(mutex_);
+  const auto now = std::chrono::steady_clock::now();
+  if (now - last_refresh_ < interval_) {
+    return true;
+  }
+  spdlog::debug("refresh fs");
+  last_refresh_ = now;
+  const bool refreshed = fs_->Refresh();
+  if (latency != nullptr) {
+    latency->Record(std::chrono::steady_clock::now() - now);
+  }
+  return refreshed;
+}
+
 }  // namespace fat32
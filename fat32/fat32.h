@@ -1,30 +1,119 @@
 #pragma once
 
-#include <fstream>
+#include <chrono>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <shared_mutex>
 #include <string>
 #include <vector>
 
 #include "absl/strings/string_view.h"
+#include "block_device.h"
+#include "cluster_cache.h"
+#include "dentry_cache.h"
+#include "file_allocation_table.h"
+#include "stats.h"
+#include "tree_diff.h"
 #include "types.h"
 
 namespace fat32 {
 
+// A file resolved once for repeated reads.
+struct FileLayout {
+  // Path of the file, relative to the root.
+  std::string path;
+  DirectoryEntry entry;
+  std::vector<Extent> extents;
+  // File offset where each extent starts, so that the extent holding an
+  // offset is found with a binary search.
+  std::vector<uint64_t> extent_offsets;
+  // FileSystem::Generation() when the layout was resolved. The layout may
+  // be stale once the generation changed.
+  uint64_t generation;
+};
+
+// A byte range of the image file.
+struct ImageRange {
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Size of the data region, in clusters.
+struct SpaceStats {
+  uint64_t cluster_size = 0;
+  uint32_t clusters = 0;
+  uint32_t free_clusters = 0;
+};
+
 // The FileSystem provides APIs to get info from FAT32 image file.
 // References:
 // 1. https://github.com/Vitaspiros/FATReader
 // 2. https://academy.cba.mit.edu/classes/networking_communications/SD/FAT.pdf
 // 3. https://wiki.osdev.org/FAT#FAT_32
 // 4. https://www.cs.uni.edu/~diesburg/courses/cop4610_fall10/
+//
+// ListDirectory, GetEntry, GetFileLayout and the positional ReadFile keep
+// no per-call state and may be called concurrently, also with Refresh. The
+// ChangeDirectory family works on a shared current directory and is meant
+// for single-threaded tools.
+//
+// An image opened writable may also be changed. File data and new
+// directory entries are written through at once, while the FAT, the
+// FSInfo sector and the sizes of the files being written are kept in
+// memory and written back together by Flush, so that a large upload does
+// not rewrite them for every write. Listings show the new sizes once
+// flushed.
 class FileSystem {
  public:
-  FileSystem(const std::string& image_file);
+  // `cluster_cache_size` is the memory budget of the cluster cache in
+  // bytes, 0 disables it.
+  FileSystem(const std::string& image_file,
+             BlockDeviceType device_type = BlockDeviceType::kMmap,
+             uint64_t cluster_cache_size = 16 << 20, bool writable = false);
 
+  // Brings the file system up to date with the image. The whole FAT is
+  // compared and every cached directory read again, since the host
+  // rewrites directory clusters in place without touching the FAT, so a
+  // refresh costs O(FAT + cached directories), the latter bounded by the
+  // dentry cache. Only what changed is parsed again and invalidated:
+  // directories whose chain and content are unchanged are kept as they
+  // are. The image is only fully re-initialized if its boot sector
+  // changed. Changes made through this file system are written back
+  // first; if that fails, the image is not read, they are kept for the
+  // next refresh and false is returned.
   bool Refresh();
 
+  // Incremented every time a refresh finds a change, and by changes made
+  // through this file system once readers must see them: when clusters
+  // are allocated or freed, and when changed entries are written back.
+  // Until then, a file growing within its clusters only shows in its entry.
+  uint64_t Generation() const {
+    std::shared_lock lock(mutex_);
+    return generation_;
+  }
+
   bool IsValid() const { return valid_; };
 
+  // Takes a snapshot of the tree at `path` for DiffSnapshots. Directories
+  // already read are taken from the cache, as left by the last refresh.
+  bool Snapshot(absl::string_view path, TreeSnapshot* snapshot) const;
+
   bool IsPathExists(absl::string_view& path) const;
 
+  // Lists the directory at `path`, relative to the root ("" for the root).
+  bool ListDirectory(absl::string_view path,
+                     std::vector<DirectoryEntry>* entries) const;
+
+  // Like ListDirectory, but shares the cached listing instead of copying
+  // it. Returns nullptr if `path` is not a directory.
+  std::shared_ptr<const Directory> OpenDirectory(absl::string_view path) const;
+
+  // Gets the entry of the file or directory at `path`, relative to the root.
+  bool GetEntry(absl::string_view path, DirectoryEntry* entry) const;
+
   bool ChangeDirectory(absl::string_view path, bool parent = false);
 
   const std::vector<DirectoryEntry>& CurrentDirectoryEntries() const {
@@ -42,27 +131,186 @@ class FileSystem {
   bool ReadFile(absl::string_view path, char* out);
 
   uint32_t ReadFile(const DirectoryEntry& entry, uint32_t offset, uint32_t size,
-                    char* out);
+                    char* out) const;
+
+  // Resolves the file at `path` and its cluster chain.
+  bool GetFileLayout(absl::string_view path, FileLayout* layout) const;
+
+  // Like ReadFile(entry, ...), without walking the cluster chain again.
+  uint32_t ReadFile(const FileLayout& layout, uint32_t offset, uint32_t size,
+                    char* out) const;
+
+  // Maps [offset, offset + size) of the file to the ranges of the image
+  // holding it, for callers reading the image file themselves. `device` is
+  // set to the device of the image, which stays open as long as it is held
+  // even if a refresh reopens the image. Returns the number of bytes
+  // mapped.
+  uint32_t MapFile(const FileLayout& layout, uint32_t offset, uint32_t size,
+                   std::vector<ImageRange>* ranges,
+                   std::shared_ptr<const BlockDevice>* device) const;
 
   DirectoryEntry GetPathInfo(absl::string_view path);
 
+  ClusterCacheStats GetClusterCacheStats() const {
+    return cluster_cache_.Stats();
+  }
+
+  // Reads of the image since the file system was created, across reopens.
+  BlockDeviceStats GetBlockDeviceStats() const;
+
+  // Exact free space, kept up to date by Refresh and by writes without
+  // scanning the FAT.
+  SpaceStats GetSpaceStats() const;
+
+  // Runs of free clusters, in cluster order. Where new files will go, many
+  // short runs mean that they will be fragmented.
+  std::vector<Extent> GetFreeExtents() const;
+
+  bool IsWritable() const { return writable_; }
+
+  // Creates an empty file. Fails if the parent directory does not exist,
+  // if an entry of the same name, ignoring case, exists, or if the name is
+  // not a valid long filename, see IsValidLongFilename.
+  bool CreateFile(absl::string_view path);
+
+  // Creates an empty directory, with the same checks as CreateFile.
+  bool MakeDirectory(absl::string_view path);
+
+  // Removes a file, not a directory, and frees its clusters.
+  bool Unlink(absl::string_view path);
+
+  // Shrinks or grows, with zeros, the file at `path` to `size` bytes.
+  bool Truncate(absl::string_view path, uint32_t size);
+
+  // Sets the last modification time of the file or directory at `path`,
+  // to the precision of FAT, 2 seconds. The root has no entry to set it in.
+  bool SetModificationTime(absl::string_view path, time_t timestamp);
+
+  // Writes `size` bytes of `data` at `offset` of the file of `layout`,
+  // from GetFileLayout, growing the file as needed. The gap between the end
+  // of the file and `offset` is filled with zeros. `layout` is updated,
+  // and re-resolved first if stale. Returns the number of bytes written.
+  uint32_t WriteFile(FileLayout* layout, uint32_t offset, uint32_t size,
+                     const char* data);
+
+  // Writes back what is kept in memory. With `sync`, also waits for all
+  // the writes to reach the storage.
+  bool Flush(bool sync = false);
+
  private:
   void Initialize(const std::string& image_file);
 
+  bool RefreshIncrementally();
+
+  // Reads the directory starting at `first_cluster`. Returns `cached` if
+  // it is still up to date, `changed_clusters` tells which FAT entries
+  // changed since it was read.
+  std::shared_ptr<const Directory> LoadDirectoryLocked(
+      uint32_t first_cluster, const std::shared_ptr<const Directory>& cached,
+      const std::vector<ClusterRange>& changed_clusters) const;
+
   bool ReadFile(const DirectoryEntry& entry, std::ostream& os);
 
+  // Reads small files through the cluster cache.
+  uint32_t ReadFileLocked(const FileLayout& layout, uint32_t offset,
+                          uint32_t size, char* out) const;
+
+  std::shared_ptr<const Directory> OpenDirectoryLocked(
+      absl::string_view path) const;
+
+  bool GetEntryLocked(absl::string_view path, DirectoryEntry* entry) const;
+
+  // Writes back the changes in an order that keeps the image consistent
+  // if interrupted: new chains and FSInfo, then the entries pointing at
+  // them, then the release of the freed chains. Entries are kept until
+  // they are written.
+  bool FlushLocked();
+
+  // Writes the changed parts of the FAT and the FSInfo sector.
+  bool FlushFatLocked();
+
+  // Updates the FSInfo sector from the FAT.
+  bool WriteFsInfoLocked();
+
+  // Re-reads the directory at `path` after it was written to.
+  bool ReloadDirectoryLocked(const std::string& path);
+
+  // Adds `entry` named `name` to the directory at `parent`, with a long
+  // filename if needed, and sets `entry` to what was added.
+  bool AddEntryLocked(absl::string_view parent, absl::string_view name,
+                      DirectoryEntry* entry);
+
+  // Allocates clusters so that the file of `layout` holds `size` bytes.
+  bool ReserveLocked(FileLayout* layout, uint64_t size);
+
+  // Writes `data`, or zeros if nullptr, at `offset` of the file of
+  // `layout`, which must have its clusters allocated, and sets the size of
+  // the file to at least `offset` + `size`.
+  bool WriteRangeLocked(FileLayout* layout, uint64_t offset, uint32_t size,
+                        const char* data);
+
+  // Records that the entry of the file of `layout` changed, last modified
+  // at `modified`. Starts a new generation if the file got smaller.
+  void UpdateEntryLocked(const FileLayout& layout, time_t modified);
+
  private:
-  const std::string& image_file_;
-  std::ifstream in_;
+  // A changed entry of a file, not written back yet.
+  struct DirtyEntry {
+    std::string parent;
+    DirectoryEntry entry;
+  };
+
+  // Guards everything below against Refresh.
+  mutable std::shared_mutex mutex_;
+  const std::string image_file_;
+  const BlockDeviceType device_type_;
+  const bool writable_;
+  // Shared with the callers of MapFile.
+  std::shared_ptr<BlockDevice> device_;
+  // Reads of the devices closed by a refresh.
+  BlockDeviceStats closed_device_stats_;
   bool valid_ = false;
+  uint64_t generation_ = 0;
   std::string current_path_;
 
+  char boot_sector_[512];
   BiosParameterBlock bpb_;
   ExtendedBiosParameterBlock ebpb_;
-  /* FileAllocationTable fat_; */
+  FileAllocationTable fat_;
   FileSystemInformation fs_info_;
   std::vector<DirectoryEntry> root_dir_entries_;
   std::vector<DirectoryEntry> current_dir_entries_;
-  };
+  mutable DentryCache dentry_cache_;
+  // Directory clusters and small files. Directories are read from the
+  // image, and the cache updated, while refreshing.
+  mutable ClusterCache cluster_cache_;
+  // Keyed by location, so that they are written back in order.
+  std::map<uint64_t, DirtyEntry> dirty_entries_;
+};
+
+// Seconds between refreshes by a Refresher. A refresh compares the whole
+// FAT, see FileSystem::Refresh, so the image is not scanned more often than
+// the host writes clips.
+constexpr double kMinRefreshInterval = 5.0;
+
+// Refreshes a file system on behalf of the requests of a mount or a server,
+// at most once per interval so that a burst of requests costs one refresh.
+class Refresher {
+ public:
+  explicit Refresher(FileSystem* fs, double interval = kMinRefreshInterval)
+      : fs_(fs), interval_(interval) {}
+
+  // Refreshes unless the last refresh is more recent than the interval.
+  // Callers arriving during a refresh wait for it. Records the latency of
+  // actual refreshes in `latency` if not null. Returns false if the
+  // refresh failed.
+  bool Refresh(LatencyHistogram* latency = nullptr);
+
+ private:
+  FileSystem* const fs_;
+  const std::chrono::duration<double> interval_;
+  std::mutex mutex_;
+  std::chrono::steady_clock::time_point last_refresh_;
+};
 
 }  // namespace fat32
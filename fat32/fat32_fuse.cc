@@ -1,157 +1,1131 @@
 #include "fat32_fuse.h"
 
-#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "clip_views.h"
+#include "directory_parser.h"
+#include "readahead.h"
 #include "spdlog/spdlog.h"
+#include "stats.h"
 
 #define FUSE_USE_VERSION 31
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
 namespace fat32 {
 
 namespace fuse {
 
 static FileSystem *fs = nullptr;
-static double last_fs_refresh_time = 0.0;
-constexpr double kMinFsRefreshInterval = 5.0;
+static MountOptions mount_options;
+static std::unique_ptr<Refresher> refresher;
+// Null when readahead is disabled.
+static std::unique_ptr<ReadaheadWorker> readahead_worker;
 
-bool RefreshFs() {
-  const double now = std::chrono::duration_cast<std::chrono::seconds>(
-                         std::chrono::steady_clock::now().time_since_epoch())
-                         .count();
+// Latencies and counters of the mount, read from the stats file.
+struct MountStats {
+  LatencyHistogram lookup;
+  LatencyHistogram getattr;
+  LatencyHistogram readdir;
+  LatencyHistogram open;
+  LatencyHistogram read;
+  LatencyHistogram write;
+  LatencyHistogram refresh;
+  std::atomic<uint64_t> bytes_served{0};
+};
+static MountStats stats;
+
+// A read-only file in the root, generated when opened, with the stats as
+// JSON. Entries never get inode 2, see EntryInode.
+constexpr fuse_ino_t kStatsInode = 2;
+constexpr char kStatsName[] = ".fat32-stats";
+
+bool RefreshFs() { return refresher->Refresh(&stats.refresh); }
+
+// A file or directory the kernel looked up. The kernel refers to it by
+// inode number until it forgets all its lookups.
+struct Inode {
+  std::string path;  // relative to the root
+  uint64_t lookups = 0;
+  // Bumped by every write to the file, through any of its handles.
+  std::shared_ptr<std::atomic<uint64_t>> writes =
+      std::make_shared<std::atomic<uint64_t>>(0);
+};
+
+static std::mutex inodes_mutex;
+// Guarded by inodes_mutex. The root is not in there.
+static absl::flat_hash_map<fuse_ino_t, Inode> inodes;
+
+// Directories of the clip views are numbered past the entries, by path, so
+// that they keep their number when the views are rebuilt. Files of the
+// views are the entries of the clips, under their own numbers and paths.
+// Numbers are never reused, paths gone from the views are dropped once the
+// kernel forgot them.
+constexpr fuse_ino_t kFirstViewInode = fuse_ino_t{1} << 48;
+// Guarded by inodes_mutex.
+static absl::flat_hash_map<std::string, fuse_ino_t> view_inodes;
+static fuse_ino_t next_view_inode = kFirstViewInode;
+
+static std::mutex clip_views_mutex;
+// Guarded by clip_views_mutex. Built when first needed after a refresh.
+static std::shared_ptr<const ClipViews> clip_views;
+// Updates the views, one thread at a time.
+static std::mutex clip_views_builder_mutex;
+static std::unique_ptr<ClipViewsBuilder> clip_views_builder;
+
+// Inode numbers are the position of the entry in the image, counted in
+// entries, so a file keeps its number across lookups and refreshes as long
+// as its entry does not move. Entries are past the reserved sectors, so
+// this never collides with the root.
+fuse_ino_t EntryInode(const DirectoryEntry &entry) {
+  return entry.location / kDirectoryEntrySize;
+}
+
+fuse_ino_t ViewInode(const std::string &path) {
+  std::lock_guard lock(inodes_mutex);
+  const auto [it, inserted] = view_inodes.try_emplace(path, next_view_inode);
+  if (inserted) {
+    next_view_inode++;
+  }
+  return it->second;
+}
+
+// Drops the numbers of the view directories not in `views` anymore and
+// not known to the kernel.
+void PruneViewInodes(const ClipViews &views) {
+  std::lock_guard lock(inodes_mutex);
+  absl::erase_if(view_inodes, [&views](const auto &view) {
+    return views.FindDirectory(view.first) == nullptr &&
+           !inodes.contains(view.second);
+  });
+}
+
+// Returns the views of the current generation. While another thread
+// updates them, the previous views are returned rather than waiting.
+std::shared_ptr<const ClipViews> GetClipViews() {
+  std::shared_ptr<const ClipViews> views;
+  {
+    std::lock_guard lock(clip_views_mutex);
+    views = clip_views;
+  }
+  if (views != nullptr && views->Generation() == fs->Generation()) {
+    return views;
+  }
+  std::unique_lock builder_lock(clip_views_builder_mutex, std::try_to_lock);
+  if (!builder_lock.owns_lock()) {
+    if (views != nullptr) {
+      return views;
+    }
+    builder_lock.lock();
+  }
+  {
+    // Possibly updated while waiting.
+    std::lock_guard lock(clip_views_mutex);
+    views = clip_views;
+  }
+  if (views != nullptr && views->Generation() == fs->Generation()) {
+    return views;
+  }
+
+  views = clip_views_builder->Update(*fs);
+  {
+    std::lock_guard lock(clip_views_mutex);
+    clip_views = views;
+  }
+  PruneViewInodes(*views);
+  return views;
+}
 
-  if (now - last_fs_refresh_time < kMinFsRefreshInterval) {
+bool GetInodePath(fuse_ino_t ino, std::string *path) {
+  if (ino == FUSE_ROOT_ID) {
+    path->clear();
     return true;
   }
+  std::lock_guard lock(inodes_mutex);
+  const auto it = inodes.find(ino);
+  if (it == inodes.end()) {
+    return false;
+  }
+  *path = it->second.path;
+  return true;
+}
+
+// Returns the write counter of the file `ino`, shared by its handles.
+std::shared_ptr<std::atomic<uint64_t>> GetInodeWrites(fuse_ino_t ino) {
+  std::lock_guard lock(inodes_mutex);
+  const auto it = inodes.find(ino);
+  if (it == inodes.end()) {
+    return std::make_shared<std::atomic<uint64_t>>(0);
+  }
+  return it->second.writes;
+}
+
+// Resolves `ino` to the current entry at its path. Fails if the entry
+// moved or is gone since it was looked up.
+bool GetInodeEntry(fuse_ino_t ino, std::string *path, DirectoryEntry *entry) {
+  return GetInodePath(ino, path) && fs->GetEntry(*path, entry) &&
+         EntryInode(*entry) == ino;
+}
+
+void FillStat(fuse_ino_t ino, const DirectoryEntry &entry, struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = ino;
+  const mode_t writable = mount_options.read_write ? 0200 : 0;
+  if (entry.IsDirectory()) {
+    st->st_mode = S_IFDIR | 0555 | writable;
+  } else {
+    st->st_mode = S_IFREG | 0444 | writable;
+  }
+  st->st_nlink = 1;
+  st->st_size = entry.size;
+  st->st_mtim.tv_sec = entry.LastModificationDatetime().ToTimestamp();
+  st->st_ctim.tv_sec = entry.CreationDatetime().ToTimestamp();
+}
+
+void FillStatsStat(struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = kStatsInode;
+  st->st_mode = S_IFREG | 0444;
+  st->st_nlink = 1;
+  // The size is only known once generated, the file is read with direct
+  // I/O.
+}
+
+std::string FormatStats() {
+  std::string out = "{\"operations\":{";
+  const std::pair<const char *, const LatencyHistogram *> operations[] = {
+      {"lookup", &stats.lookup}, {"getattr", &stats.getattr},
+      {"readdir", &stats.readdir}, {"open", &stats.open},
+      {"read", &stats.read}, {"write", &stats.write}};
+  for (size_t i = 0; i < std::size(operations); i++) {
+    absl::StrAppend(&out, i == 0 ? "" : ",", "\"", operations[i].first,
+                    "\":");
+    operations[i].second->AppendJson(&out);
+  }
+
+  const BlockDeviceStats device = fs->GetBlockDeviceStats();
+  absl::StrAppend(&out, "},\"bytes_served\":",
+                  stats.bytes_served.load(std::memory_order_relaxed),
+                  ",\"block_device\":{\"reads\":", device.reads,
+                  ",\"bytes_read\":", device.bytes_read,
+                  ",\"seeks\":", device.seeks, "},\"refresh\":");
+  stats.refresh.AppendJson(&out);
+
+  const SpaceStats space = fs->GetSpaceStats();
+  absl::StrAppend(&out, ",\"space\":{\"cluster_size\":", space.cluster_size,
+                  ",\"clusters\":", space.clusters,
+                  ",\"free_clusters\":", space.free_clusters, "}");
+
+  const ClusterCacheStats cache = fs->GetClusterCacheStats();
+  const uint64_t lookups = cache.hits + cache.misses;
+  absl::StrAppend(&out, ",\"generation\":", fs->Generation(),
+                  ",\"cluster_cache\":{\"hits\":", cache.hits,
+                  ",\"misses\":", cache.misses,
+                  ",\"evictions\":", cache.evictions,
+                  ",\"size\":", cache.size, ",\"capacity\":", cache.capacity,
+                  ",\"hit_rate\":",
+                  lookups > 0 ? static_cast<double>(cache.hits) / lookups : 0.0,
+                  "}}\n");
+  return out;
+}
+
+void FillViewStat(fuse_ino_t ino, struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = ino;
+  st->st_mode = S_IFDIR | 0555;
+  st->st_nlink = 2;
+}
+
+void FillRootStat(struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = FUSE_ROOT_ID;
+  st->st_mode = S_IFDIR | 0755;
+  st->st_nlink = 2;
+}
+
+// Records a lookup of the entry at `path` handed to the kernel.
+void AddLookup(fuse_ino_t ino, std::string path) {
+  std::lock_guard lock(inodes_mutex);
+  Inode &inode = inodes[ino];
+  inode.path = std::move(path);
+  inode.lookups++;
+}
+
+void Forget(fuse_ino_t ino, uint64_t nlookup) {
+  std::lock_guard lock(inodes_mutex);
+  const auto it = inodes.find(ino);
+  if (it == inodes.end()) {
+    return;
+  }
+  if (it->second.lookups <= nlookup) {
+    inodes.erase(it);
+  } else {
+    it->second.lookups -= nlookup;
+  }
+}
+
+// Sets `path` to the path of `name` in the directory `parent`.
+bool GetChildPath(fuse_ino_t parent, const char *name, std::string *path) {
+  if (!GetInodePath(parent, path)) {
+    return false;
+  }
+  *path = path->empty() ? name : *path + "/" + name;
+  return true;
+}
+
+// Whether `name` in the directory at `parent` is in a clip view, where
+// nothing can be created or removed.
+bool InClipViews(const std::string &parent, const char *name) {
+  return IsClipViewPath(parent.empty() ? name : parent);
+}
+
+// Whether the directory at `parent` has an entry named `name`, ignoring
+// case as FAT does.
+bool HasEntry(absl::string_view parent, absl::string_view name) {
+  std::shared_ptr<const Directory> directory = fs->OpenDirectory(parent);
+  if (directory == nullptr) {
+    return false;
+  }
+  return std::any_of(directory->Entries().begin(), directory->Entries().end(),
+                     [name](const DirectoryEntry &entry) {
+                       return absl::EqualsIgnoreCase(entry.name, name);
+                     });
+}
+
+// Replies with the entry at `path`, which counts as a lookup. The volume
+// label is not a file.
+void ReplyEntry(fuse_req_t req, std::string path) {
+  DirectoryEntry entry;
+  if (!fs->GetEntry(path, &entry) || entry.IsVolumeIdEntry()) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  e.ino = EntryInode(entry);
+  e.attr_timeout = mount_options.attr_timeout;
+  e.entry_timeout = mount_options.entry_timeout;
+  FillStat(e.ino, entry, &e.attr);
+  AddLookup(e.ino, std::move(path));
+  fuse_reply_entry(req, &e);
+}
+
+// Replies with the directory or the clip at `path` in a view, which counts
+// as a lookup.
+void ReplyViewEntry(fuse_req_t req, std::string path) {
+  const std::shared_ptr<const ClipViews> views = GetClipViews();
+  if (views->FindDirectory(path) == nullptr) {
+    const ClipViewFile *file = views->FindFile(path);
+    if (file == nullptr) {
+      fuse_reply_err(req, ENOENT);
+    } else {
+      ReplyEntry(req, file->path);
+    }
+    return;
+  }
 
-  spdlog::debug("refresh fs");
-  last_fs_refresh_time = now;
-  return fs->Refresh();
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  e.ino = ViewInode(path);
+  e.attr_timeout = mount_options.attr_timeout;
+  e.entry_timeout = mount_options.entry_timeout;
+  FillViewStat(e.ino, &e.attr);
+  AddLookup(e.ino, std::move(path));
+  fuse_reply_entry(req, &e);
 }
 
-static int getattr(const char *path, struct stat *stbuf,
-                   struct fuse_file_info * /*fi*/) {
-  spdlog::debug("getattr: {}", path);
+static void lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  spdlog::debug("lookup: {} {}", parent, name);
+  ScopedLatency latency(&stats.lookup);
+
+  if (parent == FUSE_ROOT_ID && strcmp(name, kStatsName) == 0) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = kStatsInode;
+    e.attr_timeout = mount_options.attr_timeout;
+    e.entry_timeout = mount_options.entry_timeout;
+    FillStatsStat(&e.attr);
+    fuse_reply_entry(req, &e);
+    return;
+  }
+
+  if (!RefreshFs()) {
+    fuse_reply_err(req, EAGAIN);
+    return;
+  }
 
-  memset(stbuf, 0, sizeof(struct stat));
-  if (strcmp(path, "/") == 0) {
-    stbuf->st_mode = S_IFDIR | 0755;
-    stbuf->st_nlink = 2;
+  // The on-disk dot entries would get their own inode numbers.
+  std::string path;
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+      !GetChildPath(parent, name, &path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  if (IsClipViewPath(path)) {
+    ReplyViewEntry(req, std::move(path));
   } else {
-    std::string filename(path + 1);  // +1 to skip the leading '/'.
+    ReplyEntry(req, std::move(path));
+  }
+}
 
-    if (!RefreshFs()) {
-      return -EAGAIN;
+static void forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  Forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void forget_multi(fuse_req_t req, size_t count,
+                         struct fuse_forget_data *forgets) {
+  for (size_t i = 0; i < count; i++) {
+    Forget(forgets[i].ino, forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void getattr(fuse_req_t req, fuse_ino_t ino,
+                    struct fuse_file_info * /*fi*/) {
+  spdlog::debug("getattr: {}", ino);
+  ScopedLatency latency(&stats.getattr);
+
+  struct stat st;
+  if (ino == FUSE_ROOT_ID) {
+    FillRootStat(&st);
+    fuse_reply_attr(req, &st, mount_options.attr_timeout);
+    return;
+  }
+  if (ino == kStatsInode) {
+    FillStatsStat(&st);
+    fuse_reply_attr(req, &st, mount_options.attr_timeout);
+    return;
+  }
+
+  if (!RefreshFs()) {
+    fuse_reply_err(req, EAGAIN);
+    return;
+  }
+
+  std::string path;
+  DirectoryEntry entry;
+  if (GetInodePath(ino, &path) && IsClipViewPath(path)) {
+    if (GetClipViews()->FindDirectory(path) == nullptr) {
+      fuse_reply_err(req, ENOENT);
+      return;
     }
-    fs->ChangeDirectory(filename, true);
+    FillViewStat(ino, &st);
+    fuse_reply_attr(req, &st, mount_options.attr_timeout);
+    return;
+  }
+  if (!GetInodeEntry(ino, &path, &entry)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  FillStat(ino, entry, &st);
+  fuse_reply_attr(req, &st, mount_options.attr_timeout);
+}
 
-    const char kPathDelimeter = '/';
-    const auto &pos = filename.find_last_of(kPathDelimeter);
+// Only the size and the modification time can be changed, FAT has no
+// owners nor permissions. The access time, kept as a date, follows the
+// modification time.
+static void setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                    int to_set, struct fuse_file_info *fi) {
+  spdlog::debug("setattr: {} {}", ino, to_set);
+
+  if ((to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID |
+                 FUSE_SET_ATTR_GID)) != 0) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+  const bool set_size = (to_set & FUSE_SET_ATTR_SIZE) != 0;
+  const bool set_mtime =
+      (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)) != 0;
+  if (set_size || set_mtime) {
+    std::string path;
+    DirectoryEntry entry;
+    if (!mount_options.read_write || ino == FUSE_ROOT_ID ||
+        ino == kStatsInode) {
+      fuse_reply_err(req, EROFS);
+      return;
+    }
+    if (!GetInodeEntry(ino, &path, &entry)) {
+      fuse_reply_err(req, ENOENT);
+      return;
+    }
+    if (set_size && entry.IsDirectory()) {
+      fuse_reply_err(req, EISDIR);
+      return;
+    }
+    if (set_size && attr->st_size > UINT32_MAX) {
+      fuse_reply_err(req, EFBIG);
+      return;
+    }
+    if (set_size && !fs->Truncate(path, attr->st_size)) {
+      fuse_reply_err(req, EIO);
+      return;
+    }
+    // After the size, which sets the modification time to now.
+    if (set_mtime &&
+        !fs->SetModificationTime(path,
+                                 (to_set & FUSE_SET_ATTR_MTIME_NOW) != 0
+                                     ? time(nullptr)
+                                     : attr->st_mtim.tv_sec)) {
+      fuse_reply_err(req, EIO);
+      return;
+    }
+  }
+  getattr(req, ino, fi);
+}
+
+// State of an open directory, kept in fuse_file_info::fh.
+struct DirectoryHandle {
+  // A snapshot of the listing, so that offsets stay valid across readdir
+  // calls even if a refresh changes the directory.
+  std::shared_ptr<const Directory> directory;
+  // Or the directory of a clip view, which the views keep alive.
+  std::shared_ptr<const ClipViews> views;
+  const ClipViewDirectory *view = nullptr;
+  std::string path;
+  fuse_ino_t parent;
+};
+
+static void opendir(fuse_req_t req, fuse_ino_t ino,
+                    struct fuse_file_info *fi) {
+  spdlog::debug("opendir: {}", ino);
+
+  if (!RefreshFs()) {
+    fuse_reply_err(req, EAGAIN);
+    return;
+  }
+
+  std::string path;
+  if (!GetInodePath(ino, &path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  auto handle = std::make_unique<DirectoryHandle>();
+  const auto pos = path.find_last_of('/');
+  handle->parent = FUSE_ROOT_ID;
+  if (IsClipViewPath(path)) {
+    handle->views = GetClipViews();
+    handle->view = handle->views->FindDirectory(path);
+    if (handle->view == nullptr) {
+      fuse_reply_err(req, ENOENT);
+      return;
+    }
     if (pos != std::string::npos) {
-      filename = filename.substr(pos + 1);
+      handle->parent = ViewInode(path.substr(0, pos));
+    }
+  } else {
+    handle->directory = fs->OpenDirectory(path);
+    if (handle->directory == nullptr) {
+      fuse_reply_err(req, ENOTDIR);
+      return;
+    }
+    DirectoryEntry parent;
+    if (pos != std::string::npos &&
+        fs->GetEntry(path.substr(0, pos), &parent)) {
+      handle->parent = EntryInode(parent);
+    }
+  }
+  handle->path = path;
+
+  fi->fh = reinterpret_cast<uint64_t>(handle.release());
+  fuse_reply_open(req, fi);
+}
+
+// Like ReadDirectory, for a directory of a clip view. Offsets 0 and 1 are
+// "." and "..", then the subdirectories and the files.
+void ReadViewDirectory(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       const DirectoryHandle &handle, bool plus) {
+  const ClipViewDirectory &view = *handle.view;
+  const size_t count = view.directories.size() + view.files.size() + 2;
+  std::vector<char> buf(size);
+  size_t used = 0;
+  for (size_t i = off; i < count; i++) {
+    const char *name;
+    std::string path;
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    if (i < 2) {
+      name = i == 0 ? "." : "..";
+      e.attr.st_ino = i == 0 ? ino : handle.parent;
+      e.attr.st_mode = S_IFDIR;
+    } else if (i - 2 < view.directories.size()) {
+      name = view.directories[i - 2].c_str();
+      path = handle.path + "/" + name;
+      e.ino = ViewInode(path);
+      FillViewStat(e.ino, &e.attr);
+    } else {
+      const ClipViewFile &file = view.files[i - 2 - view.directories.size()];
+      name = file.name.c_str();
+      path = file.path;
+      e.ino = EntryInode(file.entry);
+      FillStat(e.ino, file.entry, &e.attr);
     }
+    e.attr_timeout = mount_options.attr_timeout;
+    e.entry_timeout = mount_options.entry_timeout;
 
-    const auto &entries = fs->CurrentDirectoryEntries();
-    const auto &it = std::find_if(
-        entries.cbegin(), entries.cend(),
-        [&filename](const auto &entry) { return entry.name == filename; });
-    if (it == entries.cend()) {
-      return -ENOENT;
+    const size_t n =
+        plus ? fuse_add_direntry_plus(req, buf.data() + used, size - used,
+                                      name, &e, i + 1)
+             : fuse_add_direntry(req, buf.data() + used, size - used, name,
+                                 &e.attr, i + 1);
+    if (n > size - used) {
+      break;
+    }
+    used += n;
+    if (plus && i >= 2) {
+      AddLookup(e.ino, std::move(path));
     }
-    if (it->IsDirectory()) {
-      stbuf->st_mode = S_IFDIR | 0555;
+  }
+  fuse_reply_buf(req, buf.data(), used);
+}
+
+// Replies to readdir and readdirplus. With `plus`, each entry comes with
+// its attributes and counts as a lookup, which saves the kernel a lookup
+// and a getattr per entry when listing.
+void ReadDirectory(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                   struct fuse_file_info *fi, bool plus) {
+  ScopedLatency latency(&stats.readdir);
+  auto *handle = reinterpret_cast<DirectoryHandle *>(fi->fh);
+  if (handle->view != nullptr) {
+    ReadViewDirectory(req, ino, size, off, *handle, plus);
+    return;
+  }
+  const std::vector<DirectoryEntry> &entries = handle->directory->Entries();
+
+  // Offsets 0 and 1 are "." and "..", then the entries of the directory,
+  // and in the root the stats file and the clip views.
+  const size_t count = entries.size() + (ino == FUSE_ROOT_ID ? 5 : 2);
+  std::vector<char> buf(size);
+  size_t used = 0;
+  for (size_t i = off; i < count; i++) {
+    const char *name;
+    const DirectoryEntry *entry = nullptr;
+    const char *view = nullptr;
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    if (i == 0) {
+      name = ".";
+      e.attr.st_ino = ino;
+      e.attr.st_mode = S_IFDIR;
+    } else if (i == 1) {
+      name = "..";
+      e.attr.st_ino = handle->parent;
+      e.attr.st_mode = S_IFDIR;
+    } else if (i == entries.size() + 2) {
+      name = kStatsName;
+      e.ino = kStatsInode;
+      e.attr_timeout = mount_options.attr_timeout;
+      e.entry_timeout = mount_options.entry_timeout;
+      FillStatsStat(&e.attr);
+    } else if (i > entries.size() + 2) {
+      view = i == entries.size() + 3 ? kClipsByTime : kClipsByCamera;
+      name = view;
+      e.ino = ViewInode(view);
+      e.attr_timeout = mount_options.attr_timeout;
+      e.entry_timeout = mount_options.entry_timeout;
+      FillViewStat(e.ino, &e.attr);
     } else {
-      stbuf->st_mode = S_IFREG | 0444;
+      entry = &entries[i - 2];
+      if (entry->name == "." || entry->name == ".." ||
+          entry->IsVolumeIdEntry()) {
+        continue;
+      }
+      name = entry->name.c_str();
+      e.ino = EntryInode(*entry);
+      if (plus) {
+        e.attr_timeout = mount_options.attr_timeout;
+        e.entry_timeout = mount_options.entry_timeout;
+        FillStat(e.ino, *entry, &e.attr);
+      } else {
+        e.attr.st_ino = e.ino;
+        e.attr.st_mode = entry->IsDirectory() ? S_IFDIR : S_IFREG;
+      }
+    }
+
+    const size_t n =
+        plus ? fuse_add_direntry_plus(req, buf.data() + used, size - used,
+                                      name, &e, i + 1)
+             : fuse_add_direntry(req, buf.data() + used, size - used, name,
+                                 &e.attr, i + 1);
+    if (n > size - used) {
+      break;
+    }
+    used += n;
+    // The kernel takes a reference on every entry but the dot ones.
+    if (plus && entry != nullptr) {
+      AddLookup(e.ino, handle->path.empty()
+                           ? entry->name
+                           : handle->path + "/" + entry->name);
+    } else if (plus && view != nullptr) {
+      AddLookup(e.ino, view);
     }
-    stbuf->st_nlink = 1;
-    stbuf->st_size = it->size;
-    stbuf->st_mtim.tv_sec = it->LastModificationDatetime().ToTimestamp();
-    stbuf->st_ctim.tv_sec = it->CreationDatetime().ToTimestamp();
   }
-  return 0;
+  fuse_reply_buf(req, buf.data(), used);
 }
 
-static int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                   off_t /*offset*/, struct fuse_file_info * /*fi*/,
-                   enum fuse_readdir_flags /*flags*/) {
-  spdlog::debug("readdir: {}", path);
+static void readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi) {
+  spdlog::debug("readdir: {} {}", ino, off);
+  ReadDirectory(req, ino, size, off, fi, /*plus=*/false);
+}
+
+static void readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                        off_t off, struct fuse_file_info *fi) {
+  spdlog::debug("readdirplus: {} {}", ino, off);
+  ReadDirectory(req, ino, size, off, fi, /*plus=*/true);
+}
 
-  if (strcmp(path, "/") == 0) {
-    filler(buf, ".", nullptr, 0, FUSE_FILL_DIR_PLUS);
-    filler(buf, "..", nullptr, 0, FUSE_FILL_DIR_PLUS);
+static void releasedir(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  spdlog::debug("releasedir: {}", ino);
+  delete reinterpret_cast<DirectoryHandle *>(fi->fh);
+  fuse_reply_err(req, 0);
+}
+
+// Sizes in clusters, from the free count kept with the FAT, so that it is
+// cheap enough to poll.
+static void statfs(fuse_req_t req, fuse_ino_t ino) {
+  spdlog::debug("statfs: {}", ino);
+
+  if (!RefreshFs()) {
+    fuse_reply_err(req, EAGAIN);
+    return;
   }
 
-  std::string path_str(path + 1);  // +1 to skip the leading '/'.
+  const SpaceStats space = fs->GetSpaceStats();
+  struct statvfs st;
+  memset(&st, 0, sizeof(st));
+  st.f_bsize = space.cluster_size;
+  st.f_frsize = space.cluster_size;
+  st.f_blocks = space.clusters;
+  st.f_bfree = space.free_clusters;
+  st.f_bavail = space.free_clusters;
+  st.f_namemax = 255;
+  if (!mount_options.read_write) {
+    st.f_flag = ST_RDONLY;
+  }
+  fuse_reply_statfs(req, &st);
+}
+
+static void mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                  mode_t /*mode*/) {
+  spdlog::debug("mkdir: {} {}", parent, name);
+
+  std::string path;
+  if (!mount_options.read_write) {
+    fuse_reply_err(req, EROFS);
+    return;
+  }
+  if (!GetInodePath(parent, &path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  if (InClipViews(path, name)) {
+    fuse_reply_err(req, EROFS);
+    return;
+  }
+  if (!IsValidLongFilename(name)) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  if (HasEntry(path, name)) {
+    fuse_reply_err(req, EEXIST);
+    return;
+  }
+  path = path.empty() ? name : path + "/" + name;
+  if (!fs->MakeDirectory(path)) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  ReplyEntry(req, std::move(path));
+}
+
+static void unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  spdlog::debug("unlink: {} {}", parent, name);
+
+  std::string path;
+  DirectoryEntry entry;
+  if (!mount_options.read_write) {
+    fuse_reply_err(req, EROFS);
+  } else if (!GetChildPath(parent, name, &path)) {
+    fuse_reply_err(req, ENOENT);
+  } else if (IsClipViewPath(path)) {
+    fuse_reply_err(req, EROFS);
+  } else if (!fs->GetEntry(path, &entry)) {
+    fuse_reply_err(req, ENOENT);
+  } else if (entry.IsDirectory()) {
+    fuse_reply_err(req, EISDIR);
+  } else {
+    fuse_reply_err(req, fs->Unlink(path) ? 0 : EIO);
+  }
+}
+
+// State of an open file, kept in fuse_file_info::fh.
+struct FileHandle {
+  std::string path;
+
+  std::mutex mutex;
+  // Guarded by mutex. Replaced when a refresh may have changed the file.
+  std::shared_ptr<const FileLayout> layout;
+
+  // The write counter of the inode.
+  std::shared_ptr<std::atomic<uint64_t>> writes;
+  // Null when readahead is disabled.
+  std::shared_ptr<FileReadahead> readahead;
+};
+
+// State of an open stats file, kept in fuse_file_info::fh.
+struct StatsHandle {
+  // Generated when opened, so that all reads see the same stats.
+  std::string content;
+};
+
+static void open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  spdlog::debug("open: {}", ino);
+  ScopedLatency latency(&stats.open);
+
+  const bool writing = (fi->flags & O_ACCMODE) != O_RDONLY;
+  if (writing && ino == kStatsInode) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+  if (writing && !mount_options.read_write) {
+    fuse_reply_err(req, EROFS);
+    return;
+  }
+  if (ino == kStatsInode) {
+    auto handle = std::make_unique<StatsHandle>();
+    handle->content = FormatStats();
+    fi->fh = reinterpret_cast<uint64_t>(handle.release());
+    fi->direct_io = 1;
+    fuse_reply_open(req, fi);
+    return;
+  }
   if (!RefreshFs()) {
-    return -EAGAIN;
+    fuse_reply_err(req, EAGAIN);
+    return;
   }
-  fs->ChangeDirectory(path_str);
-  for (const auto &entry : fs->CurrentDirectoryEntries()) {
-    filler(buf, entry.name.data(), nullptr, 0, FUSE_FILL_DIR_PLUS);
+
+  auto handle = std::make_unique<FileHandle>();
+  auto layout = std::make_shared<FileLayout>();
+  if (!GetInodePath(ino, &handle->path) ||
+      !fs->GetFileLayout(handle->path, layout.get()) ||
+      EntryInode(layout->entry) != ino) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  if (writing && (fi->flags & O_TRUNC) != 0 && layout->entry.size > 0) {
+    if (!fs->Truncate(handle->path, 0) ||
+        !fs->GetFileLayout(handle->path, layout.get())) {
+      fuse_reply_err(req, EIO);
+      return;
+    }
+  }
+  handle->layout = std::move(layout);
+  handle->writes = GetInodeWrites(ino);
+  if (readahead_worker != nullptr) {
+    handle->readahead = std::make_shared<FileReadahead>(
+        fs, readahead_worker.get(), mount_options.readahead_window,
+        handle->writes);
+  }
+  fi->fh = reinterpret_cast<uint64_t>(handle.release());
+  fuse_reply_open(req, fi);
+}
+
+static void release(fuse_req_t req, fuse_ino_t ino,
+                    struct fuse_file_info *fi) {
+  spdlog::debug("release: {}", ino);
+  if (ino == kStatsInode) {
+    delete reinterpret_cast<StatsHandle *>(fi->fh);
+  } else {
+    delete reinterpret_cast<FileHandle *>(fi->fh);
   }
-  return 0;
+  fuse_reply_err(req, 0);
 }
 
-// int open(const char *path, struct fuse_file_info *fi) {
-//   // if (files.find(path) == files.end()) return -ENOENT;
-//   if ((fi->flags & 3) != O_RDONLY) {
-//     return -EACCES;
-//   };
-//   return 0;
-// }
+// Replies with the ranges of the image file holding the data, which
+// libfuse splices into the reply when the kernel supports it.
+void ReplyImageRanges(fuse_req_t req, const FileLayout &layout, off_t offset,
+                      size_t size) {
+  std::vector<ImageRange> ranges;
+  // Keeps the image file open until the reply is sent.
+  std::shared_ptr<const BlockDevice> device;
+  const uint32_t size_mapped =
+      fs->MapFile(layout, offset, size, &ranges, &device);
+  if (size_mapped == 0) {
+    fuse_reply_buf(req, nullptr, 0);
+    return;
+  }
+  stats.bytes_served.fetch_add(size_mapped, std::memory_order_relaxed);
 
-int read(const char *path, char *buf, size_t size, off_t offset,
-         struct fuse_file_info * /*fi*/) {
-  spdlog::debug("read: {}", path);
+  // fuse_bufvec ends with a one element array of buffers.
+  std::vector<char> storage(sizeof(fuse_bufvec) +
+                            (ranges.size() - 1) * sizeof(fuse_buf));
+  auto *bufv = reinterpret_cast<fuse_bufvec *>(storage.data());
+  bufv->count = ranges.size();
+  bufv->idx = 0;
+  bufv->off = 0;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    fuse_buf &buf = bufv->buf[i];
+    memset(&buf, 0, sizeof(buf));
+    buf.size = ranges[i].size;
+    buf.flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK |
+                                            FUSE_BUF_FD_RETRY);
+    buf.fd = device->fd();
+    buf.pos = ranges[i].offset;
+    device->RecordRead(ranges[i].offset, ranges[i].size);
+  }
+  fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                 struct fuse_file_info *fi) {
+  spdlog::debug("read: {}", ino);
+  ScopedLatency latency(&stats.read);
+
+  if (ino == kStatsInode) {
+    const std::string &content =
+        reinterpret_cast<StatsHandle *>(fi->fh)->content;
+    if (static_cast<size_t>(offset) >= content.size()) {
+      fuse_reply_buf(req, nullptr, 0);
+    } else {
+      fuse_reply_buf(req, content.data() + offset,
+                     std::min(size, content.size() - offset));
+    }
+    return;
+  }
 
-  std::string path_str(path + 1);
   if (!RefreshFs()) {
-    return -EAGAIN;
+    fuse_reply_err(req, EAGAIN);
+    return;
+  }
+
+  auto *handle = reinterpret_cast<FileHandle *>(fi->fh);
+  std::shared_ptr<const FileLayout> layout;
+  {
+    std::lock_guard lock(handle->mutex);
+    // The file may have grown or moved since it was opened. Writes within
+    // its clusters only change its entry until they are flushed.
+    if (handle->layout->generation != fs->Generation() ||
+        (mount_options.read_write &&
+         offset + size > handle->layout->entry.size)) {
+      auto updated = std::make_shared<FileLayout>();
+      if (!fs->GetFileLayout(handle->path, updated.get())) {
+        fuse_reply_err(req, ENOENT);
+        return;
+      }
+      handle->layout = std::move(updated);
+    }
+    layout = handle->layout;
+  }
+
+  if (offset >= layout->entry.size) {
+    fuse_reply_buf(req, nullptr, 0);
+    return;
+  }
+
+  if (offset + size > layout->entry.size) {
+    size = layout->entry.size - offset;
+  }
+
+  if (mount_options.zero_copy) {
+    ReplyImageRanges(req, *layout, offset, size);
+    return;
+  }
+
+  std::vector<char> buf(size);
+  const uint32_t size_read =
+      handle->readahead != nullptr
+          ? handle->readahead->Read(layout, offset, size, buf.data())
+          : fs->ReadFile(*layout, offset, size, buf.data());
+  stats.bytes_served.fetch_add(size_read, std::memory_order_relaxed);
+  fuse_reply_buf(req, buf.data(), size_read);
+}
+
+static void create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                   mode_t /*mode*/, struct fuse_file_info *fi) {
+  spdlog::debug("create: {} {}", parent, name);
+
+  std::string path;
+  auto handle = std::make_unique<FileHandle>();
+  auto layout = std::make_shared<FileLayout>();
+  if (!mount_options.read_write) {
+    fuse_reply_err(req, EROFS);
+    return;
+  }
+  if (!GetInodePath(parent, &path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  if (InClipViews(path, name)) {
+    fuse_reply_err(req, EROFS);
+    return;
+  }
+  if (!IsValidLongFilename(name)) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  if (HasEntry(path, name)) {
+    fuse_reply_err(req, EEXIST);
+    return;
   }
-  fs->ChangeDirectory(path_str, true);
-  const DirectoryEntry *entry = fs->FindDirectoryEntry(path_str);
-  if (entry == nullptr) {
-    return -ENOENT;
+  path = path.empty() ? name : path + "/" + name;
+  if (!fs->CreateFile(path) || !fs->GetFileLayout(path, layout.get())) {
+    fuse_reply_err(req, EIO);
+    return;
   }
-  if (entry->IsDirectory()) {
-    return -EISDIR;
+
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  e.ino = EntryInode(layout->entry);
+  e.attr_timeout = mount_options.attr_timeout;
+  e.entry_timeout = mount_options.entry_timeout;
+  FillStat(e.ino, layout->entry, &e.attr);
+  AddLookup(e.ino, path);
+
+  handle->path = std::move(path);
+  handle->layout = std::move(layout);
+  handle->writes = GetInodeWrites(e.ino);
+  if (readahead_worker != nullptr) {
+    handle->readahead = std::make_shared<FileReadahead>(
+        fs, readahead_worker.get(), mount_options.readahead_window,
+        handle->writes);
   }
+  fi->fh = reinterpret_cast<uint64_t>(handle.release());
+  fuse_reply_create(req, &e, fi);
+}
+
+static void write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                  size_t size, off_t offset, struct fuse_file_info *fi) {
+  spdlog::debug("write: {} {} {}", ino, offset, size);
+  ScopedLatency latency(&stats.write);
 
-  if (offset >= entry->size) {
-    return 0;
+  if (static_cast<uint64_t>(offset) + size > UINT32_MAX) {
+    fuse_reply_err(req, EFBIG);
+    return;
   }
 
-  if (offset + size > entry->size) {
-    size = entry->size - offset;
+  auto *handle = reinterpret_cast<FileHandle *>(fi->fh);
+  std::lock_guard lock(handle->mutex);
+  // Readers of the handle keep the layout they got.
+  auto layout = std::make_shared<FileLayout>(*handle->layout);
+  const uint32_t size_written = fs->WriteFile(layout.get(), offset, size, buf);
+  if (size_written == 0 && size > 0) {
+    fuse_reply_err(req, EIO);
+    return;
   }
+  handle->layout = std::move(layout);
+  // Readahead of the other handles of the file may hold what was
+  // overwritten.
+  (*handle->writes)++;
+  fuse_reply_write(req, size_written);
+}
 
-  return fs->ReadFile(*entry, offset, size, buf);
+// Called on every close of a file, writes back what the writes of the file
+// left in memory.
+static void flush(fuse_req_t req, fuse_ino_t ino,
+                  struct fuse_file_info * /*fi*/) {
+  spdlog::debug("flush: {}", ino);
+  if (mount_options.read_write && ino != kStatsInode && !fs->Flush()) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  fuse_reply_err(req, 0);
 }
 
-static struct fuse_operations operations {
-  .getattr = getattr, .read = read, .readdir = readdir,
-  // .open = this->open,
+static void fsync(fuse_req_t req, fuse_ino_t ino, int /*datasync*/,
+                  struct fuse_file_info * /*fi*/) {
+  spdlog::debug("fsync: {}", ino);
+  if (mount_options.read_write && !fs->Flush(/*sync=*/true)) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  fuse_reply_err(req, 0);
+}
+
+static void destroy(void * /*userdata*/) {
+  if (mount_options.read_write && !fs->Flush(/*sync=*/true)) {
+    spdlog::error("failed to write back changes on unmount");
+  }
+}
+
+static void init(void * /*userdata*/, struct fuse_conn_info *conn) {
+  // Always use readdirplus rather than letting the kernel pick between
+  // readdir and readdirplus, listings are followed by getattrs of the
+  // entries most of the time.
+  conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+  if (mount_options.zero_copy) {
+    conn->want |=
+        conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+  }
+}
+
+static const struct fuse_lowlevel_ops operations = {
+    .init = init,
+    .destroy = destroy,
+    .lookup = lookup,
+    .forget = forget,
+    .getattr = getattr,
+    .setattr = setattr,
+    .mkdir = mkdir,
+    .unlink = unlink,
+    .open = open,
+    .read = read,
+    .write = write,
+    .flush = flush,
+    .release = release,
+    .fsync = fsync,
+    .opendir = opendir,
+    .readdir = readdir,
+    .releasedir = releasedir,
+    .statfs = statfs,
+    .create = create,
+    .forget_multi = forget_multi,
+    .readdirplus = readdirplus,
 };
 
 }  // namespace fuse
 
-bool MountFat32(fat32::FileSystem &fat32_fs, absl::string_view mount_path) {
+bool MountFat32(fat32::FileSystem &fat32_fs, absl::string_view mount_path,
+                const MountOptions &options) {
   struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
-
   fuse_opt_add_arg(&args, "fat32fuse");
-  // fuse_opt_add_arg(&args, "-h");
-  fuse_opt_add_arg(&args, mount_path.data());
-  fuse_opt_add_arg(&args, "-f");  // run in foreground
-  fuse_opt_add_arg(&args, "-s");  // single thread
-  // fuse_opt_add_arg(&args, "-oentry_timeout=0");
-  // fuse_opt_add_arg(&args, "-oattr_timeout=0");
 
   fuse::fs = &fat32_fs;
+  fuse::refresher = std::make_unique<Refresher>(&fat32_fs);
+  fuse::clip_views_builder = std::make_unique<ClipViewsBuilder>();
+  fuse::mount_options = options;
+  if (options.readahead_window > 0 && !options.zero_copy) {
+    fuse::readahead_worker = std::make_unique<ReadaheadWorker>();
+  }
+
+  bool succeed = false;
+  struct fuse_session *se = fuse_session_new(
+      &args, &fuse::operations, sizeof(fuse::operations), nullptr);
+  if (se != nullptr) {
+    if (fuse_set_signal_handlers(se) == 0) {
+      if (fuse_session_mount(se, std::string(mount_path).c_str()) == 0) {
+        // Runs in the foreground, with one thread per concurrent request.
+        succeed = fuse_session_loop_mt(se, 0) == 0;
+        fuse_session_unmount(se);
+      }
+      fuse_remove_signal_handlers(se);
+    }
+    fuse_session_destroy(se);
+  }
 
-  int ret = fuse_main(args.argc, args.argv, &fuse::operations, nullptr);
   fuse_opt_free_args(&args);
-  return ret == 0;
+  fuse::readahead_worker.reset();
+  return succeed;
 }
 
 }  // namespace fat32
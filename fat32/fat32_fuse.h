@@ -1,10 +1,31 @@
 #pragma once
 
+#include <cstdint>
+
 #include "absl/strings/string_view.h"
 #include "fat32.h"
 
 namespace fat32 {
 
-bool MountFat32(fat32::FileSystem& fat32_fs, absl::string_view mount_path);
+struct MountOptions {
+  // Size of the chunks read ahead of sequential reads, 0 disables
+  // readahead.
+  uint32_t readahead_window = 1 << 20;
+  // Reply to reads with ranges of the image file, that the kernel may
+  // splice into the reply, rather than copying the data. The kernel then
+  // reads ahead in the image file itself, so readahead_window only applies
+  // without zero copy.
+  bool zero_copy = true;
+  // How long, in seconds, the kernel may cache names and attributes
+  // without asking again.
+  double entry_timeout = 1.0;
+  double attr_timeout = 1.0;
+  // Allow creating, writing and removing files. The file system must have
+  // been opened writable.
+  bool read_write = false;
+};
+
+bool MountFat32(fat32::FileSystem& fat32_fs, absl::string_view mount_path,
+                const MountOptions& options = {});
 
 }  // namespace fat32
@@ -0,0 +1,529 @@
+#include "file_allocation_table.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace fat32 {
+
+namespace {
+
+// Size of each sequential read while loading the table.
+constexpr uint64_t kLoadChunkSize = 1 << 20;
+// Granularity of the comparison while reloading the table.
+constexpr uint64_t kReloadChunkEntries = 1 << 14;
+// Granularity of the writes of a flush, the smallest sector size.
+constexpr uint32_t kDirtyBlockEntries = 512 / 4;
+
+// When mirroring is disabled (bit 7 of the EBPB flags), bits 0-3 hold
+// the index of the only active FAT. Otherwise all FATs are identical and
+// the first one is used.
+uint32_t ActiveFatIndex(const ExtendedBiosParameterBlock &ebpb) {
+  if ((ebpb.flags & 0x80) != 0) {
+    return ebpb.flags & 0x0F;
+  }
+  return 0;
+}
+
+// The 28 bits of an entry in its on-disk byte order, so that entries are
+// tested without converting them.
+const uint32_t kRawEntryMask = htole32(0x0FFFFFFF);
+
+// Returns bit i set if entry i of the 16 at `entries` is free.
+uint32_t FreeMask16(const uint32_t *entries) {
+#if defined(__SSE2__)
+  const __m128i mask = _mm_set1_epi32(kRawEntryMask);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i free[4];
+  for (int i = 0; i < 4; i++) {
+    const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(entries + 4 * i));
+    free[i] = _mm_cmpeq_epi32(_mm_and_si128(v, mask), zero);
+  }
+  // Lanes are all ones or all zeros, which saturating packs keep.
+  return _mm_movemask_epi8(
+      _mm_packs_epi16(_mm_packs_epi32(free[0], free[1]),
+                      _mm_packs_epi32(free[2], free[3])));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint32x4_t mask = vdupq_n_u32(kRawEntryMask);
+  uint16x4_t free[4];
+  for (int i = 0; i < 4; i++) {
+    const uint32x4_t v = vandq_u32(vld1q_u32(entries + 4 * i), mask);
+    free[i] = vmovn_u32(vceqq_u32(v, vdupq_n_u32(0)));
+  }
+  const uint8x16_t bytes =
+      vcombine_u8(vmovn_u16(vcombine_u16(free[0], free[1])),
+                  vmovn_u16(vcombine_u16(free[2], free[3])));
+  // No movemask on NEON, weight each lane by its bit and add them up.
+  static const uint8_t kWeights[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                       1, 2, 4, 8, 16, 32, 64, 128};
+  const uint8x16_t bits = vandq_u8(bytes, vld1q_u8(kWeights));
+  return vaddv_u8(vget_low_u8(bits)) |
+         (static_cast<uint32_t>(vaddv_u8(vget_high_u8(bits))) << 8);
+#else
+  uint32_t result = 0;
+  for (int i = 0; i < 16; i++) {
+    result |= static_cast<uint32_t>((entries[i] & kRawEntryMask) == 0) << i;
+  }
+  return result;
+#endif
+}
+
+}  // namespace
+
+bool Intersects(const std::vector<ClusterRange> &ranges,
+                const std::vector<Extent> &extents) {
+  for (const Extent &extent : extents) {
+    const uint64_t end = static_cast<uint64_t>(extent.start_cluster) +
+                         extent.length;
+    // First range ending after the start of the extent.
+    auto it = std::upper_bound(
+        ranges.begin(), ranges.end(), extent.start_cluster,
+        [](uint32_t cluster, const ClusterRange &range) {
+          return cluster < range.end;
+        });
+    if (it != ranges.end() && it->begin < end) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool FileAllocationTable::GetLayout(const BiosParameterBlock &bpb,
+                                    const ExtendedBiosParameterBlock &ebpb,
+                                    uint64_t *address, uint64_t *count) const {
+  const uint64_t data_sectors =
+      bpb.sectorsCount32 -
+      (bpb.reservedSectors + (bpb.countFats * ebpb.sectorsPerFAT));
+  const uint64_t total_clusters = data_sectors / bpb.sectorsPerCluster;
+  const uint64_t fat_size =
+      static_cast<uint64_t>(ebpb.sectorsPerFAT) * bpb.bytesPerSector;
+  // The FAT may be larger than needed, ignore the entries past the last
+  // data cluster.
+  *count = std::min(fat_size / 4, total_clusters + 2);
+
+  const uint32_t active_fat = ActiveFatIndex(ebpb);
+  if (active_fat >= bpb.countFats) {
+    spdlog::error("invalid active FAT index {}", active_fat);
+    return false;
+  }
+  *address = (bpb.reservedSectors +
+              static_cast<uint64_t>(active_fat) * ebpb.sectorsPerFAT) *
+             bpb.bytesPerSector;
+  return true;
+}
+
+bool FileAllocationTable::Load(const BlockDevice &device,
+                               const BiosParameterBlock &bpb,
+                               const ExtendedBiosParameterBlock &ebpb) {
+  uint64_t fat_address;
+  uint64_t count;
+  if (!GetLayout(bpb, ebpb, &fat_address, &count)) {
+    return false;
+  }
+
+  entries_.resize(count);
+  char *out = reinterpret_cast<char *>(entries_.data());
+  uint64_t address = fat_address;
+  uint64_t remaining = count * 4;
+  while (remaining > 0) {
+    const uint64_t chunk = std::min(remaining, kLoadChunkSize);
+    if (!device.Read(address, chunk, out)) {
+      spdlog::error("failed to read FAT at 0x{:X}", fat_address);
+      entries_.clear();
+      return false;
+    }
+    out += chunk;
+    address += chunk;
+    remaining -= chunk;
+  }
+
+  free_.assign((count + 63) / 64, 0);
+  free_count_ = 0;
+  UpdateFree(2, count);
+  next_free_ = 2;
+  dirty_blocks_.clear();
+
+  spdlog::debug("loaded FAT with {} entries, {} free", count, free_count_);
+  return true;
+}
+
+bool FileAllocationTable::Reload(const BlockDevice &device,
+                                 const BiosParameterBlock &bpb,
+                                 const ExtendedBiosParameterBlock &ebpb,
+                                 std::vector<ClusterRange> *changed) {
+  uint64_t fat_address;
+  uint64_t count;
+  if (!GetLayout(bpb, ebpb, &fat_address, &count) ||
+      count != entries_.size()) {
+    return false;
+  }
+
+  std::vector<uint32_t> buffer;
+  for (uint64_t begin = 0; begin < count; begin += kReloadChunkEntries) {
+    const uint64_t n = std::min(kReloadChunkEntries, count - begin);
+    const uint64_t address = fat_address + begin * 4;
+
+    // A memory mapped image is compared in place.
+    const uint32_t *current;
+    if (device.Data() != nullptr && address + n * 4 <= device.Size()) {
+      current = reinterpret_cast<const uint32_t *>(device.Data() + address);
+      device.RecordRead(address, n * 4);
+    } else {
+      buffer.resize(n);
+      if (!device.Read(address, n * 4,
+                       reinterpret_cast<char *>(buffer.data()))) {
+        spdlog::error("failed to read FAT at 0x{:X}", address);
+        return false;
+      }
+      current = buffer.data();
+    }
+
+    uint32_t *cached = entries_.data() + begin;
+    if (memcmp(current, cached, n * 4) == 0) {
+      continue;
+    }
+    // The mapping may be rewritten under us, by the USB gadget, so a chunk
+    // that changed is copied before it is looked at entry by entry.
+    if (current != buffer.data()) {
+      buffer.assign(current, current + n);
+      current = buffer.data();
+    }
+
+    uint64_t first = 0;
+    while (first < n && current[first] == cached[first]) {
+      first++;
+    }
+    uint64_t last = n;
+    while (last > first && current[last - 1] == cached[last - 1]) {
+      last--;
+    }
+    if (last <= first) {
+      continue;
+    }
+    memcpy(cached + first, current + first, (last - first) * 4);
+    UpdateFree(std::max<uint64_t>(begin + first, 2), begin + last);
+
+    const ClusterRange range{static_cast<uint32_t>(begin + first),
+                             static_cast<uint32_t>(begin + last)};
+    if (!changed->empty() && changed->back().end == range.begin) {
+      changed->back().end = range.end;
+    } else {
+      changed->push_back(range);
+    }
+  }
+  return true;
+}
+
+std::vector<Extent> FileAllocationTable::GetExtents(
+    uint32_t first_cluster) const {
+  std::vector<Extent> extents;
+  uint32_t cluster = first_cluster;
+  uint64_t visited = 0;
+
+  while (cluster >= 2 && cluster < entries_.size()) {
+    if (++visited > entries_.size()) {
+      spdlog::warn("cluster chain from 0x{:X} loops", first_cluster);
+      break;
+    }
+
+    if (!extents.empty() && extents.back().start_cluster +
+                                    extents.back().length ==
+                                cluster) {
+      extents.back().length++;
+    } else {
+      extents.push_back({cluster, 1});
+    }
+
+    const uint32_t next_cluster = Entry(cluster);
+    if (next_cluster >= kEocc) {
+      break;
+    } else if (next_cluster == kBadCluster) {
+      spdlog::warn("bad cluster in chain from 0x{:X}", first_cluster);
+      break;
+    }
+    cluster = next_cluster;
+  }
+
+  return extents;
+}
+
+void FileAllocationTable::Clear() {
+  entries_.clear();
+  free_.clear();
+  free_count_ = 0;
+  next_free_ = 2;
+  dirty_blocks_.clear();
+  freed_.clear();
+  unwritten_.clear();
+}
+
+void FileAllocationTable::UpdateFree(uint32_t begin, uint32_t end) {
+  // Whole words of the bitmap at once, masked to the range.
+  for (uint64_t word = begin / 64; word * 64 < end; word++) {
+    const uint64_t first = word * 64;
+    uint64_t mask = ~uint64_t{0};
+    if (first < begin) {
+      mask &= ~uint64_t{0} << (begin - first);
+    }
+    if (first + 64 > end) {
+      mask &= ~uint64_t{0} >> (first + 64 - end);
+    }
+
+    uint64_t bits = 0;
+    if (first + 64 <= entries_.size()) {
+      for (int i = 0; i < 4; i++) {
+        bits |= static_cast<uint64_t>(FreeMask16(&entries_[first + 16 * i]))
+                << (16 * i);
+      }
+    } else {
+      for (uint64_t i = first; i < end; i++) {
+        bits |= static_cast<uint64_t>(Entry(i) == 0) << (i - first);
+      }
+    }
+    bits &= mask;
+
+    free_count_ += __builtin_popcountll(bits) -
+                   __builtin_popcountll(free_[word] & mask);
+    free_[word] = (free_[word] & ~mask) | bits;
+  }
+}
+
+uint32_t FileAllocationTable::FindFree(uint32_t cluster) const {
+  if (cluster < 2 || cluster >= entries_.size()) {
+    cluster = 2;
+  }
+  // The free bits of the first word from `cluster` on.
+  size_t word = cluster / 64;
+  uint64_t bits = free_[word] & (~uint64_t{0} << (cluster % 64));
+  // One more word than the bitmap, to see the start of the first one again
+  // after wrapping.
+  for (size_t i = 0; i <= free_.size(); i++) {
+    if (bits != 0) {
+      return word * 64 + __builtin_ctzll(bits);
+    }
+    word = word + 1 < free_.size() ? word + 1 : 0;
+    bits = free_[word];
+  }
+  return 0;
+}
+
+std::vector<Extent> FileAllocationTable::GetFreeExtents() const {
+  std::vector<Extent> extents;
+  for (size_t word = 0; word < free_.size(); word++) {
+    uint64_t bits = free_[word];
+    while (bits != 0) {
+      const uint32_t bit = __builtin_ctzll(bits);
+      // Up to the next used cluster, or the end of the word.
+      const uint64_t run = ~(bits >> bit);
+      const uint32_t length = run == 0 ? 64 : __builtin_ctzll(run);
+      const uint32_t cluster = word * 64 + bit;
+      if (!extents.empty() &&
+          extents.back().start_cluster + extents.back().length == cluster) {
+        extents.back().length += length;
+      } else {
+        extents.push_back({cluster, length});
+      }
+      if (bit + length == 64) {
+        break;
+      }
+      bits &= ~uint64_t{0} << (bit + length);
+    }
+  }
+  return extents;
+}
+
+void FileAllocationTable::SetNextFree(uint32_t cluster) {
+  if (cluster >= 2 && cluster < entries_.size()) {
+    next_free_ = cluster;
+  }
+}
+
+bool FileAllocationTable::Allocate(uint32_t count, uint32_t last,
+                                   std::vector<Extent> *extents) {
+  if (count > free_count_) {
+    return false;
+  }
+
+  // Continue the chain in place if possible, so that appending to a file
+  // keeps it contiguous.
+  uint32_t cluster =
+      last != 0 && last + 1 < entries_.size() && IsFree(last + 1)
+          ? last + 1
+          : FindFree(next_free_);
+  const uint32_t chain_end = last;
+  while (count > 0) {
+    SetNextCluster(cluster, kEndOfChain);
+    if (last != 0 && last == chain_end) {
+      SetUnwritten(last, cluster, /*cut=*/false);
+    } else if (last != 0) {
+      SetNextCluster(last, cluster);
+    }
+    if (!extents->empty() &&
+        extents->back().start_cluster + extents->back().length == cluster) {
+      extents->back().length++;
+    } else {
+      extents->push_back({cluster, 1});
+    }
+    last = cluster;
+    if (--count > 0) {
+      cluster = cluster + 1 < entries_.size() && IsFree(cluster + 1)
+                    ? cluster + 1
+                    : FindFree(cluster + 1);
+    }
+  }
+  next_free_ = last + 1 < entries_.size() ? last + 1 : 2;
+  return true;
+}
+
+void FileAllocationTable::FreeChain(uint32_t first_cluster,
+                                    std::vector<ClusterRange> *freed) {
+  for (const Extent &extent : GetExtents(first_cluster)) {
+    freed_.push_back(extent);
+    freed->push_back(
+        {extent.start_cluster, extent.start_cluster + extent.length});
+  }
+}
+
+void FileAllocationTable::CutChain(uint32_t last,
+                                   std::vector<ClusterRange> *freed) {
+  if (last < 2 || last >= entries_.size()) {
+    return;
+  }
+  const uint32_t next = Entry(last);
+  if (next < 2 || next >= entries_.size()) {
+    // Already the end of the chain.
+    return;
+  }
+  SetUnwritten(last, kEndOfChain, /*cut=*/true);
+  FreeChain(next, freed);
+}
+
+bool FileAllocationTable::ReleaseFreed() {
+  if (freed_.empty() && unwritten_.empty()) {
+    return false;
+  }
+  for (const Extent &extent : freed_) {
+    for (uint32_t i = 0; i < extent.length; i++) {
+      SetNextCluster(extent.start_cluster + i, 0);
+    }
+  }
+  freed_.clear();
+  for (const auto &[cluster, unwritten] : unwritten_) {
+    dirty_blocks_.insert(cluster / kDirtyBlockEntries);
+  }
+  unwritten_.clear();
+  return true;
+}
+
+void FileAllocationTable::SetNextCluster(uint32_t cluster, uint32_t next) {
+  if (cluster < 2 || cluster >= entries_.size()) {
+    return;
+  }
+  // The high 4 bits are reserved and kept as they are.
+  entries_[cluster] =
+      htole32((le32toh(entries_[cluster]) & 0xF0000000) | next);
+  UpdateFree(cluster, cluster + 1);
+  dirty_blocks_.insert(cluster / kDirtyBlockEntries);
+  unwritten_.erase(cluster);
+}
+
+void FileAllocationTable::SetUnwritten(uint32_t cluster, uint32_t next,
+                                       bool cut) {
+  // The image still holds the value before the first unwritten change. A
+  // cut chain extended again is still longer there than the new one, so it
+  // stays cut until released, after the entries are written.
+  const auto it = unwritten_.find(cluster);
+  const uint32_t previous =
+      it != unwritten_.end() ? it->second.previous : entries_[cluster];
+  cut = cut || (it != unwritten_.end() && it->second.cut);
+  SetNextCluster(cluster, next);
+  unwritten_[cluster] = {previous, cut};
+}
+
+bool FileAllocationTable::Flush(BlockDevice &device,
+                                const BiosParameterBlock &bpb,
+                                const ExtendedBiosParameterBlock &ebpb) {
+  if (!WriteBlocks(dirty_blocks_, device, bpb, ebpb)) {
+    return false;
+  }
+  dirty_blocks_.clear();
+
+  // The clusters the chains were extended by are allocated on the image,
+  // link them.
+  std::set<uint32_t> linked;
+  for (auto it = unwritten_.begin(); it != unwritten_.end();) {
+    if (it->second.cut) {
+      ++it;
+      continue;
+    }
+    linked.insert(it->first / kDirtyBlockEntries);
+    it = unwritten_.erase(it);
+  }
+  if (!WriteBlocks(linked, device, bpb, ebpb)) {
+    dirty_blocks_ = std::move(linked);
+    return false;
+  }
+  return true;
+}
+
+bool FileAllocationTable::WriteBlocks(const std::set<uint32_t> &blocks,
+                                      BlockDevice &device,
+                                      const BiosParameterBlock &bpb,
+                                      const ExtendedBiosParameterBlock &ebpb) {
+  uint64_t fat_address;
+  uint64_t count;
+  if (!GetLayout(bpb, ebpb, &fat_address, &count)) {
+    return false;
+  }
+  const bool mirrored = (ebpb.flags & 0x80) == 0;
+  const uint64_t fat_size =
+      static_cast<uint64_t>(ebpb.sectorsPerFAT) * bpb.bytesPerSector;
+  const uint64_t first_fat = static_cast<uint64_t>(bpb.reservedSectors) *
+                             bpb.bytesPerSector;
+
+  // Consecutive blocks are written at once.
+  auto it = blocks.begin();
+  while (it != blocks.end()) {
+    const uint32_t first_block = *it;
+    uint32_t end_block = first_block + 1;
+    while (++it != blocks.end() && *it == end_block) {
+      end_block++;
+    }
+    const uint64_t begin = uint64_t{first_block} * kDirtyBlockEntries;
+    const uint64_t end =
+        std::min<uint64_t>(uint64_t{end_block} * kDirtyBlockEntries, count);
+    const char *data = reinterpret_cast<const char *>(entries_.data() + begin);
+    std::vector<uint32_t> patched;
+    for (auto unwritten = unwritten_.lower_bound(begin);
+         unwritten != unwritten_.end() && unwritten->first < end;
+         ++unwritten) {
+      if (patched.empty()) {
+        patched.assign(entries_.begin() + begin, entries_.begin() + end);
+        data = reinterpret_cast<const char *>(patched.data());
+      }
+      patched[unwritten->first - begin] = unwritten->second.previous;
+    }
+
+    for (uint32_t i = 0; i < bpb.countFats; i++) {
+      const uint64_t address = first_fat + i * fat_size;
+      if (!mirrored && address != fat_address) {
+        continue;
+      }
+      if (!device.Write(address + begin * 4, (end - begin) * 4, data)) {
+        spdlog::error("failed to write FAT {} at 0x{:X}", i, address);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace fat32
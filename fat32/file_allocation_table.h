@@ -0,0 +1,186 @@
+#pragma once
+
+#include <endian.h>
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "block_device.h"
+#include "types.h"
+
+namespace fat32 {
+
+// End Of Cluster Chain value
+constexpr uint32_t kEocc = 0x0FFFFFF8;
+// Bad Cluster value
+constexpr uint32_t kBadCluster = 0x0FFFFFF7;
+// End Of Cluster Chain value written by the allocator
+constexpr uint32_t kEndOfChain = 0x0FFFFFFF;
+
+// A run of physically contiguous clusters in a cluster chain.
+struct Extent {
+  uint32_t start_cluster;
+  uint32_t length;  // in clusters
+
+  bool operator==(const Extent& other) const {
+    return start_cluster == other.start_cluster && length == other.length;
+  }
+};
+
+// A half-open range [begin, end) of clusters.
+struct ClusterRange {
+  uint32_t begin;
+  uint32_t end;
+};
+
+// Returns whether any cluster of `extents` is in one of `ranges`, which
+// must be sorted.
+bool Intersects(const std::vector<ClusterRange>& ranges,
+                const std::vector<Extent>& extents);
+
+// In-memory copy of the active FAT.
+//
+// The table is loaded once with large sequential reads, so following a
+// cluster chain never touches the image again. Chains are handed out as
+// extent lists, which collapse the long contiguous runs TeslaCam clips
+// usually have into a handful of (start_cluster, length) pairs.
+//
+// The entries are kept byte for byte as on disk, so that Reload can tell
+// what changed with a plain memory compare.
+//
+// Free clusters are tracked in a bitmap next to the table, so allocating
+// skips 64 used clusters per word instead of reading their entries, and
+// the exact number of free clusters is always known. The bitmap is built
+// with SIMD compares of 16 entries at a time, and only the changed ranges
+// are recomputed on reload. Changes to the table stay in memory until
+// Flush.
+class FileAllocationTable {
+ public:
+  bool Load(const BlockDevice& device, const BiosParameterBlock& bpb,
+            const ExtendedBiosParameterBlock& ebpb);
+
+  // Re-reads the table and updates only the entries that differ. The
+  // changed clusters are appended to `changed`, sorted.
+  bool Reload(const BlockDevice& device, const BiosParameterBlock& bpb,
+              const ExtendedBiosParameterBlock& ebpb,
+              std::vector<ClusterRange>* changed);
+
+  void Clear();
+
+  // Number of entries in the table, including the two reserved ones.
+  uint32_t Size() const { return entries_.size(); }
+
+  // Returns the (28 bits) value of the FAT entry of `cluster`, or kEocc if
+  // the cluster is out of range.
+  uint32_t GetNextCluster(uint32_t cluster) const {
+    return cluster < entries_.size() ? Entry(cluster) : kEocc;
+  }
+
+  // Collapses the chain starting at `first_cluster` into extents. The
+  // chain stops at the end marker, a bad or free cluster, an out of range
+  // cluster, or when a loop is detected.
+  std::vector<Extent> GetExtents(uint32_t first_cluster) const;
+
+  // Number of free data clusters, exact unlike the FSInfo hint.
+  uint32_t FreeCount() const { return free_count_; }
+
+  // Runs of free clusters, in cluster order, from the free bitmap.
+  std::vector<Extent> GetFreeExtents() const;
+
+  // Where the next allocation starts looking for free clusters.
+  uint32_t NextFree() const { return next_free_; }
+
+  // Sets the allocation hint, from the FSInfo sector. Out of range values
+  // are ignored.
+  void SetNextFree(uint32_t cluster);
+
+  // Allocates `count` clusters, contiguous when possible, and chains them
+  // after `last` unless it is 0. The new clusters are appended to
+  // `extents`. Returns false, allocating nothing, if there are not enough
+  // free clusters.
+  bool Allocate(uint32_t count, uint32_t last, std::vector<Extent>* extents);
+
+  // Frees the chain starting at `first_cluster`, and appends the freed
+  // clusters to `freed`. The clusters stay allocated until ReleaseFreed, so
+  // that they are not reused while entries on the image still point at
+  // them.
+  void FreeChain(uint32_t first_cluster, std::vector<ClusterRange>* freed);
+
+  // Ends the chain at `last` and frees the rest of it like FreeChain. The
+  // chain is only cut on the image once released, so that it does not get
+  // shorter than the size of the entry there.
+  void CutChain(uint32_t last, std::vector<ClusterRange>* freed);
+
+  // Marks the clusters of the chains freed since the last call as free,
+  // and cuts the chains. Returns false if there was nothing to release.
+  bool ReleaseFreed();
+
+  // Sets the (28 bits) value of the FAT entry of `cluster`.
+  void SetNextCluster(uint32_t cluster, uint32_t next);
+
+  // Whether the table has changes not written to the image.
+  bool IsDirty() const { return !dirty_blocks_.empty(); }
+
+  // Writes the changed parts of the table to every FAT, or only to the
+  // active one when mirroring is disabled. Chains are extended on the image
+  // once the clusters they are extended by are written.
+  bool Flush(BlockDevice& device, const BiosParameterBlock& bpb,
+             const ExtendedBiosParameterBlock& ebpb);
+
+ private:
+  uint32_t Entry(uint32_t cluster) const {
+    return le32toh(entries_[cluster]) & 0x0FFFFFFF;  // only 28 bits are used
+  }
+
+  bool IsFree(uint32_t cluster) const {
+    return (free_[cluster / 64] >> (cluster % 64)) & 1;
+  }
+
+  // Updates the free bitmap and count for the entries in [begin, end),
+  // which must not include the two reserved ones.
+  void UpdateFree(uint32_t begin, uint32_t end);
+
+  // Returns the first free cluster from `cluster` on, wrapping around to
+  // the start of the table. There must be a free cluster.
+  uint32_t FindFree(uint32_t cluster) const;
+
+  // Sets the entry of `cluster` like SetNextCluster, but keeps writing what
+  // it was until written on its own, see unwritten_.
+  void SetUnwritten(uint32_t cluster, uint32_t next, bool cut);
+
+  // Writes the blocks of the table in `blocks`, with the entries of
+  // unwritten_ as they were.
+  bool WriteBlocks(const std::set<uint32_t>& blocks, BlockDevice& device,
+                   const BiosParameterBlock& bpb,
+                   const ExtendedBiosParameterBlock& ebpb);
+
+  // Address of the active FAT and its number of entries.
+  bool GetLayout(const BiosParameterBlock& bpb,
+                 const ExtendedBiosParameterBlock& ebpb, uint64_t* address,
+                 uint64_t* count) const;
+
+ private:
+  std::vector<uint32_t> entries_;  // little-endian
+  // Bit i is set if cluster i is free.
+  std::vector<uint64_t> free_;
+  uint32_t free_count_ = 0;
+  uint32_t next_free_ = 2;
+  // Indexes of the blocks of kDirtyBlockEntries entries changed since the
+  // last flush.
+  std::set<uint32_t> dirty_blocks_;
+  // Freed by FreeChain, not released yet.
+  std::vector<Extent> freed_;
+  // Entries written after the others, with their previous value
+  // (little-endian) written until then: the end of a chain extended by
+  // Allocate, written last by Flush, and the end of a chain cut by
+  // CutChain, written once released.
+  struct UnwrittenEntry {
+    uint32_t previous;
+    bool cut;
+  };
+  std::map<uint32_t, UnwrittenEntry> unwritten_;
+};
+
+}  // namespace fat32
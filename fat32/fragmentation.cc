@@ -0,0 +1,196 @@
+#include "fragmentation.h"
+
+#include <algorithm>
+
+#include "absl/strings/str_cat.h"
+#include "json.h"
+#include "tree_diff.h"
+
+namespace fat32 {
+
+namespace {
+
+// Default readahead of Linux block devices, read_ahead_kb.
+constexpr uint64_t kReadaheadSize = 128 << 10;
+
+constexpr const char *kHistogramLabels[kExtentHistogramBuckets] = {
+    "1", "2", "3-4", "5-8", "9-16", "17-32", "33+"};
+
+size_t HistogramBucket(uint32_t extents) {
+  if (extents <= 1) {
+    return 0;
+  }
+  // log2 of extents, rounded up.
+  const size_t bucket = 64 - __builtin_clzll(extents - 1);
+  return std::min(bucket, kExtentHistogramBuckets - 1);
+}
+
+void AppendFileJson(const FileFragmentation &file, std::string *out) {
+  out->append("{\"path\":");
+  AppendJsonString(file.path, out);
+  absl::StrAppend(out, ",\"size\":", file.size, ",\"clusters\":",
+                  file.clusters, ",\"extents\":", file.extents,
+                  ",\"seeks\":", file.seeks, "}");
+}
+
+}  // namespace
+
+uint32_t EstimateSeeks(const std::vector<Extent> &extents,
+                       uint64_t cluster_size) {
+  if (extents.empty()) {
+    return 0;
+  }
+  uint32_t seeks = 1;
+  for (size_t i = 1; i < extents.size(); i++) {
+    const uint64_t end = static_cast<uint64_t>(extents[i - 1].start_cluster) +
+                         extents[i - 1].length;
+    const uint64_t start = extents[i].start_cluster;
+    if (start < end || (start - end) * cluster_size >= kReadaheadSize) {
+      seeks++;
+    }
+  }
+  return seeks;
+}
+
+bool AnalyzeFragmentation(const FileSystem &fs, absl::string_view path,
+                          FragmentationReport *report) {
+  TreeSnapshot snapshot;
+  if (!fs.Snapshot(path, &snapshot)) {
+    return false;
+  }
+  const SpaceStats space = fs.GetSpaceStats();
+  report->cluster_size = space.cluster_size;
+  report->clusters = space.clusters;
+  report->files.clear();
+  report->directories.clear();
+
+  for (const auto &[directory_path, directory] : snapshot.directories) {
+    DirectoryFragmentation stats;
+    stats.path = directory_path;
+    for (const DirectoryEntry &entry : directory->Entries()) {
+      if (entry.IsDirectory() || entry.IsVolumeIdEntry()) {
+        continue;
+      }
+      FileLayout layout;
+      const std::string file_path =
+          directory_path.empty()
+              ? entry.name
+              : absl::StrCat(directory_path, "/", entry.name);
+      if (!fs.GetFileLayout(file_path, &layout)) {
+        // Removed since the snapshot.
+        continue;
+      }
+      FileFragmentation file;
+      file.path = file_path;
+      file.size = layout.entry.size;
+      for (const Extent &extent : layout.extents) {
+        file.clusters += extent.length;
+      }
+      file.extents = layout.extents.size();
+      file.seeks = EstimateSeeks(layout.extents, space.cluster_size);
+
+      stats.files++;
+      stats.clusters += file.clusters;
+      stats.extents += file.extents;
+      stats.seeks += file.seeks;
+      if (file.extents > 0) {
+        stats.histogram[HistogramBucket(file.extents)]++;
+      }
+      report->files.push_back(std::move(file));
+    }
+    report->directories.push_back(std::move(stats));
+  }
+
+  std::sort(report->files.begin(), report->files.end(),
+            [](const FileFragmentation &a, const FileFragmentation &b) {
+              return a.path < b.path;
+            });
+  std::sort(report->directories.begin(), report->directories.end(),
+            [](const DirectoryFragmentation &a,
+               const DirectoryFragmentation &b) { return a.path < b.path; });
+
+  const std::vector<Extent> free_extents = fs.GetFreeExtents();
+  report->free_clusters = 0;
+  report->largest_free_extent = 0;
+  report->free_extents = free_extents.size();
+  for (const Extent &extent : free_extents) {
+    report->free_clusters += extent.length;
+    report->largest_free_extent =
+        std::max(report->largest_free_extent, extent.length);
+  }
+  return true;
+}
+
+std::string FormatFragmentationJson(const FragmentationReport &report,
+                                    size_t worst) {
+  uint64_t clusters = 0;
+  uint64_t extents = 0;
+  uint64_t seeks = 0;
+  uint32_t fragmented = 0;
+  for (const FileFragmentation &file : report.files) {
+    clusters += file.clusters;
+    extents += file.extents;
+    seeks += file.seeks;
+    fragmented += file.extents > 1 ? 1 : 0;
+  }
+  std::string out = absl::StrCat(
+      "{\"cluster_size\":", report.cluster_size,
+      ",\"clusters\":", report.clusters, ",\"files\":", report.files.size(),
+      ",\"file_clusters\":", clusters, ",\"extents\":", extents,
+      ",\"seeks\":", seeks, ",\"fragmented_files\":", fragmented,
+      ",\"free\":{\"clusters\":", report.free_clusters,
+      ",\"extents\":", report.free_extents,
+      ",\"largest_extent\":", report.largest_free_extent, "}");
+
+  out.append(",\"directories\":[");
+  for (size_t i = 0; i < report.directories.size(); i++) {
+    const DirectoryFragmentation &directory = report.directories[i];
+    out.append(i == 0 ? "{\"path\":" : ",{\"path\":");
+    AppendJsonString(directory.path, &out);
+    absl::StrAppend(&out, ",\"files\":", directory.files,
+                    ",\"clusters\":", directory.clusters,
+                    ",\"extents\":", directory.extents,
+                    ",\"seeks\":", directory.seeks, ",\"histogram\":{");
+    for (size_t j = 0; j < kExtentHistogramBuckets; j++) {
+      absl::StrAppend(&out, j == 0 ? "\"" : ",\"", kHistogramLabels[j],
+                      "\":", directory.histogram[j]);
+    }
+    out.append("}}");
+  }
+
+  // Most extents first, then most seeks, then by path.
+  std::vector<const FileFragmentation *> ranked;
+  for (const FileFragmentation &file : report.files) {
+    ranked.push_back(&file);
+  }
+  worst = std::min(worst, ranked.size());
+  std::partial_sort(ranked.begin(), ranked.begin() + worst, ranked.end(),
+                    [](const FileFragmentation *a, const FileFragmentation *b) {
+                      if (a->extents != b->extents) {
+                        return a->extents > b->extents;
+                      }
+                      if (a->seeks != b->seeks) {
+                        return a->seeks > b->seeks;
+                      }
+                      return a->path < b->path;
+                    });
+  out.append("],\"worst\":[");
+  for (size_t i = 0; i < worst; i++) {
+    if (i > 0) {
+      out.push_back(',');
+    }
+    AppendFileJson(*ranked[i], &out);
+  }
+
+  out.append("],\"file_list\":[");
+  for (size_t i = 0; i < report.files.size(); i++) {
+    if (i > 0) {
+      out.push_back(',');
+    }
+    AppendFileJson(report.files[i], &out);
+  }
+  out.append("]}\n");
+  return out;
+}
+
+}  // namespace fat32
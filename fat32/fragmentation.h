@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "fat32.h"
+
+namespace fat32 {
+
+// Files by number of extents: 1, 2, 3-4, 5-8, 9-16, 17-32 and more.
+constexpr size_t kExtentHistogramBuckets = 7;
+
+struct FileFragmentation {
+  // Relative to the root of the file system.
+  std::string path;
+  uint32_t size = 0;
+  uint32_t clusters = 0;
+  uint32_t extents = 0;
+  // Estimated seeks to read the file from start to end, see EstimateSeeks.
+  uint32_t seeks = 0;
+};
+
+// The files directly in a directory, not in its subdirectories.
+struct DirectoryFragmentation {
+  std::string path;
+  uint32_t files = 0;
+  uint64_t clusters = 0;
+  uint64_t extents = 0;
+  uint64_t seeks = 0;
+  // Non-empty files by number of extents.
+  std::array<uint32_t, kExtentHistogramBuckets> histogram = {};
+};
+
+struct FragmentationReport {
+  uint64_t cluster_size = 0;
+  uint32_t clusters = 0;
+  // Sorted by path.
+  std::vector<FileFragmentation> files;
+  std::vector<DirectoryFragmentation> directories;
+  // Runs of free clusters, where new files will be allocated.
+  uint32_t free_clusters = 0;
+  uint32_t free_extents = 0;
+  uint32_t largest_free_extent = 0;
+};
+
+// Estimates the seeks to read `extents` in order: one to the first extent,
+// then one per jump backwards or forward by at least the readahead of the
+// kernel, which reads through shorter gaps.
+uint32_t EstimateSeeks(const std::vector<Extent>& extents,
+                       uint64_t cluster_size);
+
+// Walks the tree at `path` and the cluster chain of every file, from the
+// FAT held in memory. Returns false if `path` cannot be read.
+bool AnalyzeFragmentation(const FileSystem& fs, absl::string_view path,
+                          FragmentationReport* report);
+
+// Formats the report as JSON: totals, free space, the directories with
+// their histograms, the `worst` files with the most extents, and every
+// file.
+std::string FormatFragmentationJson(const FragmentationReport& report,
+                                    size_t worst);
+
+}  // namespace fat32
@@ -0,0 +1,796 @@
+#include "http_server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "spdlog/spdlog.h"
+
+namespace fat32 {
+
+namespace {
+
+constexpr size_t kMaxRequestHeaderSize = 16 << 10;
+constexpr int kMaxEvents = 64;
+// Bytes sent per sendfile call, before turning to the other connections.
+constexpr size_t kSendChunkSize = 1 << 20;
+// Connections past this are closed as soon as they are accepted.
+constexpr size_t kMaxConnections = 256;
+// Connections that neither complete a request nor take any of their
+// response for this long are closed, checked every kIdleCheckInterval.
+constexpr auto kIdleTimeout = std::chrono::seconds(60);
+constexpr auto kIdleCheckInterval = std::chrono::seconds(1);
+
+struct Connection {
+  int fd;
+  // Tells the connection apart from later ones given the same fd.
+  uint64_t id;
+  uint32_t events = 0;
+  // When a request was last completed or response bytes last sent.
+  std::chrono::steady_clock::time_point last_active;
+  std::string in;
+  // Whether the peer shut down its side. What is left in `in` is still
+  // answered, then the connection is closed.
+  bool read_closed = false;
+  // Whether a request was handed to the resolver thread and its response
+  // is not back yet.
+  bool resolving = false;
+  // The response being sent: the head and any generated body, then the
+  // ranges of the image holding the requested bytes of a file.
+  bool sending = false;
+  bool keep_alive = true;
+  std::string out;
+  size_t out_sent = 0;
+  std::vector<ImageRange> ranges;
+  size_t range = 0;
+  uint64_t range_sent = 0;
+  std::shared_ptr<const BlockDevice> device;
+};
+
+// A request handed to the resolver thread, and the response it prepared
+// for the connection.
+struct Job {
+  int fd;
+  uint64_t connection_id;
+  std::string method;
+  std::string target;
+  std::string range_header;
+  bool keep_alive;
+
+  std::string out;
+  std::vector<ImageRange> ranges;
+  std::shared_ptr<const BlockDevice> device;
+};
+
+const char *ContentType(absl::string_view path) {
+  static constexpr std::pair<const char *, const char *> kTypes[] = {
+      {".mp4", "video/mp4"},
+      {".json", "application/json"},
+      {".png", "image/png"},
+      {".jpg", "image/jpeg"},
+      {".txt", "text/plain; charset=utf-8"},
+      {".html", "text/html; charset=utf-8"},
+      {".wav", "audio/wav"},
+  };
+  for (const auto &[extension, type] : kTypes) {
+    if (absl::EndsWithIgnoreCase(path, extension)) {
+      return type;
+    }
+  }
+  return "application/octet-stream";
+}
+
+int HexValue(char c) {
+  if (absl::ascii_isdigit(c)) {
+    return c - '0';
+  }
+  c = absl::ascii_tolower(c);
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+bool PercentDecode(absl::string_view in, std::string *out) {
+  out->clear();
+  for (size_t i = 0; i < in.size(); i++) {
+    if (in[i] != '%') {
+      out->push_back(in[i]);
+      continue;
+    }
+    if (i + 2 >= in.size() || HexValue(in[i + 1]) < 0 ||
+        HexValue(in[i + 2]) < 0) {
+      return false;
+    }
+    out->push_back(static_cast<char>(HexValue(in[i + 1]) * 16 +
+                                     HexValue(in[i + 2])));
+    i += 2;
+  }
+  return true;
+}
+
+void AppendPercentEncoded(absl::string_view in, std::string *out) {
+  static constexpr char kHex[] = "0123456789ABCDEF";
+  for (const char c : in) {
+    if (absl::ascii_isalnum(c) || strchr("-._~/", c) != nullptr) {
+      out->push_back(c);
+    } else {
+      out->push_back('%');
+      out->push_back(kHex[static_cast<uint8_t>(c) >> 4]);
+      out->push_back(kHex[static_cast<uint8_t>(c) & 0xF]);
+    }
+  }
+}
+
+void AppendHtmlEscaped(absl::string_view in, std::string *out) {
+  for (const char c : in) {
+    switch (c) {
+      case '&':
+        out->append("&amp;");
+        break;
+      case '<':
+        out->append("&lt;");
+        break;
+      case '>':
+        out->append("&gt;");
+        break;
+      case '"':
+        out->append("&quot;");
+        break;
+      default:
+        out->push_back(c);
+    }
+  }
+}
+
+enum class RangeResult { kNone, kValid, kUnsatisfiable };
+
+// Parses a single byte range of a Range header for a file of `size` bytes
+// into [begin, end). Multiple ranges are ignored, the whole file is sent.
+RangeResult ParseRange(absl::string_view value, uint64_t size,
+                       uint64_t *begin, uint64_t *end) {
+  value = absl::StripAsciiWhitespace(value);
+  if (!absl::ConsumePrefix(&value, "bytes=") ||
+      absl::StrContains(value, ',')) {
+    return RangeResult::kNone;
+  }
+  const size_t dash = value.find('-');
+  if (dash == absl::string_view::npos) {
+    return RangeResult::kNone;
+  }
+  const absl::string_view first = value.substr(0, dash);
+  const absl::string_view last = value.substr(dash + 1);
+  uint64_t a;
+  uint64_t b;
+  if (first.empty()) {
+    // The last b bytes.
+    if (!absl::SimpleAtoi(last, &b)) {
+      return RangeResult::kNone;
+    }
+    if (b == 0 || size == 0) {
+      return RangeResult::kUnsatisfiable;
+    }
+    *begin = size - std::min(b, size);
+    *end = size;
+    return RangeResult::kValid;
+  }
+  if (!absl::SimpleAtoi(first, &a) ||
+      (!last.empty() && (!absl::SimpleAtoi(last, &b) || b < a))) {
+    return RangeResult::kNone;
+  }
+  if (a >= size) {
+    return RangeResult::kUnsatisfiable;
+  }
+  *begin = a;
+  *end = last.empty() ? size : std::min(b, size - 1) + 1;
+  return RangeResult::kValid;
+}
+
+class HttpServer {
+ public:
+  explicit HttpServer(FileSystem &fs)
+      : fs_(fs),
+        refresher_(&fs),
+        wake_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+        resolver_thread_([this] { ResolveLoop(); }) {}
+
+  ~HttpServer() {
+    {
+      std::lock_guard lock(resolve_mutex_);
+      stopping_ = true;
+    }
+    resolve_wanted_.notify_one();
+    resolver_thread_.join();
+    for (auto &[fd, connection] : connections_) {
+      close(fd);
+    }
+    if (wake_fd_ >= 0) {
+      close(wake_fd_);
+    }
+    if (epoll_fd_ >= 0) {
+      close(epoll_fd_);
+    }
+    if (listen_fd_ >= 0) {
+      close(listen_fd_);
+    }
+  }
+
+  bool Listen(const HttpServerOptions &options);
+
+  void Run();
+
+ private:
+  void Accept();
+
+  // Reads what the peer sent, noting if it shut down its side. Returns
+  // false if the connection failed.
+  bool Receive(Connection *connection);
+
+  // Answers the requests received and sends what the socket takes. Returns
+  // false if the connection must be closed.
+  bool Progress(Connection *connection);
+
+  // Hands the next request of `connection` to the resolver thread if it
+  // was fully received. Returns false if the request is invalid.
+  bool StartResponse(Connection *connection);
+
+  // Starts sending the responses prepared by the resolver thread.
+  void DeliverResponses();
+
+  // Runs on the resolver thread.
+  void PrepareResponse(Job *job);
+
+  // Sets a complete response, with a generated body.
+  void SetResponse(Job *job, int status, absl::string_view reason,
+                   absl::string_view content_type, absl::string_view body,
+                   bool head, absl::string_view extra_headers = "");
+
+  void ListDirectory(Job *job, const std::string &path, bool head);
+
+  enum class SendResult { kDone, kBlocked, kError };
+
+  SendResult Send(Connection *connection);
+
+  void SetEvents(Connection *connection, uint32_t events);
+
+  void Close(int fd);
+
+  // Closes the connections idle for kIdleTimeout.
+  void CloseIdle();
+
+  // Prepares the responses to the jobs queued until the server is
+  // destroyed, refreshing the file system first, rate limited by
+  // `refresher_`. The event loop never takes the file system lock, which a
+  // refresh holds while it reads the FAT.
+  void ResolveLoop();
+
+  FileSystem &fs_;
+  Refresher refresher_;
+  std::mutex resolve_mutex_;
+  std::condition_variable resolve_wanted_;
+  // Guarded by resolve_mutex_.
+  std::deque<Job> jobs_;
+  std::vector<Job> resolved_;
+  bool stopping_ = false;
+  // Signaled by the resolver thread when jobs are resolved.
+  int wake_fd_;
+  // Started once the above is set up.
+  std::thread resolver_thread_;
+  int listen_fd_ = -1;
+  int epoll_fd_ = -1;
+  uint64_t next_connection_id_ = 0;
+  absl::flat_hash_map<int, std::unique_ptr<Connection>> connections_;
+};
+
+bool HttpServer::Listen(const HttpServerOptions &options) {
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(options.port);
+  if (inet_pton(AF_INET, options.address.c_str(), &address.sin_addr) != 1) {
+    spdlog::error("invalid address {}", options.address);
+    return false;
+  }
+
+  listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  const int one = 1;
+  if (listen_fd_ < 0 ||
+      setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) !=
+          0 ||
+      bind(listen_fd_, reinterpret_cast<const struct sockaddr *>(&address),
+           sizeof(address)) != 0 ||
+      listen(listen_fd_, SOMAXCONN) != 0) {
+    spdlog::error("failed to listen on {}:{}: {}", options.address,
+                  options.port, strerror(errno));
+    return false;
+  }
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = listen_fd_;
+  struct epoll_event wake_event = {};
+  wake_event.events = EPOLLIN;
+  wake_event.data.fd = wake_fd_;
+  if (epoll_fd_ < 0 || wake_fd_ < 0 ||
+      epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &event) != 0 ||
+      epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &wake_event) != 0) {
+    spdlog::error("failed to set up epoll: {}", strerror(errno));
+    return false;
+  }
+  spdlog::info("serving http on {}:{}", options.address, options.port);
+  return true;
+}
+
+void HttpServer::Run() {
+  struct epoll_event events[kMaxEvents];
+  auto last_idle_check = std::chrono::steady_clock::now();
+  while (true) {
+    const int count = epoll_wait(
+        epoll_fd_, events, kMaxEvents,
+        std::chrono::milliseconds(kIdleCheckInterval).count());
+    if (count < 0) {
+      if (errno != EINTR) {
+        spdlog::error("epoll_wait failed: {}", strerror(errno));
+        return;
+      }
+      continue;
+    }
+    for (int i = 0; i < count; i++) {
+      const int fd = events[i].data.fd;
+      if (fd == listen_fd_) {
+        Accept();
+        continue;
+      }
+      if (fd == wake_fd_) {
+        DeliverResponses();
+        continue;
+      }
+      const auto it = connections_.find(fd);
+      if (it == connections_.end()) {
+        continue;
+      }
+      Connection *connection = it->second.get();
+      if ((events[i].events & (EPOLLERR | EPOLLHUP)) != 0 ||
+          ((events[i].events & EPOLLIN) != 0 && !Receive(connection)) ||
+          !Progress(connection)) {
+        Close(fd);
+      }
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (now - last_idle_check >= kIdleCheckInterval) {
+      CloseIdle();
+      last_idle_check = now;
+    }
+  }
+}
+
+void HttpServer::Accept() {
+  while (true) {
+    const int fd =
+        accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+          errno != ECONNABORTED) {
+        spdlog::warn("failed to accept: {}", strerror(errno));
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return;
+    }
+    if (connections_.size() >= kMaxConnections) {
+      spdlog::debug("too many connections, closing a new one");
+      close(fd);
+      continue;
+    }
+    auto connection = std::make_unique<Connection>();
+    connection->fd = fd;
+    connection->id = next_connection_id_++;
+    connection->last_active = std::chrono::steady_clock::now();
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+      close(fd);
+      continue;
+    }
+    connection->events = EPOLLIN;
+    connections_.emplace(fd, std::move(connection));
+  }
+}
+
+bool HttpServer::Receive(Connection *connection) {
+  char buffer[4096];
+  while (!connection->read_closed &&
+         connection->in.size() <= kMaxRequestHeaderSize) {
+    const ssize_t n = read(connection->fd, buffer, sizeof(buffer));
+    if (n > 0) {
+      connection->in.append(buffer, n);
+      continue;
+    }
+    if (n == 0) {
+      connection->read_closed = true;
+      return true;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+  return true;
+}
+
+bool HttpServer::Progress(Connection *connection) {
+  while (true) {
+    if (!connection->sending && !connection->resolving &&
+        !StartResponse(connection)) {
+      return false;
+    }
+    if (connection->resolving) {
+      // The next request is read once this one is answered.
+      SetEvents(connection, 0);
+      return true;
+    }
+    if (!connection->sending) {
+      if (connection->read_closed) {
+        return false;  // no other request is coming
+      }
+      SetEvents(connection, EPOLLIN);
+      return true;
+    }
+    switch (Send(connection)) {
+      case SendResult::kError:
+        return false;
+      case SendResult::kBlocked:
+        // Stop reading until the response is out.
+        SetEvents(connection, EPOLLOUT);
+        return true;
+      case SendResult::kDone:
+        break;
+    }
+    connection->sending = false;
+    connection->out.clear();
+    connection->out_sent = 0;
+    connection->ranges.clear();
+    connection->range = 0;
+    connection->range_sent = 0;
+    connection->device.reset();
+    if (!connection->keep_alive) {
+      return false;
+    }
+  }
+}
+
+bool HttpServer::StartResponse(Connection *connection) {
+  const size_t end = connection->in.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    return connection->in.size() <= kMaxRequestHeaderSize;
+  }
+
+  const std::vector<absl::string_view> lines = absl::StrSplit(
+      absl::string_view(connection->in.data(), end), "\r\n");
+  const std::vector<absl::string_view> request_line =
+      absl::StrSplit(lines[0], ' ');
+  if (request_line.size() != 3 ||
+      !absl::StartsWith(request_line[2], "HTTP/1.")) {
+    return false;
+  }
+
+  absl::string_view range_header;
+  absl::string_view connection_header;
+  // Bodies are not read, only GET and HEAD are served.
+  bool has_body = false;
+  for (size_t i = 1; i < lines.size(); i++) {
+    const size_t colon = lines[i].find(':');
+    if (colon == absl::string_view::npos) {
+      continue;
+    }
+    const absl::string_view name = lines[i].substr(0, colon);
+    const absl::string_view value =
+        absl::StripAsciiWhitespace(lines[i].substr(colon + 1));
+    if (absl::EqualsIgnoreCase(name, "Range")) {
+      range_header = value;
+    } else if (absl::EqualsIgnoreCase(name, "Connection")) {
+      connection_header = value;
+    } else if (absl::EqualsIgnoreCase(name, "Content-Length")) {
+      has_body |= value != "0";
+    } else if (absl::EqualsIgnoreCase(name, "Transfer-Encoding")) {
+      has_body = true;
+    }
+  }
+  // A body would otherwise be taken for the next request, so the
+  // connection is closed after the response.
+  connection->keep_alive =
+      !has_body &&
+      (request_line[2] == "HTTP/1.1"
+           ? !absl::EqualsIgnoreCase(connection_header, "close")
+           : absl::EqualsIgnoreCase(connection_header, "keep-alive"));
+
+  Job job;
+  job.fd = connection->fd;
+  job.connection_id = connection->id;
+  job.method = std::string(request_line[0]);
+  job.target = std::string(request_line[1]);
+  job.range_header = std::string(range_header);
+  job.keep_alive = connection->keep_alive;
+  {
+    std::lock_guard lock(resolve_mutex_);
+    jobs_.push_back(std::move(job));
+  }
+  resolve_wanted_.notify_one();
+
+  connection->resolving = true;
+  connection->last_active = std::chrono::steady_clock::now();
+  connection->in.erase(0, end + 4);
+  return true;
+}
+
+void HttpServer::DeliverResponses() {
+  uint64_t count;
+  if (read(wake_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    spdlog::warn("failed to read the wake event: {}", strerror(errno));
+  }
+  std::vector<Job> resolved;
+  {
+    std::lock_guard lock(resolve_mutex_);
+    resolved.swap(resolved_);
+  }
+  for (Job &job : resolved) {
+    const auto it = connections_.find(job.fd);
+    if (it == connections_.end() || it->second->id != job.connection_id) {
+      continue;  // closed while resolving
+    }
+    Connection *connection = it->second.get();
+    connection->resolving = false;
+    connection->sending = true;
+    connection->out = std::move(job.out);
+    connection->ranges = std::move(job.ranges);
+    connection->device = std::move(job.device);
+    if (!Progress(connection)) {
+      Close(job.fd);
+    }
+  }
+}
+
+void HttpServer::PrepareResponse(Job *job) {
+  const absl::string_view method = job->method;
+  const absl::string_view target = job->target;
+  const bool head = method == "HEAD";
+  if (method != "GET" && !head) {
+    SetResponse(job, 405, "Method Not Allowed", "text/plain",
+                "method not allowed\n", false, "Allow: GET, HEAD\r\n");
+    return;
+  }
+  std::string path;
+  if (!PercentDecode(target.substr(0, target.find('?')), &path)) {
+    SetResponse(job, 400, "Bad Request", "text/plain", "bad request\n", head);
+    return;
+  }
+  path = std::string(absl::StripSuffix(absl::StripPrefix(path, "/"), "/"));
+
+  DirectoryEntry entry;
+  if (path.empty() || (fs_.GetEntry(path, &entry) && entry.IsDirectory())) {
+    ListDirectory(job, path, head);
+    return;
+  }
+  FileLayout layout;
+  if (!fs_.GetFileLayout(path, &layout)) {
+    SetResponse(job, 404, "Not Found", "text/plain", "not found\n", head);
+    return;
+  }
+
+  const uint64_t size = layout.entry.size;
+  uint64_t begin = 0;
+  uint64_t end = size;
+  const RangeResult range =
+      job->range_header.empty()
+          ? RangeResult::kNone
+          : ParseRange(job->range_header, size, &begin, &end);
+  if (range == RangeResult::kUnsatisfiable) {
+    SetResponse(job, 416, "Range Not Satisfiable", "text/plain", "", head,
+                absl::StrCat("Content-Range: bytes */", size, "\r\n"));
+    return;
+  }
+  if (!head && end > begin &&
+      fs_.MapFile(layout, begin, end - begin, &job->ranges, &job->device) !=
+          end - begin) {
+    job->ranges.clear();
+    job->device.reset();
+    SetResponse(job, 500, "Internal Server Error", "text/plain",
+                "failed to read\n", head);
+    return;
+  }
+
+  const bool partial = range == RangeResult::kValid;
+  absl::StrAppend(&job->out, "HTTP/1.1 ",
+                  partial ? "206 Partial Content" : "200 OK",
+                  "\r\nContent-Type: ", ContentType(path),
+                  "\r\nContent-Length: ", end - begin);
+  if (partial) {
+    absl::StrAppend(&job->out, "\r\nContent-Range: bytes ", begin, "-",
+                    end - 1, "/", size);
+  }
+  absl::StrAppend(&job->out,
+                  "\r\nAccept-Ranges: bytes"
+                  "\r\nAccess-Control-Allow-Origin: *"
+                  "\r\nConnection: ",
+                  job->keep_alive ? "keep-alive" : "close",
+                  "\r\n\r\n");
+}
+
+void HttpServer::SetResponse(Job *job, int status, absl::string_view reason,
+                             absl::string_view content_type,
+                             absl::string_view body, bool head,
+                             absl::string_view extra_headers) {
+  absl::StrAppend(&job->out, "HTTP/1.1 ", status, " ", reason,
+                  "\r\nContent-Type: ", content_type,
+                  "\r\nContent-Length: ", body.size(), "\r\n", extra_headers,
+                  "Access-Control-Allow-Origin: *\r\nConnection: ",
+                  job->keep_alive ? "keep-alive" : "close", "\r\n\r\n");
+  if (!head) {
+    absl::StrAppend(&job->out, body);
+  }
+}
+
+void HttpServer::ListDirectory(Job *job, const std::string &path, bool head) {
+  std::vector<DirectoryEntry> entries;
+  if (!fs_.ListDirectory(path, &entries)) {
+    SetResponse(job, 404, "Not Found", "text/plain", "not found\n", head);
+    return;
+  }
+  std::string body = "<!DOCTYPE html>\n<html><body><ul>\n";
+  for (const DirectoryEntry &entry : entries) {
+    if (entry.name == "." || entry.name == ".." || entry.IsVolumeIdEntry()) {
+      continue;
+    }
+    body.append("<li><a href=\"/");
+    AppendPercentEncoded(path.empty() ? entry.name
+                                      : absl::StrCat(path, "/", entry.name),
+                         &body);
+    body.append(entry.IsDirectory() ? "/\">" : "\">");
+    AppendHtmlEscaped(entry.name, &body);
+    body.append(entry.IsDirectory() ? "/</a></li>\n" : "</a></li>\n");
+  }
+  body.append("</ul></body></html>\n");
+  SetResponse(job, 200, "OK", "text/html; charset=utf-8", body, head);
+}
+
+HttpServer::SendResult HttpServer::Send(Connection *connection) {
+  while (connection->out_sent < connection->out.size()) {
+    const ssize_t n = send(connection->fd,
+                           connection->out.data() + connection->out_sent,
+                           connection->out.size() - connection->out_sent,
+                           MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? SendResult::kBlocked
+                                                     : SendResult::kError;
+    }
+    connection->out_sent += n;
+    connection->last_active = std::chrono::steady_clock::now();
+  }
+
+  // One chunk per call, so that the other connections get their turn.
+  size_t budget = kSendChunkSize;
+  while (connection->range < connection->ranges.size()) {
+    if (budget == 0) {
+      return SendResult::kBlocked;
+    }
+    const ImageRange &range = connection->ranges[connection->range];
+    off_t offset = range.offset + connection->range_sent;
+    const size_t size =
+        std::min<uint64_t>(range.size - connection->range_sent, budget);
+    const ssize_t n =
+        sendfile(connection->fd, connection->device->fd(), &offset, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? SendResult::kBlocked
+                                                     : SendResult::kError;
+    }
+    if (n == 0) {
+      // The image shrank under us.
+      return SendResult::kError;
+    }
+    connection->device->RecordRead(offset - n, n);
+    connection->last_active = std::chrono::steady_clock::now();
+    budget -= n;
+    connection->range_sent += n;
+    if (connection->range_sent == range.size) {
+      connection->range++;
+      connection->range_sent = 0;
+    }
+  }
+  return SendResult::kDone;
+}
+
+void HttpServer::SetEvents(Connection *connection, uint32_t events) {
+  if (connection->events == events) {
+    return;
+  }
+  struct epoll_event event = {};
+  event.events = events;
+  event.data.fd = connection->fd;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, connection->fd, &event) == 0) {
+    connection->events = events;
+  }
+}
+
+void HttpServer::Close(int fd) {
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  close(fd);
+  connections_.erase(fd);
+}
+
+void HttpServer::CloseIdle() {
+  const auto now = std::chrono::steady_clock::now();
+  std::vector<int> idle;
+  for (const auto &[fd, connection] : connections_) {
+    // Waiting on the resolver thread is not idle.
+    if (!connection->resolving &&
+        now - connection->last_active >= kIdleTimeout) {
+      idle.push_back(fd);
+    }
+  }
+  for (const int fd : idle) {
+    Close(fd);
+  }
+}
+
+void HttpServer::ResolveLoop() {
+  std::unique_lock lock(resolve_mutex_);
+  while (true) {
+    resolve_wanted_.wait(lock, [this] { return !jobs_.empty() || stopping_; });
+    if (stopping_) {
+      return;
+    }
+    Job job = std::move(jobs_.front());
+    jobs_.pop_front();
+    lock.unlock();
+    if (!refresher_.Refresh()) {
+      spdlog::warn("failed to refresh the file system");
+    }
+    PrepareResponse(&job);
+    lock.lock();
+    resolved_.push_back(std::move(job));
+    const uint64_t one = 1;
+    if (write(wake_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      spdlog::warn("failed to wake the event loop: {}", strerror(errno));
+    }
+  }
+}
+
+}  // namespace
+
+bool ServeHttp(FileSystem &fs, const HttpServerOptions &options) {
+  HttpServer server(fs);
+  if (!server.Listen(options)) {
+    return false;
+  }
+  server.Run();
+  return false;
+}
+
+}  // namespace fat32
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "fat32.h"
+
+namespace fat32 {
+
+struct HttpServerOptions {
+  std::string address = "0.0.0.0";
+  uint16_t port = 8001;
+};
+
+// Serves the files of the file system over HTTP/1.1, with single range
+// requests for video players and a plain listing of directories.
+//
+// File data is sent with sendfile from the image file, at the offsets of
+// the extents of the file, so that it goes from the page cache to the
+// socket without being copied or passing through FUSE. All connections are
+// served by one thread with epoll, sending large responses a chunk at a
+// time so that they do not hold up the others. Requests are resolved on
+// another thread, which also refreshes the file system, so that sending
+// never waits on the file system lock. Connections idle for a minute are
+// closed.
+//
+// Returns false if the server cannot listen, otherwise serves until the
+// process is stopped.
+bool ServeHttp(FileSystem& fs, const HttpServerOptions& options = {});
+
+}  // namespace fat32
@@ -0,0 +1,223 @@
+#include "io_uring_block_device.h"
+
+#include <liburing.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+namespace fat32 {
+
+namespace {
+
+// Number of reads in flight per ring.
+constexpr unsigned kQueueDepth = 64;
+// Rings kept for reuse once their reader is done.
+constexpr size_t kMaxIdleRings = 8;
+// Largest single read, the length of a read is 32 bits.
+constexpr uint64_t kMaxReadSize = 1 << 30;
+
+class Ring {
+ public:
+  ~Ring() {
+    if (initialized_) {
+      io_uring_queue_exit(&ring_);
+    }
+  }
+
+  bool Init() {
+    const int ret = io_uring_queue_init(kQueueDepth, &ring_, 0);
+    if (ret < 0) {
+      spdlog::error("io_uring_queue_init failed: {}", strerror(-ret));
+      return false;
+    }
+    initialized_ = true;
+    return true;
+  }
+
+  io_uring *get() { return &ring_; }
+
+  // Waits for `count` completions and drops them. Returns false if they
+  // cannot be waited for.
+  bool Drain(unsigned count) {
+    while (count > 0) {
+      io_uring_cqe *cqe;
+      const int ret = io_uring_wait_cqe(&ring_, &cqe);
+      if (ret == -EINTR || ret == -EAGAIN) {
+        continue;
+      }
+      if (ret < 0) {
+        spdlog::error("io_uring_wait_cqe failed: {}", strerror(-ret));
+        return false;
+      }
+      io_uring_cqe_seen(&ring_, cqe);
+      count--;
+    }
+    return true;
+  }
+
+ private:
+  io_uring ring_;
+  bool initialized_ = false;
+};
+
+// Reads with one ring per concurrent reader, so that every reader keeps
+// its whole batch in flight at once.
+class IoUringBlockDevice : public BlockDevice {
+ public:
+  IoUringBlockDevice(int fd, uint64_t size, bool writable,
+                     std::unique_ptr<Ring> ring)
+      : BlockDevice(fd, size, writable) {
+    rings_.push_back(std::move(ring));
+  }
+
+  bool Read(uint64_t offset, uint64_t size, char *out) const override {
+    return ReadBatch({{offset, size, out}});
+  }
+
+  bool ReadBatch(const std::vector<ReadRequest> &requests) const override;
+
+ private:
+  std::unique_ptr<Ring> AcquireRing() const;
+
+  void ReleaseRing(std::unique_ptr<Ring> ring) const;
+
+  // Idle rings.
+  mutable std::mutex mutex_;
+  mutable std::vector<std::unique_ptr<Ring>> rings_;
+};
+
+bool IoUringBlockDevice::ReadBatch(
+    const std::vector<ReadRequest> &requests) const {
+  for (const ReadRequest &request : requests) {
+    if (!IsInRange(request.offset, request.size)) {
+      spdlog::error("read out of range: 0x{:X}+{}", request.offset,
+                    request.size);
+      return false;
+    }
+  }
+  for (const ReadRequest &request : requests) {
+    RecordRead(request.offset, request.size);
+  }
+
+  if (requests.empty()) {
+    return true;
+  }
+
+  std::unique_ptr<Ring> ring = AcquireRing();
+  if (ring == nullptr) {
+    return false;
+  }
+
+  // What is left of each request, a short read is submitted again for the
+  // rest.
+  std::vector<ReadRequest> pending = requests;
+  std::deque<ReadRequest *> to_submit;
+  for (ReadRequest &request : pending) {
+    if (request.size > 0) {
+      to_submit.push_back(&request);
+    }
+  }
+
+  bool failed = false;
+  unsigned in_flight = 0;
+  while ((!failed && !to_submit.empty()) || in_flight > 0) {
+    while (!failed && !to_submit.empty() && in_flight < kQueueDepth) {
+      io_uring_sqe *sqe = io_uring_get_sqe(ring->get());
+      if (sqe == nullptr) {
+        break;
+      }
+      ReadRequest *request = to_submit.front();
+      to_submit.pop_front();
+      io_uring_prep_read(sqe, fd(), request->out,
+                         std::min(request->size, kMaxReadSize),
+                         request->offset);
+      io_uring_sqe_set_data(sqe, request);
+      in_flight++;
+    }
+
+    const int ret = io_uring_submit_and_wait(ring->get(), 1);
+    if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+      spdlog::error("io_uring_submit_and_wait failed: {}", strerror(-ret));
+      // Reads the kernel took still target the buffers of the caller, wait
+      // for them. The ring is not reused, it may hold unsubmitted reads.
+      if (!ring->Drain(in_flight - io_uring_sq_ready(ring->get()))) {
+        // Closing the ring would not wait for the reads either.
+        ring.release();
+      }
+      return false;
+    }
+
+    io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(ring->get(), &cqe) == 0) {
+      auto *request = static_cast<ReadRequest *>(io_uring_cqe_get_data(cqe));
+      const int res = cqe->res;
+      io_uring_cqe_seen(ring->get(), cqe);
+      in_flight--;
+
+      if (res == -EINTR || res == -EAGAIN) {
+        to_submit.push_back(request);
+      } else if (res < 0) {
+        spdlog::error("read failed at 0x{:X}: {}", request->offset,
+                      strerror(-res));
+        failed = true;
+      } else if (res == 0) {
+        spdlog::error("unexpected end of image at 0x{:X}", request->offset);
+        failed = true;
+      } else {
+        request->out += res;
+        request->offset += res;
+        request->size -= res;
+        if (request->size > 0) {
+          to_submit.push_back(request);
+        }
+      }
+    }
+  }
+
+  ReleaseRing(std::move(ring));
+  return !failed;
+}
+
+std::unique_ptr<Ring> IoUringBlockDevice::AcquireRing() const {
+  {
+    std::lock_guard lock(mutex_);
+    if (!rings_.empty()) {
+      std::unique_ptr<Ring> ring = std::move(rings_.back());
+      rings_.pop_back();
+      return ring;
+    }
+  }
+  auto ring = std::make_unique<Ring>();
+  if (!ring->Init()) {
+    return nullptr;
+  }
+  return ring;
+}
+
+void IoUringBlockDevice::ReleaseRing(std::unique_ptr<Ring> ring) const {
+  std::lock_guard lock(mutex_);
+  if (rings_.size() < kMaxIdleRings) {
+    rings_.push_back(std::move(ring));
+  }
+}
+
+}  // namespace
+
+std::unique_ptr<BlockDevice> OpenIoUringBlockDevice(int fd, uint64_t size,
+                                                    bool writable) {
+  // Fail early, and not on the first read, if io_uring is not available.
+  auto ring = std::make_unique<Ring>();
+  if (!ring->Init()) {
+    return nullptr;
+  }
+  return std::make_unique<IoUringBlockDevice>(fd, size, writable,
+                                              std::move(ring));
+}
+
+}  // namespace fat32
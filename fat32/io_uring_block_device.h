@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "block_device.h"
+
+namespace fat32 {
+
+// Opens a device reading `fd` with io_uring, writes use the base class. The
+// device owns `fd` once created. Returns nullptr, leaving `fd` open, if
+// io_uring is unavailable.
+std::unique_ptr<BlockDevice> OpenIoUringBlockDevice(int fd, uint64_t size,
+                                                    bool writable);
+
+}  // namespace fat32
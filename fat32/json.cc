@@ -0,0 +1,33 @@
+#include "json.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+#include "directory_parser.h"
+
+namespace fat32 {
+
+void AppendJsonString(absl::string_view value, std::string *out) {
+  out->push_back('"');
+  while (!value.empty()) {
+    const char c = value.front();
+    const unsigned char byte = static_cast<unsigned char>(c);
+    uint32_t code_point;
+    const size_t size = byte >= 0x80 ? DecodeUtf8(value, &code_point) : 1;
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (byte < 0x20 || size == 0) {
+      char escaped[7];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", byte);
+      out->append(escaped);
+    } else {
+      out->append(value.data(), size);
+    }
+    value.remove_prefix(std::max<size_t>(size, 1));
+  }
+  out->push_back('"');
+}
+
+}  // namespace fat32
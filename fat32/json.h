@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+#include "absl/strings/string_view.h"
+
+namespace fat32 {
+
+// Appends `value` as a quoted JSON string, escaping quotes, backslashes and
+// control characters. Long names are UTF-8, but short names may hold bytes
+// of a code page, so bytes from 0x80 that are not valid UTF-8 are escaped
+// as the Latin-1 characters \u0080 to \u00ff rather than copied.
+void AppendJsonString(absl::string_view value, std::string* out);
+
+}  // namespace fat32
@@ -1,8 +1,23 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/strip.h"
 #include "argparse/argparse.hpp"
+#include "clip_index.h"
 #include "fat32.h"
 #include "fat32_fuse.h"
+#include "fragmentation.h"
+#include "http_server.h"
+#include "mp4_probe.h"
+#include "server.h"
 #include "spdlog/cfg/env.h"
 #include "spdlog/spdlog.h"
 
@@ -23,11 +38,71 @@ int main(int argc, char** argv) {
   program.add_argument("-m", "--mount-path")
       .help("path to mount fuse filesystem")
       .default_value(std::string{""});
+  program.add_argument("-s", "--socket")
+      .help("path of the Unix socket to serve on")
+      .default_value(std::string{""});
+  program.add_argument("--port")
+      .help("TCP port to serve HTTP on")
+      .default_value(8001)
+      .scan<'i', int>();
+  program.add_argument("--block-device")
+      .help("how to read the image file: mmap, pread, io_uring")
+      .default_value(std::string{"mmap"})
+      .choices("mmap", "pread", "io_uring");
+  program.add_argument("--cache-mb")
+      .help("memory budget of the cache of directory clusters and small "
+            "files, 0 to disable")
+      .default_value(16)
+      .scan<'i', int>();
+  program.add_argument("--readahead-kb")
+      .help("size of the chunks read ahead of sequential reads when "
+            "mounted with --no-zero-copy, 0 to disable")
+      .default_value(1024)
+      .scan<'i', int>();
+  program.add_argument("--no-zero-copy")
+      .help("copy file data into replies when mounted instead of letting "
+            "the kernel splice it from the image file")
+      .flag();
+  program.add_argument("--read-write")
+      .help("allow creating, writing and removing files when mounted")
+      .flag();
+
+  program.add_argument("--entry-timeout")
+      .help("seconds the kernel may cache names when mounted")
+      .default_value(1.0)
+      .scan<'g', double>();
+  program.add_argument("--attr-timeout")
+      .help("seconds the kernel may cache attributes when mounted")
+      .default_value(1.0)
+      .scan<'g', double>();
+
+  program.add_argument("--watch-interval")
+      .help("seconds between refreshes of the image when watching")
+      .default_value(1.0)
+      .scan<'g', double>();
+
+  program.add_argument("--from")
+      .help("with index, print the clips of the index at --export-path "
+            "recorded from this time, as 2024-04-19_08-46-12")
+      .default_value(std::string{""});
+  program.add_argument("--to")
+      .help("with index, print the clips recorded before this time")
+      .default_value(std::string{""});
+  program.add_argument("--top")
+      .help("with fragmentation, number of most fragmented files to list")
+      .default_value(20)
+      .scan<'i', int>();
+  program.add_argument("--follow")
+      .help("with index, keep the index up to date with the image")
+      .flag();
 
   program.add_argument("action")
-      .help("supported actions: ls, cat")
+      .help(
+          "supported actions: ls, cat, export, mount, watch, index, probe, "
+          "serve, http, fragmentation")
       .default_value(std::string{"ls"})
-      .choices("ls", "cat", "export", "mount");
+      .choices("ls", "cat", "export", "mount", "watch", "index",
+               "probe", "serve", "http", "fragmentation");
 
   try {
     program.parse_args(argc, argv);
@@ -41,13 +116,83 @@ int main(int argc, char** argv) {
   std::string path = program.get("path");
   std::string export_path = program.get("export-path");
   std::string mount_path = program.get("mount-path");
+  std::string socket_path = program.get("socket");
+  int port = program.get<int>("port");
+  std::string block_device = program.get("block-device");
+  int cache_mb = program.get<int>("cache-mb");
+  int readahead_kb = program.get<int>("readahead-kb");
+  bool zero_copy = !program.get<bool>("no-zero-copy");
+  bool read_write = program.get<bool>("read-write");
+  double entry_timeout = program.get<double>("entry-timeout");
+  double attr_timeout = program.get<double>("attr-timeout");
+  double watch_interval = program.get<double>("watch-interval");
+  std::string from = program.get("from");
+  std::string to = program.get("to");
+  bool follow = program.get<bool>("follow");
+  int top = program.get<int>("top");
   spdlog::debug("file: {}", file);
   spdlog::debug("action: {}", action);
   spdlog::debug("path: {}", path);
   spdlog::debug("export path: {}", export_path);
   spdlog::debug("mount path: {}", mount_path);
+  spdlog::debug("socket: {}", socket_path);
+  spdlog::debug("port: {}", port);
+  spdlog::debug("block device: {}", block_device);
+  spdlog::debug("cache: {} MiB", cache_mb);
+  spdlog::debug("readahead: {} KiB", readahead_kb);
+  spdlog::debug("zero copy: {}", zero_copy);
+  spdlog::debug("read write: {}", read_write);
+  spdlog::debug("entry timeout: {} s", entry_timeout);
+  spdlog::debug("attr timeout: {} s", attr_timeout);
+  spdlog::debug("watch interval: {} s", watch_interval);
+
+  if (cache_mb < 0 || cache_mb > (1 << 16)) {
+    std::cerr << "invalid cache size " << cache_mb << std::endl;
+    return 1;
+  }
+  if (readahead_kb < 0 || readahead_kb > (1 << 20)) {
+    std::cerr << "invalid readahead size " << readahead_kb << std::endl;
+    return 1;
+  }
+  if (entry_timeout < 0 || attr_timeout < 0) {
+    std::cerr << "invalid cache timeout" << std::endl;
+    return 1;
+  }
+  if (watch_interval <= 0) {
+    std::cerr << "invalid watch interval" << std::endl;
+    return 1;
+  }
+
+  if (action == "index" && (!from.empty() || !to.empty())) {
+    // Queries only need the index, not the image.
+    int64_t begin = INT64_MIN;
+    int64_t end = INT64_MAX;
+    if ((!from.empty() && !fat32::ParseClipTime(from, &begin)) ||
+        (!to.empty() && !fat32::ParseClipTime(to, &end))) {
+      std::cerr << "invalid time range" << std::endl;
+      return 1;
+    }
+    std::unique_ptr<fat32::ClipIndex> index =
+        fat32::OpenClipIndex(export_path);
+    if (index == nullptr) {
+      std::cerr << "failed to open index " << export_path << std::endl;
+      return 1;
+    }
+    for (const auto& clip : index->Find(begin, end)) {
+      std::cout << fat32::FormatClipJson(*index, clip) << "\n";
+    }
+    return 0;
+  }
 
-  auto fs = fat32::FileSystem(file);
+  fat32::BlockDeviceType block_device_type;
+  if (!fat32::ParseBlockDeviceType(block_device, &block_device_type)) {
+    std::cerr << "unknown block device '" << block_device << "'" << std::endl;
+    return 1;
+  }
+
+  auto fs = fat32::FileSystem(file, block_device_type,
+                              static_cast<uint64_t>(cache_mb) << 20,
+                              read_write && action == "mount");
   if (!fs.IsValid()) {
     std::cerr << "invalid fat32 image file" << std::endl;
     return 1;
@@ -73,13 +218,153 @@ int main(int argc, char** argv) {
       std::cerr << "--mount-path required" << std::endl;
       return 1;
     }
-    bool succeed = fat32::MountFat32(fs, mount_path);
+    fat32::MountOptions options;
+    options.readahead_window = readahead_kb * 1024;
+    options.zero_copy = zero_copy;
+    options.entry_timeout = entry_timeout;
+    options.attr_timeout = attr_timeout;
+    options.read_write = read_write;
+    bool succeed = fat32::MountFat32(fs, mount_path, options);
     if (!succeed) {
       std::cerr << "fuse exited abnormally!" << std::endl;
     }
     { std::cerr << "fuse fs unmounted" << std::endl; }
+  } else if (action == "serve") {
+    if (socket_path.empty()) {
+      std::cerr << "--socket required" << std::endl;
+      return 1;
+    }
+    if (!fat32::ServeFat32(fs, socket_path)) {
+      return 1;
+    }
+  } else if (action == "http") {
+    if (port <= 0 || port > UINT16_MAX) {
+      std::cerr << "invalid --port " << port << std::endl;
+      return 1;
+    }
+    fat32::HttpServerOptions options;
+    options.port = port;
+    if (!fat32::ServeHttp(fs, options)) {
+      return 1;
+    }
+  } else if (action == "watch") {
+    // Prints the changes below path as they are found, one JSON object per
+    // line, until killed.
+    const std::string root(
+        absl::StripSuffix(absl::StripPrefix(path, "/"), "/"));
+    fat32::TreeSnapshot before;
+    if (!fs.Snapshot(root, &before)) {
+      std::cerr << "failed to open " << path << std::endl;
+      return 1;
+    }
+    while (true) {
+      std::this_thread::sleep_for(
+          std::chrono::duration<double>(watch_interval));
+      if (!fs.Refresh()) {
+        spdlog::warn("failed to refresh {}", file);
+        continue;
+      }
+      if (fs.Generation() == before.generation) {
+        continue;
+      }
+      fat32::TreeSnapshot after;
+      if (!fs.Snapshot(root, &after)) {
+        spdlog::warn("failed to open {}", path);
+        continue;
+      }
+      std::vector<fat32::TreeChange> changes;
+      fat32::DiffSnapshots(before, after, &changes);
+      for (const auto& change : changes) {
+        std::cout << fat32::FormatChangeJson(change) << "\n";
+      }
+      std::cout.flush();
+      before = std::move(after);
+    }
+  } else if (action == "index") {
+    if (export_path.empty()) {
+      std::cerr << "--export-path required" << std::endl;
+      return 1;
+    }
+    const std::string root(
+        absl::StripSuffix(absl::StripPrefix(path, "/"), "/"));
+    fat32::ClipIndexBuilder builder(root.empty() ? "TeslaCam" : root);
+    if (!builder.Update(fs) || !builder.Write(export_path)) {
+      std::cerr << "failed to index " << builder.Root() << std::endl;
+      return 1;
+    }
+    while (follow) {
+      std::this_thread::sleep_for(
+          std::chrono::duration<double>(watch_interval));
+      if (!fs.Refresh()) {
+        spdlog::warn("failed to refresh {}", file);
+        continue;
+      }
+      if (fs.Generation() == builder.Generation()) {
+        continue;
+      }
+      if (!builder.Update(fs) || !builder.Write(export_path)) {
+        spdlog::warn("failed to index {}", builder.Root());
+      }
+    }
+  } else if (action == "probe") {
+    // The file at path, the MP4 files of the directory at path, or the
+    // files named on stdin, one per line, if path is "-".
+    std::vector<std::string> paths;
+    const std::string target(
+        absl::StripSuffix(absl::StripPrefix(path, "/"), "/"));
+    fat32::DirectoryEntry entry;
+    if (path == "-") {
+      for (std::string line; std::getline(std::cin, line);) {
+        if (!line.empty()) {
+          paths.push_back(std::string(absl::StripPrefix(line, "/")));
+        }
+      }
+    } else if (fs.GetEntry(target, &entry) && entry.IsDirectory()) {
+      std::vector<fat32::DirectoryEntry> entries;
+      fs.ListDirectory(target, &entries);
+      for (const auto& child : entries) {
+        if (!child.IsDirectory() &&
+            absl::EndsWithIgnoreCase(child.name, ".mp4")) {
+          paths.push_back(absl::StrCat(target, "/", child.name));
+        }
+      }
+    } else {
+      paths.push_back(target);
+    }
+
+    for (const auto& file_path : paths) {
+      fat32::FileLayout layout;
+      fat32::Mp4Info info;
+      if (!fs.GetFileLayout(file_path, &layout) ||
+          layout.entry.IsDirectory()) {
+        std::cout << fat32::FormatMp4InfoJson(file_path, nullptr,
+                                              "no such file")
+                  << "\n";
+      } else if (!fat32::ProbeMp4(fs, layout, &info)) {
+        std::cout << fat32::FormatMp4InfoJson(file_path, nullptr,
+                                              "no movie header")
+                  << "\n";
+      } else {
+        std::cout << fat32::FormatMp4InfoJson(file_path, &info) << "\n";
+      }
+    }
+  } else if (action == "fragmentation") {
+    // A JSON report on the files below path, the whole image by default.
+    const std::string root(
+        absl::StripSuffix(absl::StripPrefix(path, "/"), "/"));
+    fat32::FragmentationReport report;
+    if (!fat32::AnalyzeFragmentation(fs, root, &report)) {
+      std::cerr << "failed to open " << path << std::endl;
+      return 1;
+    }
+    std::cout << fat32::FormatFragmentationJson(report, std::max(top, 0));
   } else {
     std::cerr << "action '" << action << "' not implemented yet" << std::endl;
   }
+
+  const fat32::ClusterCacheStats stats = fs.GetClusterCacheStats();
+  spdlog::debug("cluster cache: {} hits, {} misses, {} evictions, {}/{} bytes",
+                stats.hits, stats.misses, stats.evictions, stats.size,
+                stats.capacity);
   return 0;
 }
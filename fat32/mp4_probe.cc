@@ -0,0 +1,146 @@
+#include "mp4_probe.h"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "absl/strings/str_cat.h"
+#include "json.h"
+#include "spdlog/spdlog.h"
+
+namespace fat32 {
+
+namespace {
+
+// Seconds from 1904-01-01, the epoch of MP4 times, to 1970-01-01.
+constexpr int64_t kMp4EpochOffset = 2082844800;
+// Boxes looked at in a level before giving up, against corrupted sizes.
+constexpr int kMaxBoxes = 1024;
+
+constexpr uint32_t FourCC(const char (&type)[5]) {
+  return (static_cast<uint32_t>(static_cast<uint8_t>(type[0])) << 24) |
+         (static_cast<uint32_t>(static_cast<uint8_t>(type[1])) << 16) |
+         (static_cast<uint32_t>(static_cast<uint8_t>(type[2])) << 8) |
+         static_cast<uint32_t>(static_cast<uint8_t>(type[3]));
+}
+
+uint32_t Load32(const char *data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return be32toh(value);
+}
+
+uint64_t Load64(const char *data) {
+  uint64_t value;
+  memcpy(&value, data, sizeof(value));
+  return be64toh(value);
+}
+
+struct Box {
+  uint32_t type;
+  uint64_t offset;
+  uint64_t header_size;
+  uint64_t size;
+};
+
+// Reads the header of the box at `offset`, which must end by `end`.
+bool ReadBox(const FileSystem &fs, const FileLayout &layout, uint64_t offset,
+             uint64_t end, Box *box) {
+  char header[16];
+  if (end - offset < 8) {
+    return false;
+  }
+  const uint32_t size = std::min<uint64_t>(sizeof(header), end - offset);
+  if (fs.ReadFile(layout, offset, size, header) != size) {
+    return false;
+  }
+
+  box->type = Load32(header + 4);
+  box->offset = offset;
+  box->header_size = 8;
+  box->size = Load32(header);
+  if (box->size == 1) {
+    // 64 bits size after the type.
+    if (size < 16) {
+      return false;
+    }
+    box->header_size = 16;
+    box->size = Load64(header + 8);
+  } else if (box->size == 0) {
+    // Up to the end of the file.
+    box->size = end - offset;
+  }
+  return box->size >= box->header_size && box->size <= end - offset;
+}
+
+// Finds the first box of `type` among the boxes in [begin, end).
+bool FindBox(const FileSystem &fs, const FileLayout &layout, uint64_t begin,
+             uint64_t end, uint32_t type, Box *box) {
+  uint64_t offset = begin;
+  for (int i = 0; i < kMaxBoxes && offset < end; i++) {
+    if (!ReadBox(fs, layout, offset, end, box)) {
+      return false;
+    }
+    if (box->type == type) {
+      return true;
+    }
+    offset += box->size;
+  }
+  return false;
+}
+
+}  // namespace
+
+bool ProbeMp4(const FileSystem &fs, const FileLayout &layout, Mp4Info *info) {
+  Box moov;
+  Box mvhd;
+  if (!FindBox(fs, layout, 0, layout.entry.size, FourCC("moov"), &moov) ||
+      !FindBox(fs, layout, moov.offset + moov.header_size,
+               moov.offset + moov.size, FourCC("mvhd"), &mvhd)) {
+    spdlog::debug("no movie header in {}", layout.path);
+    return false;
+  }
+
+  // Version and flags, then the times, timescale and duration, in 32 bits
+  // for version 0 or 64 bits for version 1.
+  char data[32];
+  const uint64_t content_size = mvhd.size - mvhd.header_size;
+  const uint32_t size = std::min<uint64_t>(sizeof(data), content_size);
+  if (fs.ReadFile(layout, mvhd.offset + mvhd.header_size, size, data) !=
+      size) {
+    return false;
+  }
+  uint64_t creation_time;
+  if (size >= 32 && data[0] == 1) {
+    creation_time = Load64(data + 4);
+    info->timescale = Load32(data + 20);
+    info->duration = Load64(data + 24);
+  } else if (size >= 20 && data[0] == 0) {
+    creation_time = Load32(data + 4);
+    info->timescale = Load32(data + 12);
+    info->duration = Load32(data + 16);
+  } else {
+    spdlog::debug("invalid movie header in {}", layout.path);
+    return false;
+  }
+  info->creation_time = static_cast<int64_t>(creation_time) - kMp4EpochOffset;
+  return true;
+}
+
+std::string FormatMp4InfoJson(absl::string_view path, const Mp4Info *info,
+                              absl::string_view error) {
+  std::string out = "{\"path\":";
+  AppendJsonString(path, &out);
+  if (info == nullptr) {
+    out.append(",\"error\":");
+    AppendJsonString(error, &out);
+    out.push_back('}');
+    return out;
+  }
+  absl::StrAppend(&out, ",\"duration\":", info->DurationInSeconds(),
+                  ",\"creation_time\":", info->creation_time, "}");
+  return out;
+}
+
+}  // namespace fat32
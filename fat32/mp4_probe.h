@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "absl/strings/string_view.h"
+#include "fat32.h"
+
+namespace fat32 {
+
+// What the movie header (mvhd) of an MP4 file tells.
+struct Mp4Info {
+  uint32_t timescale = 0;
+  // In units of the timescale.
+  uint64_t duration = 0;
+  // Seconds since the epoch.
+  int64_t creation_time = 0;
+
+  double DurationInSeconds() const {
+    return timescale > 0 ? static_cast<double>(duration) / timescale : 0.0;
+  }
+};
+
+// Reads the movie header of the file of `layout`. Only the headers of the
+// boxes on the way to the moov box and its mvhd are read, not the media
+// data they skip. Returns false if the file has no movie header yet, as
+// while it is being recorded.
+bool ProbeMp4(const FileSystem& fs, const FileLayout& layout, Mp4Info* info);
+
+// Formats the result of probing the file at `path` as a JSON object on a
+// single line, without the newline. `info` is nullptr if probing failed,
+// for the reason in `error`.
+std::string FormatMp4InfoJson(absl::string_view path, const Mp4Info* info,
+                              absl::string_view error = "");
+
+}  // namespace fat32
@@ -0,0 +1,164 @@
+#include "readahead.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace fat32 {
+
+namespace {
+
+// Number of back to back reads after which a file is read ahead.
+constexpr uint32_t kMinSequentialReads = 2;
+
+}  // namespace
+
+ReadaheadWorker::ReadaheadWorker() : thread_([this] { Run(); }) {}
+
+ReadaheadWorker::~ReadaheadWorker() {
+  {
+    std::lock_guard lock(mutex_);
+    stopped_ = true;
+  }
+  cv_.notify_one();
+  thread_.join();
+}
+
+void ReadaheadWorker::Submit(std::function<void()> job) {
+  {
+    std::lock_guard lock(mutex_);
+    jobs_.push_back(std::move(job));
+  }
+  cv_.notify_one();
+}
+
+void ReadaheadWorker::Run() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock lock(mutex_);
+      cv_.wait(lock, [this] { return stopped_ || !jobs_.empty(); });
+      if (stopped_) {
+        return;
+      }
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    job();
+  }
+}
+
+FileReadahead::FileReadahead(
+    const FileSystem *fs, ReadaheadWorker *worker, uint32_t window,
+    std::shared_ptr<const std::atomic<uint64_t>> writes)
+    : fs_(fs), worker_(worker), window_(window), writes_(std::move(writes)) {}
+
+uint32_t FileReadahead::Read(const std::shared_ptr<const FileLayout> &layout,
+                             uint32_t offset, uint32_t size, char *out) {
+  std::unique_lock lock(mutex_);
+  if (layout != layout_) {
+    // The file was resolved again, what was read ahead may be stale.
+    chunks_.clear();
+    layout_ = layout;
+  }
+  // Chunks fetched before a write may miss it. The counter is read before
+  // fetching, so a write racing with the fetch drops the chunk too.
+  const uint64_t writes = writes_->load();
+  std::erase_if(chunks_, [writes](const auto &item) {
+    return item.second->writes != writes;
+  });
+
+  if (offset == next_offset_) {
+    sequential_reads_++;
+  } else {
+    sequential_reads_ = 0;
+  }
+  const uint64_t end = static_cast<uint64_t>(offset) + size;
+  next_offset_ = end;
+
+  uint32_t size_read = ReadChunks(lock, offset, size, out);
+
+  // Chunks behind the read are not needed anymore.
+  chunks_.erase(chunks_.begin(), chunks_.lower_bound(offset / window_));
+
+  if (sequential_reads_ >= kMinSequentialReads) {
+    // Keep the chunk holding the end of the read and the next one in
+    // memory or in flight.
+    for (uint64_t index = end / window_; index <= end / window_ + 1;
+         index++) {
+      if (index * window_ < layout->entry.size && !chunks_.contains(index)) {
+        Prefetch(layout, index, writes);
+      }
+    }
+  }
+  lock.unlock();
+
+  if (size_read < size) {
+    size_read += fs_->ReadFile(*layout, offset + size_read, size - size_read,
+                               out + size_read);
+  }
+  return size_read;
+}
+
+uint32_t FileReadahead::ReadChunks(std::unique_lock<std::mutex> &lock,
+                                   uint32_t offset, uint32_t size,
+                                   char *out) {
+  uint32_t size_read = 0;
+  while (size_read < size) {
+    const uint64_t position = static_cast<uint64_t>(offset) + size_read;
+    const auto it = chunks_.find(position / window_);
+    if (it == chunks_.end()) {
+      break;
+    }
+    const std::shared_ptr<Chunk> chunk = it->second;
+    cv_.wait(lock, [&chunk] { return chunk->ready; });
+
+    const uint64_t skip = position % window_;
+    if (skip >= chunk->size) {
+      break;
+    }
+    const uint32_t n = std::min<uint64_t>(size - size_read, chunk->size - skip);
+    memcpy(out + size_read, chunk->data.data() + skip, n);
+    size_read += n;
+  }
+  return size_read;
+}
+
+void FileReadahead::Prefetch(const std::shared_ptr<const FileLayout> &layout,
+                             uint64_t index, uint64_t writes) {
+  auto chunk = std::make_shared<Chunk>();
+  chunk->writes = writes;
+  chunks_.emplace(index, chunk);
+
+  std::weak_ptr<FileReadahead> weak_self = weak_from_this();
+  worker_->Submit([weak_self, layout, chunk, index] {
+    const std::shared_ptr<FileReadahead> self = weak_self.lock();
+    if (self == nullptr) {
+      return;  // the file was closed
+    }
+    {
+      // Skip chunks dropped while waiting in the queue, a reader still
+      // waiting on one falls back to reading the file.
+      std::lock_guard lock(self->mutex_);
+      const auto it = self->chunks_.find(index);
+      if (it == self->chunks_.end() || it->second != chunk) {
+        chunk->ready = true;
+        self->cv_.notify_all();
+        return;
+      }
+    }
+
+    // The data is only touched by readers once the chunk is ready.
+    chunk->data.resize(self->window_);
+    const uint32_t size = self->fs_->ReadFile(
+        *layout, index * self->window_, self->window_, chunk->data.data());
+    {
+      std::lock_guard lock(self->mutex_);
+      chunk->size = size;
+      chunk->ready = true;
+    }
+    self->cv_.notify_all();
+  });
+}
+
+}  // namespace fat32
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fat32.h"
+
+namespace fat32 {
+
+// A background thread running prefetch jobs in submission order.
+class ReadaheadWorker {
+ public:
+  ReadaheadWorker();
+  ~ReadaheadWorker();
+
+  void Submit(std::function<void()> job);
+
+ private:
+  void Run();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> jobs_;
+  bool stopped_ = false;
+  std::thread thread_;
+};
+
+// Readahead state of one open file.
+//
+// The file is split in chunks of `window` bytes. Once reads are found to
+// be sequential, the chunk after the one being read is fetched by the
+// worker, so that the following reads are served from memory instead of
+// waiting on the card. Chunks are dropped once `writes`, bumped by every
+// write to the file, changed since they were fetched.
+class FileReadahead : public std::enable_shared_from_this<FileReadahead> {
+ public:
+  FileReadahead(const FileSystem* fs, ReadaheadWorker* worker,
+                uint32_t window,
+                std::shared_ptr<const std::atomic<uint64_t>> writes);
+
+  // Reads like FileSystem::ReadFile(layout, ...), from the prefetched
+  // chunks when possible.
+  uint32_t Read(const std::shared_ptr<const FileLayout>& layout,
+                uint32_t offset, uint32_t size, char* out);
+
+ private:
+  struct Chunk {
+    std::vector<char> data;
+    uint32_t size = 0;  // bytes read, valid once ready
+    bool ready = false;
+    uint64_t writes = 0;  // value of the counter when fetched
+  };
+
+  // Copies what the chunks hold from `offset` on, waiting for chunks in
+  // flight. Returns the number of bytes copied.
+  uint32_t ReadChunks(std::unique_lock<std::mutex>& lock, uint32_t offset,
+                      uint32_t size, char* out);
+
+  void Prefetch(const std::shared_ptr<const FileLayout>& layout,
+                uint64_t index, uint64_t writes);
+
+  const FileSystem* fs_;
+  ReadaheadWorker* worker_;
+  const uint32_t window_;
+  const std::shared_ptr<const std::atomic<uint64_t>> writes_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Guarded by mutex_.
+  std::shared_ptr<const FileLayout> layout_;
+  std::map<uint64_t, std::shared_ptr<Chunk>> chunks_;
+  uint64_t next_offset_ = 0;
+  uint32_t sequential_reads_ = 0;
+};
+
+}  // namespace fat32
@@ -0,0 +1,370 @@
+#include "server.h"
+
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+#include "mp4_probe.h"
+#include "spdlog/spdlog.h"
+
+namespace fat32 {
+
+namespace {
+
+// Length, code and id.
+constexpr size_t kFrameHeaderSize = 9;
+constexpr uint32_t kMaxRequestSize = 64 << 10;
+constexpr uint32_t kMaxReadSize = 16 << 20;
+
+uint32_t Load32(const char *data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return le32toh(value);
+}
+
+uint64_t Load64(const char *data) {
+  uint64_t value;
+  memcpy(&value, data, sizeof(value));
+  return le64toh(value);
+}
+
+void Append8(uint8_t value, std::string *out) { out->push_back(value); }
+
+void Append16(uint16_t value, std::string *out) {
+  value = htole16(value);
+  out->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void Append32(uint32_t value, std::string *out) {
+  value = htole32(value);
+  out->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void Append64(uint64_t value, std::string *out) {
+  value = htole64(value);
+  out->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void AppendEntry(const DirectoryEntry &entry, std::string *out) {
+  const uint16_t name_size = std::min<size_t>(entry.name.size(), UINT16_MAX);
+  Append8(entry.IsDirectory() ? 1 : 0, out);
+  Append32(entry.size, out);
+  Append64(entry.LastModificationDatetime().ToTimestamp(), out);
+  Append16(name_size, out);
+  out->append(entry.name.data(), name_size);
+}
+
+class Connection {
+ public:
+  Connection(FileSystem &fs, Refresher &refresher, int fd)
+      : fs_(fs), refresher_(refresher), fd_(fd) {}
+
+  ~Connection() { close(fd_); }
+
+  // Serves requests until the peer closes the connection or sends an
+  // invalid frame.
+  void Run();
+
+ private:
+  // Appends the reply to the request of `code` and `payload` to `out`.
+  void Handle(uint8_t code, uint32_t id, absl::string_view payload,
+              std::string *out);
+
+  // Sets `layout_` to the file at `path`, reusing it if still current.
+  bool GetLayout(absl::string_view path);
+
+  bool Send(const std::string &data);
+
+  FileSystem &fs_;
+  Refresher &refresher_;
+  const int fd_;
+  // The last file read, for ranges read one after the other.
+  FileLayout layout_;
+  bool has_layout_ = false;
+};
+
+void Connection::Run() {
+  std::string in;
+  std::string out;
+  std::vector<char> buffer(1 << 16);
+  while (true) {
+    const ssize_t n = read(fd_, buffer.data(), buffer.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    in.append(buffer.data(), n);
+
+    // Answer everything received so far in one write, or one per
+    // kMaxReadSize of replies.
+    size_t pos = 0;
+    bool refreshed = false;
+    while (in.size() - pos >= 4) {
+      const uint32_t size = Load32(in.data() + pos);
+      if (size < kFrameHeaderSize - 4 || size > kMaxRequestSize) {
+        spdlog::warn("invalid request of {} bytes", size);
+        return;
+      }
+      if (in.size() - pos - 4 < size) {
+        break;
+      }
+      if (!refreshed) {
+        if (!refresher_.Refresh()) {
+          spdlog::warn("failed to refresh the file system");
+        }
+        refreshed = true;
+      }
+      const char *frame = in.data() + pos + 4;
+      Handle(static_cast<uint8_t>(frame[0]), Load32(frame + 1),
+             absl::string_view(frame + 5, size - 5), &out);
+      pos += 4 + size;
+      if (out.size() >= kMaxReadSize) {
+        if (!Send(out)) {
+          return;
+        }
+        out.clear();
+      }
+    }
+    in.erase(0, pos);
+    if (!out.empty()) {
+      if (!Send(out)) {
+        return;
+      }
+      out.clear();
+    }
+  }
+}
+
+void Connection::Handle(uint8_t code, uint32_t id, absl::string_view payload,
+                        std::string *out) {
+  const size_t start = out->size();
+  Append32(0, out);  // length, set below
+  Append8(0, out);   // status, set below
+  Append32(id, out);
+
+  int status = 0;
+  switch (static_cast<ServerOperation>(code)) {
+    case ServerOperation::kList: {
+      std::vector<DirectoryEntry> entries;
+      if (!fs_.ListDirectory(absl::StripPrefix(payload, "/"), &entries)) {
+        status = ENOENT;
+        break;
+      }
+      for (const DirectoryEntry &entry : entries) {
+        if (entry.name != "." && entry.name != ".." &&
+            !entry.IsVolumeIdEntry()) {
+          AppendEntry(entry, out);
+        }
+      }
+      break;
+    }
+    case ServerOperation::kStat: {
+      DirectoryEntry entry;
+      if (!fs_.GetEntry(absl::StripPrefix(payload, "/"), &entry)) {
+        status = ENOENT;
+        break;
+      }
+      AppendEntry(entry, out);
+      break;
+    }
+    case ServerOperation::kRead: {
+      if (payload.size() < 12) {
+        status = EINVAL;
+        break;
+      }
+      const uint64_t offset = Load64(payload.data());
+      const uint32_t size = Load32(payload.data() + 8);
+      if (size > kMaxReadSize) {
+        status = EINVAL;
+        break;
+      }
+      if (!GetLayout(payload.substr(12))) {
+        status = ENOENT;
+        break;
+      }
+      if (offset >= layout_.entry.size) {
+        break;
+      }
+      const uint32_t read_size =
+          std::min<uint64_t>(size, layout_.entry.size - offset);
+      const size_t data_start = out->size();
+      out->resize(data_start + read_size);
+      if (fs_.ReadFile(layout_, offset, read_size, out->data() + data_start) !=
+          read_size) {
+        out->resize(data_start);
+        status = EIO;
+      }
+      break;
+    }
+    case ServerOperation::kProbe: {
+      Mp4Info info;
+      if (!GetLayout(payload)) {
+        status = ENOENT;
+        break;
+      }
+      if (!ProbeMp4(fs_, layout_, &info)) {
+        status = EINVAL;
+        break;
+      }
+      Append32(info.timescale, out);
+      Append64(info.duration, out);
+      Append64(info.creation_time, out);
+      break;
+    }
+    default:
+      status = ENOSYS;
+      break;
+  }
+
+  if (status != 0) {
+    out->resize(start + kFrameHeaderSize);
+  }
+  const uint32_t size = htole32(out->size() - start - 4);
+  memcpy(out->data() + start, &size, sizeof(size));
+  (*out)[start + 4] = static_cast<char>(status);
+}
+
+bool Connection::GetLayout(absl::string_view path) {
+  path = absl::StripPrefix(path, "/");
+  if (has_layout_ && layout_.path == path &&
+      layout_.generation == fs_.Generation()) {
+    return true;
+  }
+  has_layout_ = fs_.GetFileLayout(path, &layout_) &&
+                !layout_.entry.IsDirectory();
+  return has_layout_;
+}
+
+bool Connection::Send(const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    const ssize_t n =
+        send(fd_, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+// The sockets of the connections being served, so that they can be shut
+// down and waited for before what their threads use goes away.
+class Clients {
+ public:
+  void Add(int fd) {
+    std::lock_guard lock(mutex_);
+    fds_.insert(fd);
+  }
+
+  // Called by the thread of `fd` before closing it.
+  void Remove(int fd) {
+    std::lock_guard lock(mutex_);
+    fds_.erase(fd);
+    done_.notify_all();
+  }
+
+  // Shuts down the sockets and waits for their threads to remove them.
+  void StopAll() {
+    std::unique_lock lock(mutex_);
+    for (const int fd : fds_) {
+      shutdown(fd, SHUT_RDWR);
+    }
+    done_.wait(lock, [this] { return fds_.empty(); });
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable done_;
+  absl::flat_hash_set<int> fds_;
+};
+
+}  // namespace
+
+bool ServeFat32(FileSystem &fs, const std::string &socket_path) {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    spdlog::error("socket path too long: {}", socket_path);
+    return false;
+  }
+  memcpy(address.sun_path, socket_path.data(), socket_path.size());
+
+  // A socket nobody listens on is left by a server that stopped, and is
+  // replaced. One that answers belongs to a running server.
+  const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probe < 0) {
+    spdlog::error("failed to create socket: {}", strerror(errno));
+    return false;
+  }
+  const bool served =
+      connect(probe, reinterpret_cast<const struct sockaddr *>(&address),
+              sizeof(address)) == 0;
+  const bool stale = !served && errno == ECONNREFUSED;
+  close(probe);
+  if (served) {
+    spdlog::error("{} is served by another process", socket_path);
+    return false;
+  }
+  if (stale) {
+    unlink(socket_path.c_str());
+  }
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    spdlog::error("failed to create socket: {}", strerror(errno));
+    return false;
+  }
+  if (bind(fd, reinterpret_cast<const struct sockaddr *>(&address),
+           sizeof(address)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    spdlog::error("failed to listen on {}: {}", socket_path, strerror(errno));
+    close(fd);
+    return false;
+  }
+  spdlog::info("serving on {}", socket_path);
+
+  Refresher refresher(&fs);
+  Clients clients;
+  while (true) {
+    const int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      spdlog::error("failed to accept: {}", strerror(errno));
+      close(fd);
+      // The threads use the refresher and the file system of the caller.
+      clients.StopAll();
+      return false;
+    }
+    // Clients are few, scripts and the UI, a thread each keeps slow reads
+    // of one from holding up the others.
+    clients.Add(client);
+    std::thread([&fs, &refresher, &clients, client] {
+      Connection connection(fs, refresher, client);
+      connection.Run();
+      clients.Remove(client);
+    }).detach();
+  }
+}
+
+}  // namespace fat32
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "fat32.h"
+
+namespace fat32 {
+
+// Serves the file system on a Unix stream socket, so that scripts share one
+// FileSystem and its caches rather than opening the image every time.
+//
+// Every frame is a little endian uint32 length of what follows, a uint8
+// code, a uint32 id and a payload. A request has an operation as code, and
+// its reply has the same id, a status (0 or an errno) as code and, on
+// success, the payload described below. Requests may be pipelined, they are
+// answered in order. Paths are relative to the root, without a leading
+// slash, and take the rest of the payload.
+//
+//   kList   path -> entries of the directory
+//   kStat   path -> the entry
+//   kRead   uint64 offset, uint32 size, path -> up to size bytes
+//   kProbe  path -> uint32 timescale, uint64 duration, int64 creation time
+//
+// An entry is a uint8 flags (1 for a directory), a uint32 size, an int64
+// modification time, a uint16 name length and the name.
+enum class ServerOperation : uint8_t {
+  kList = 1,
+  kStat = 2,
+  kRead = 3,
+  kProbe = 4,
+};
+
+// Listens on `socket_path`, replacing a stale socket, and serves until the
+// process is stopped. Returns false if the socket cannot be set up.
+bool ServeFat32(FileSystem& fs, const std::string& socket_path);
+
+}  // namespace fat32
@@ -0,0 +1,39 @@
+#include "stats.h"
+
+#include <algorithm>
+
+#include "absl/strings/str_cat.h"
+
+namespace fat32 {
+
+void LatencyHistogram::Record(std::chrono::nanoseconds latency) {
+  const uint64_t ns = std::max<int64_t>(latency.count(), 0);
+  const uint64_t us = ns / 1000;
+  // The bucket of the first power of two above us.
+  const int bucket =
+      std::min(us == 0 ? 0 : 64 - __builtin_clzll(us), kBuckets - 1);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  total_ns_.fetch_add(ns, std::memory_order_relaxed);
+  buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::AppendJson(std::string *out) const {
+  absl::StrAppend(out, "{\"count\":", count_.load(std::memory_order_relaxed),
+                  ",\"total_us\":",
+                  total_ns_.load(std::memory_order_relaxed) / 1000,
+                  ",\"buckets_us\":{");
+  bool first = true;
+  for (int i = 0; i < kBuckets; i++) {
+    const uint64_t n = buckets_[i].load(std::memory_order_relaxed);
+    if (n == 0) {
+      continue;
+    }
+    const std::string bound =
+        i == kBuckets - 1 ? "inf" : absl::StrCat(uint64_t{1} << i);
+    absl::StrAppend(out, first ? "" : ",", "\"", bound, "\":", n);
+    first = false;
+  }
+  absl::StrAppend(out, "}}");
+}
+
+}  // namespace fat32
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace fat32 {
+
+// Counts latencies in power of two buckets of microseconds. Recording is
+// lock free, so it is cheap enough for every request.
+class LatencyHistogram {
+ public:
+  // Bucket i counts latencies under 2^i us, the last one all the others.
+  static constexpr int kBuckets = 32;
+
+  void Record(std::chrono::nanoseconds latency);
+
+  // Appends a JSON object with the count, the total and the non empty
+  // buckets keyed by their bound in microseconds.
+  void AppendJson(std::string* out) const;
+
+ private:
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> total_ns_{0};
+  std::atomic<uint64_t> buckets_[kBuckets] = {};
+};
+
+// Records the time from its construction to its destruction.
+class ScopedLatency {
+ public:
+  explicit ScopedLatency(LatencyHistogram* histogram)
+      : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+  ~ScopedLatency() {
+    histogram_->Record(std::chrono::steady_clock::now() - start_);
+  }
+
+  ScopedLatency(const ScopedLatency&) = delete;
+  ScopedLatency& operator=(const ScopedLatency&) = delete;
+
+ private:
+  LatencyHistogram* const histogram_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace fat32
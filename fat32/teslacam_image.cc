@@ -0,0 +1,500 @@
+#include "teslacam_image.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+#include <memory>
+#include <random>
+
+#include "spdlog/spdlog.h"
+
+namespace fat32 {
+
+namespace {
+
+constexpr uint32_t kBytesPerSector = 512;
+constexpr uint32_t kReservedSectors = 32;
+constexpr uint32_t kCountFats = 2;
+constexpr uint32_t kRootCluster = 2;
+constexpr uint32_t kEndOfChain = 0x0FFFFFFF;
+// Below this many clusters the volume would be FAT16.
+constexpr uint64_t kMinClusters = 65525;
+constexpr uint8_t kAttrDirectory = 0x10;
+constexpr uint8_t kAttrArchive = 0x20;
+constexpr uint8_t kAttrLongName = 0x0F;
+// 2024-04-19 08:00:00 UTC, when the first clip is recorded.
+constexpr time_t kFirstClipTime = 1713513600;
+constexpr const char *kCameras[] = {"front", "back", "left_repeater",
+                                    "right_repeater"};
+constexpr size_t kCameraCount = std::size(kCameras);
+
+// The default cluster size of mkfs.fat for a volume of `size` bytes.
+uint32_t DefaultClusterSize(uint64_t size) {
+  if (size <= (8ull << 30)) {
+    return 4 << 10;
+  }
+  if (size <= (16ull << 30)) {
+    return 8 << 10;
+  }
+  if (size <= (32ull << 30)) {
+    return 16 << 10;
+  }
+  return 32 << 10;
+}
+
+void Store16(uint8_t *p, uint16_t value) {
+  value = htole16(value);
+  memcpy(p, &value, sizeof(value));
+}
+
+void Store32(uint8_t *p, uint32_t value) {
+  value = htole32(value);
+  memcpy(p, &value, sizeof(value));
+}
+
+bool WriteAll(int fd, const void *data, uint64_t size, uint64_t offset) {
+  const char *p = static_cast<const char *>(data);
+  while (size > 0) {
+    const ssize_t n = pwrite(fd, p, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      spdlog::error("failed to write image at {}: {}", offset,
+                    strerror(errno));
+      return false;
+    }
+    p += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+std::string FormatTime(time_t time) {
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  char buf[32];
+  strftime(buf, sizeof(buf), "%Y-%m-%d_%H-%M-%S", &tm);
+  return buf;
+}
+
+uint16_t FatDate(time_t time) {
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  return ((tm.tm_year + 1900 - 1980) << 9) | ((tm.tm_mon + 1) << 5) |
+         tm.tm_mday;
+}
+
+uint16_t FatTime(time_t time) {
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  return (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+}
+
+uint8_t ShortNameChecksum(const uint8_t *short_name) {
+  uint8_t sum = 0;
+  for (int i = 0; i < 11; i++) {
+    sum = ((sum & 1) << 7) + (sum >> 1) + short_name[i];
+  }
+  return sum;
+}
+
+// Builds the volume in memory: the FAT, and the directories until they are
+// written out.
+class ImageBuilder {
+ public:
+  struct Directory {
+    uint32_t first_cluster;
+    uint32_t last_cluster;
+    uint32_t clusters;
+    std::string bytes;
+  };
+
+  ImageBuilder(uint32_t cluster_size, uint64_t count_clusters)
+      : cluster_size_(cluster_size), fat_(count_clusters + 2) {
+    fat_[0] = 0x0FFFFFF8;
+    fat_[1] = kEndOfChain;
+    fat_[kRootCluster] = kEndOfChain;
+  }
+
+  uint32_t ClusterSize() const { return cluster_size_; }
+  uint32_t NextFreeCluster() const { return next_free_; }
+  uint64_t FreeClusters() const { return fat_.size() - next_free_; }
+
+  // Allocates `count` contiguous clusters after `*last`, or as a new chain
+  // if `*last` is 0. Returns the first cluster, 0 if the volume is full.
+  uint32_t Allocate(uint32_t count, uint32_t *last) {
+    if (count == 0 || count > FreeClusters()) {
+      return 0;
+    }
+    const uint32_t first = next_free_;
+    next_free_ += count;
+    for (uint32_t c = first; c + 1 < next_free_; c++) {
+      fat_[c] = c + 1;
+    }
+    fat_[next_free_ - 1] = kEndOfChain;
+    if (*last != 0) {
+      fat_[*last] = first;
+    }
+    *last = next_free_ - 1;
+    return first;
+  }
+
+  Directory *MakeRoot() {
+    auto &dir = directories_.emplace_back(new Directory{
+        kRootCluster, kRootCluster, 1, std::string()});
+    return dir.get();
+  }
+
+  // Adds a subdirectory, with its dot entries, to `parent`.
+  Directory *MakeDirectory(Directory *parent, const std::string &name,
+                           time_t time) {
+    uint32_t last = 0;
+    const uint32_t first = Allocate(1, &last);
+    if (first == 0 || !AddEntry(parent, name, kAttrDirectory, first, 0, time)) {
+      return nullptr;
+    }
+    auto &dir = directories_.emplace_back(
+        new Directory{first, first, 1, std::string()});
+    const uint32_t parent_cluster =
+        parent->first_cluster == kRootCluster ? 0 : parent->first_cluster;
+    AddShortEntry(dir.get(), ".          ", kAttrDirectory, first, 0, time);
+    AddShortEntry(dir.get(), "..         ", kAttrDirectory, parent_cluster, 0,
+                  time);
+    return dir.get();
+  }
+
+  // Adds a long named entry to `dir`, growing its chain when full.
+  bool AddEntry(Directory *dir, const std::string &name, uint8_t attributes,
+                uint32_t first_cluster, uint32_t size, time_t time) {
+    char short_name[12];
+    const auto dot = name.find_last_of('.');
+    std::string extension =
+        dot == std::string::npos ? "" : name.substr(dot + 1, 3);
+    for (char &c : extension) {
+      c = toupper(c);
+    }
+    snprintf(short_name, sizeof(short_name), "F%07u%-3s",
+             ++short_name_counter_, extension.c_str());
+    const uint8_t checksum =
+        ShortNameChecksum(reinterpret_cast<const uint8_t *>(short_name));
+
+    // Each long name entry holds 13 UTF-16 characters, the name ends with
+    // a 0x0000 if it does not fill the last one, then 0xFFFF padding.
+    const size_t count = (name.size() + 12) / 13;
+    for (size_t i = count; i > 0; i--) {
+      uint8_t entry[32] = {};
+      entry[0] = i | (i == count ? 0x40 : 0);
+      entry[11] = kAttrLongName;
+      entry[13] = checksum;
+      static constexpr uint8_t kOffsets[13] = {1,  3,  5,  7,  9,  14, 16,
+                                               18, 20, 22, 24, 28, 30};
+      for (size_t j = 0; j < 13; j++) {
+        const size_t pos = (i - 1) * 13 + j;
+        uint16_t c = 0xFFFF;
+        if (pos < name.size()) {
+          c = static_cast<uint8_t>(name[pos]);
+        } else if (pos == name.size()) {
+          c = 0x0000;
+        }
+        Store16(entry + kOffsets[j], c);
+      }
+      if (!Append(dir, entry)) {
+        return false;
+      }
+    }
+    return AddShortEntry(dir, short_name, attributes, first_cluster, size,
+                         time);
+  }
+
+  // Writes the directories and the FATs.
+  bool Write(int fd, uint64_t fat_address, uint64_t fat_size,
+             uint64_t data_address) const {
+    for (const auto &dir : directories_) {
+      uint32_t cluster = dir->first_cluster;
+      for (uint64_t pos = 0; pos < dir->bytes.size(); pos += cluster_size_) {
+        const uint64_t n =
+            std::min<uint64_t>(cluster_size_, dir->bytes.size() - pos);
+        if (!WriteAll(fd, dir->bytes.data() + pos, n,
+                      data_address +
+                          static_cast<uint64_t>(cluster - 2) * cluster_size_)) {
+          return false;
+        }
+        cluster = fat_[cluster];
+      }
+    }
+
+    // The clusters past the next free one are free, zeros left as holes.
+    std::vector<uint8_t> fat(static_cast<uint64_t>(next_free_) * 4);
+    for (uint32_t i = 0; i < next_free_; i++) {
+      Store32(fat.data() + i * 4, fat_[i]);
+    }
+    for (uint32_t i = 0; i < kCountFats; i++) {
+      if (!WriteAll(fd, fat.data(), fat.size(), fat_address + i * fat_size)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  bool AddShortEntry(Directory *dir, const char *short_name,
+                     uint8_t attributes, uint32_t first_cluster,
+                     uint32_t size, time_t time) {
+    uint8_t entry[32] = {};
+    memcpy(entry, short_name, 11);
+    entry[11] = attributes;
+    Store16(entry + 14, FatTime(time));
+    Store16(entry + 16, FatDate(time));
+    Store16(entry + 18, FatDate(time));
+    Store16(entry + 20, first_cluster >> 16);
+    Store16(entry + 22, FatTime(time));
+    Store16(entry + 24, FatDate(time));
+    Store16(entry + 26, first_cluster & 0xFFFF);
+    Store32(entry + 28, size);
+    return Append(dir, entry);
+  }
+
+  bool Append(Directory *dir, const uint8_t *entry) {
+    if (dir->bytes.size() + 32 > uint64_t{dir->clusters} * cluster_size_) {
+      // The directory grows wherever the next free cluster is, which
+      // fragments it as clips are recorded in between.
+      if (Allocate(1, &dir->last_cluster) == 0) {
+        return false;
+      }
+      dir->clusters++;
+    }
+    dir->bytes.append(reinterpret_cast<const char *>(entry), 32);
+    return true;
+  }
+
+  const uint32_t cluster_size_;
+  std::vector<uint32_t> fat_;
+  uint32_t next_free_ = kRootCluster + 1;
+  uint32_t short_name_counter_ = 0;
+  std::vector<std::unique_ptr<Directory>> directories_;
+};
+
+// Records one minute of the four cameras in `dir`, as the car does: the
+// clips grow at the same time, so with fragmentation their runs of
+// clusters interleave.
+bool RecordMinute(ImageBuilder *builder, ImageBuilder::Directory *dir,
+                  const std::string &dir_path, time_t time,
+                  const TeslaCamImageOptions &options, std::mt19937_64 *rng,
+                  TeslaCamImage *image) {
+  uint32_t sizes[kCameraCount];
+  uint32_t remaining[kCameraCount];
+  uint32_t first[kCameraCount] = {};
+  uint32_t last[kCameraCount] = {};
+  for (size_t i = 0; i < kCameraCount; i++) {
+    // Clips of a minute are a little smaller than the nominal size.
+    sizes[i] = options.clip_size - (*rng)() % (options.clip_size / 8 + 1);
+    remaining[i] =
+        (uint64_t{sizes[i]} + builder->ClusterSize() - 1) /
+        builder->ClusterSize();
+  }
+
+  // Runs end after each cluster with probability `fragmentation`.
+  std::geometric_distribution<uint32_t> run_length(
+      std::clamp(options.fragmentation, 1e-9, 1 - 1e-9));
+  bool recording = true;
+  while (recording) {
+    recording = false;
+    for (size_t i = 0; i < kCameraCount; i++) {
+      if (remaining[i] == 0) {
+        continue;
+      }
+      uint32_t count = remaining[i];
+      if (options.fragmentation >= 1) {
+        count = 1;
+      } else if (options.fragmentation > 0) {
+        count = std::min(count, 1 + run_length(*rng));
+      }
+      const uint32_t cluster = builder->Allocate(count, &last[i]);
+      if (cluster == 0) {
+        spdlog::error("image full");
+        return false;
+      }
+      if (first[i] == 0) {
+        first[i] = cluster;
+      }
+      remaining[i] -= count;
+      recording |= remaining[i] > 0;
+    }
+  }
+
+  for (size_t i = 0; i < kCameraCount; i++) {
+    const std::string name =
+        FormatTime(time) + "-" + kCameras[i] + ".mp4";
+    if (!builder->AddEntry(dir, name, kAttrArchive, first[i], sizes[i],
+                           time)) {
+      return false;
+    }
+    image->clips.push_back(dir_path + "/" + name);
+  }
+  return true;
+}
+
+}  // namespace
+
+bool WriteTeslaCamImage(const std::string &path,
+                        const TeslaCamImageOptions &options,
+                        TeslaCamImage *image) {
+  const uint32_t cluster_size = options.cluster_size != 0
+                                    ? options.cluster_size
+                                    : DefaultClusterSize(options.size);
+  const uint64_t sectors = options.size / kBytesPerSector;
+  if (cluster_size < kBytesPerSector || cluster_size > (64 << 10) ||
+      (cluster_size & (cluster_size - 1)) != 0 || sectors > UINT32_MAX ||
+      options.clip_size < cluster_size || options.clip_size > UINT32_MAX ||
+      options.fragmentation < 0 || options.fragmentation > 1 ||
+      options.minutes_per_event == 0) {
+    spdlog::error("invalid TeslaCam image options");
+    return false;
+  }
+  const uint32_t sectors_per_cluster = cluster_size / kBytesPerSector;
+
+  // Sized for all the sectors after the reserved ones, a little more than
+  // the clusters left once the FATs are taken out.
+  const uint64_t sectors_per_fat =
+      ((sectors - kReservedSectors) / sectors_per_cluster + 2) * 4 /
+          kBytesPerSector +
+      1;
+  const uint64_t data_sector =
+      kReservedSectors + kCountFats * sectors_per_fat;
+  const uint64_t count_clusters =
+      sectors > data_sector ? (sectors - data_sector) / sectors_per_cluster
+                            : 0;
+  if (count_clusters < kMinClusters) {
+    spdlog::error("{} clusters is too few for FAT32", count_clusters);
+    return false;
+  }
+
+  ImageBuilder builder(cluster_size, count_clusters);
+  std::mt19937_64 rng(options.seed);
+  image->directories.clear();
+  image->clips.clear();
+
+  ImageBuilder::Directory *root = builder.MakeRoot();
+  ImageBuilder::Directory *teslacam =
+      builder.MakeDirectory(root, "TeslaCam", kFirstClipTime);
+  ImageBuilder::Directory *recent_clips =
+      teslacam != nullptr
+          ? builder.MakeDirectory(teslacam, "RecentClips", kFirstClipTime)
+          : nullptr;
+  ImageBuilder::Directory *sentry_clips =
+      recent_clips != nullptr
+          ? builder.MakeDirectory(teslacam, "SentryClips", kFirstClipTime)
+          : nullptr;
+  if (sentry_clips == nullptr) {
+    spdlog::error("image full");
+    return false;
+  }
+  image->directories = {"TeslaCam", "TeslaCam/RecentClips",
+                        "TeslaCam/SentryClips"};
+
+  const uint64_t clusters_per_minute =
+      kCameraCount * ((options.clip_size + cluster_size - 1) /
+                             cluster_size);
+  const uint64_t minutes = static_cast<uint64_t>(
+      options.fill * count_clusters / clusters_per_minute);
+  const uint64_t events = minutes / 2 / options.minutes_per_event;
+  const uint64_t recent_minutes = minutes - events * options.minutes_per_event;
+
+  // Sentry events first, then the recent clips, one minute after another.
+  time_t time = kFirstClipTime;
+  for (uint64_t event = 0; event < events; event++) {
+    const std::string name = FormatTime(time);
+    const std::string event_path = "TeslaCam/SentryClips/" + name;
+    ImageBuilder::Directory *dir =
+        builder.MakeDirectory(sentry_clips, name, time);
+    if (dir == nullptr) {
+      spdlog::error("image full");
+      return false;
+    }
+    image->directories.push_back(event_path);
+    for (uint32_t i = 0; i < options.minutes_per_event; i++, time += 60) {
+      if (!RecordMinute(&builder, dir, event_path, time, options, &rng,
+                        image)) {
+        return false;
+      }
+    }
+    // The metadata of the event and its thumbnail, left empty.
+    for (const auto &[file, size] :
+         {std::pair<const char *, uint32_t>{"event.json", 200},
+          std::pair<const char *, uint32_t>{"thumb.png", 20 << 10}}) {
+      uint32_t last = 0;
+      const uint32_t first = builder.Allocate(
+          (size + cluster_size - 1) / cluster_size, &last);
+      if (first == 0 ||
+          !builder.AddEntry(dir, file, kAttrArchive, first, size, time)) {
+        spdlog::error("image full");
+        return false;
+      }
+    }
+  }
+  for (uint64_t i = 0; i < recent_minutes; i++, time += 60) {
+    if (!RecordMinute(&builder, recent_clips, "TeslaCam/RecentClips", time,
+                      options, &rng, image)) {
+      return false;
+    }
+  }
+
+  const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+  if (fd < 0) {
+    spdlog::error("failed to create {}: {}", path, strerror(errno));
+    return false;
+  }
+  bool succeed = ftruncate(fd, sectors * kBytesPerSector) == 0;
+  if (!succeed) {
+    spdlog::error("failed to resize {}: {}", path, strerror(errno));
+  }
+
+  uint8_t boot_sector[kBytesPerSector] = {0xEB, 0x58, 0x90};
+  memcpy(boot_sector + 3, "MSWIN4.1", 8);
+  Store16(boot_sector + 11, kBytesPerSector);
+  boot_sector[13] = sectors_per_cluster;
+  Store16(boot_sector + 14, kReservedSectors);
+  boot_sector[16] = kCountFats;
+  boot_sector[21] = 0xF8;  // fixed media
+  Store16(boot_sector + 24, 32);  // sectors per track
+  Store16(boot_sector + 26, 64);  // heads
+  Store32(boot_sector + 32, sectors);
+  Store32(boot_sector + 36, sectors_per_fat);
+  Store32(boot_sector + 44, kRootCluster);
+  Store16(boot_sector + 48, 1);  // FSInfo sector
+  Store16(boot_sector + 50, 6);  // backup boot sector
+  boot_sector[64] = 0x80;
+  boot_sector[66] = 0x29;
+  Store32(boot_sector + 67, static_cast<uint32_t>(options.seed));
+  memcpy(boot_sector + 71, "TESLACAM   FAT32   ", 19);
+  boot_sector[510] = 0x55;
+  boot_sector[511] = 0xAA;
+
+  uint8_t fs_info[kBytesPerSector] = {};
+  Store32(fs_info, 0x41615252);
+  Store32(fs_info + 484, 0x61417272);
+  Store32(fs_info + 488, builder.FreeClusters());
+  Store32(fs_info + 492, builder.NextFreeCluster());
+  Store32(fs_info + 508, 0xAA550000);
+
+  succeed = succeed &&
+            WriteAll(fd, boot_sector, sizeof(boot_sector), 0) &&
+            WriteAll(fd, fs_info, sizeof(fs_info), kBytesPerSector) &&
+            WriteAll(fd, boot_sector, sizeof(boot_sector),
+                     6 * kBytesPerSector) &&
+            builder.Write(fd, kReservedSectors * kBytesPerSector,
+                          sectors_per_fat * kBytesPerSector,
+                          data_sector * kBytesPerSector);
+  close(fd);
+  return succeed;
+}
+
+}  // namespace fat32
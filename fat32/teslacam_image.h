@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace fat32 {
+
+struct TeslaCamImageOptions {
+  // Logical size of the image. The image is a sparse file, only its
+  // metadata is written, clips read as zeros.
+  uint64_t size = 1ull << 30;
+  // 512 bytes to 64 KiB, 0 for the default of mkfs.fat for the size.
+  uint32_t cluster_size = 0;
+  // Probability that a clip continues in a new run of clusters after each
+  // cluster, interleaved with the runs of the other cameras being recorded
+  // at the same time. 0 makes every clip contiguous.
+  double fragmentation = 0.0;
+  // Share of the data clusters taken by clips, split evenly between
+  // RecentClips and SentryClips.
+  double fill = 0.5;
+  uint64_t clip_size = 32 << 20;
+  uint32_t minutes_per_event = 10;
+  uint64_t seed = 1;
+};
+
+// What was written in the image, paths are relative to the root.
+struct TeslaCamImage {
+  std::vector<std::string> directories;
+  std::vector<std::string> clips;
+};
+
+// Writes a FAT32 image with the layout of a TeslaCam drive:
+//
+//   TeslaCam/RecentClips/<time>-<camera>.mp4
+//   TeslaCam/SentryClips/<time>/<time>-<camera>.mp4, event.json, thumb.png
+//
+// with the four cameras recording a clip every minute. The same options
+// always give the same image. Returns false on I/O error or if the options
+// are invalid.
+bool WriteTeslaCamImage(const std::string& path,
+                        const TeslaCamImageOptions& options,
+                        TeslaCamImage* image);
+
+}  // namespace fat32
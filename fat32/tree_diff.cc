@@ -0,0 +1,145 @@
+#include "tree_diff.h"
+
+#include "absl/strings/str_cat.h"
+#include "json.h"
+
+namespace fat32 {
+
+namespace {
+
+// The "." and ".." entries and the volume label are not part of the tree.
+bool IsListed(const DirectoryEntry &entry) {
+  return entry.name != "." && entry.name != ".." &&
+         !entry.IsVolumeIdEntry();
+}
+
+std::string ChildPath(absl::string_view parent, absl::string_view name) {
+  return parent.empty() ? std::string(name) : absl::StrCat(parent, "/", name);
+}
+
+// Appends `entry` at `path` and, for a directory, everything below it in
+// `snapshot`, as `type`.
+void AppendTree(const TreeSnapshot &snapshot, const std::string &path,
+                const DirectoryEntry &entry, TreeChange::Type type,
+                std::vector<TreeChange> *changes) {
+  changes->push_back({type, path, entry});
+  if (!entry.IsDirectory()) {
+    return;
+  }
+  const auto it = snapshot.directories.find(path);
+  if (it == snapshot.directories.end()) {
+    return;
+  }
+  for (const DirectoryEntry &child : it->second->Entries()) {
+    if (IsListed(child)) {
+      AppendTree(snapshot, ChildPath(path, child.name), child, type, changes);
+    }
+  }
+}
+
+// Whether `after` is another file or directory than `before`, rather than
+// the same one changed in place. An empty file gets its first cluster when
+// it is first written to.
+bool IsReplaced(const DirectoryEntry &before, const DirectoryEntry &after) {
+  if (before.IsDirectory() != after.IsDirectory()) {
+    return true;
+  }
+  const bool same_cluster = before.firstClusterHigh == after.firstClusterHigh &&
+                            before.firstClusterLow == after.firstClusterLow;
+  const bool was_empty =
+      before.firstClusterHigh == 0 && before.firstClusterLow == 0;
+  if (!same_cluster && !(was_empty && !after.IsDirectory())) {
+    return true;
+  }
+  return !after.IsDirectory() && after.size < before.size;
+}
+
+void DiffDirectory(const TreeSnapshot &before, const TreeSnapshot &after,
+                   const std::string &path, std::vector<TreeChange> *changes) {
+  const auto after_it = after.directories.find(path);
+  if (after_it == after.directories.end()) {
+    return;
+  }
+  const Directory &after_directory = *after_it->second;
+  const auto before_it = before.directories.find(path);
+  if (before_it == before.directories.end()) {
+    for (const DirectoryEntry &entry : after_directory.Entries()) {
+      if (IsListed(entry)) {
+        AppendTree(after, ChildPath(path, entry.name), entry,
+                   TreeChange::Type::kAdded, changes);
+      }
+    }
+    return;
+  }
+  const Directory &before_directory = *before_it->second;
+
+  // Unchanged, only its subdirectories may have changed.
+  if (&before_directory == &after_directory) {
+    for (const DirectoryEntry &entry : after_directory.Entries()) {
+      if (IsListed(entry) && entry.IsDirectory()) {
+        DiffDirectory(before, after, ChildPath(path, entry.name), changes);
+      }
+    }
+    return;
+  }
+
+  for (const DirectoryEntry &entry : before_directory.Entries()) {
+    const DirectoryEntry *current = after_directory.Find(entry.name);
+    if (IsListed(entry) &&
+        (current == nullptr || IsReplaced(entry, *current))) {
+      AppendTree(before, ChildPath(path, entry.name), entry,
+                 TreeChange::Type::kRemoved, changes);
+    }
+  }
+  for (const DirectoryEntry &entry : after_directory.Entries()) {
+    if (!IsListed(entry)) {
+      continue;
+    }
+    const std::string child_path = ChildPath(path, entry.name);
+    const DirectoryEntry *previous = before_directory.Find(entry.name);
+    if (previous == nullptr || IsReplaced(*previous, entry)) {
+      AppendTree(after, child_path, entry, TreeChange::Type::kAdded, changes);
+    } else if (entry.IsDirectory()) {
+      DiffDirectory(before, after, child_path, changes);
+    } else if (entry.size > previous->size) {
+      changes->push_back(
+          {TreeChange::Type::kGrown, child_path, entry, previous->size});
+    }
+  }
+}
+
+}  // namespace
+
+void DiffSnapshots(const TreeSnapshot &before, const TreeSnapshot &after,
+                   std::vector<TreeChange> *changes) {
+  DiffDirectory(before, after, after.root, changes);
+}
+
+std::string FormatChangeJson(const TreeChange &change) {
+  const char *type = "";
+  switch (change.type) {
+    case TreeChange::Type::kAdded:
+      type = "added";
+      break;
+    case TreeChange::Type::kRemoved:
+      type = "removed";
+      break;
+    case TreeChange::Type::kGrown:
+      type = "grown";
+      break;
+  }
+
+  std::string out = absl::StrCat("{\"type\":\"", type, "\",\"path\":");
+  AppendJsonString(change.path, &out);
+  absl::StrAppend(
+      &out, ",\"directory\":", change.entry.IsDirectory() ? "true" : "false",
+      ",\"size\":", change.entry.size, ",\"mtime\":",
+      change.entry.LastModificationDatetime().ToTimestamp());
+  if (change.type == TreeChange::Type::kGrown) {
+    absl::StrAppend(&out, ",\"previous_size\":", change.previous_size);
+  }
+  out.push_back('}');
+  return out;
+}
+
+}  // namespace fat32
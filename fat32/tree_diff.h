@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "dentry_cache.h"
+#include "types.h"
+
+namespace fat32 {
+
+// The directories of a tree as of a refresh, by path relative to the root
+// of the file system. A refresh keeps the Directory of a directory that did
+// not change, so consecutive snapshots share them, and only the
+// directories that changed are compared entry by entry.
+struct TreeSnapshot {
+  std::string root;
+  uint64_t generation = 0;
+  absl::flat_hash_map<std::string, std::shared_ptr<const Directory>>
+      directories;
+};
+
+struct TreeChange {
+  enum class Type { kAdded, kRemoved, kGrown };
+
+  Type type;
+  // Relative to the root of the file system.
+  std::string path;
+  DirectoryEntry entry;
+  // Size before the change, for kGrown.
+  uint32_t previous_size = 0;
+};
+
+// Appends what changed from `before` to `after`, which must have the same
+// root, parents before their children. The entries of an added or removed
+// directory are reported as added or removed too. A file that shrank or
+// moved to other clusters was replaced, and is reported as removed then
+// added.
+void DiffSnapshots(const TreeSnapshot& before, const TreeSnapshot& after,
+                   std::vector<TreeChange>* changes);
+
+// Formats `change` as a JSON object on a single line, without the newline.
+std::string FormatChangeJson(const TreeChange& change);
+
+}  // namespace fat32
@@ -26,7 +26,7 @@ struct Datetime : Date {
   time_t ToTimestamp() const {
     struct tm tm;
     tm.tm_year = static_cast<int>(year) + 1980 - 1900;
-    tm.tm_mon = month;
+    tm.tm_mon = month - 1;
     tm.tm_mday = day;
     tm.tm_hour = hour;
     tm.tm_min = minutes;
@@ -56,11 +56,11 @@ Datetime ConvertToDatetime(uint16_t date, uint16_t time) {
   date >>= 4;
   result.year = date & 0b1111111;
 
-  result.hour = time & 0b1111;
+  result.seconds = (time & 0b11111) * 2;
   time >>= 5;
   result.minutes = time & 0b111111;
   time >>= 6;
-  result.seconds = (time & 0b11111) * 2;
+  result.hour = time & 0b11111;
 
   return result;
 }
@@ -123,6 +123,7 @@ struct DirectoryEntry {
 
   // processed fields
   std::string name;
+  uint64_t location;  // address of the (short) entry in the image
   bool IsReadOnly() const { return (attributes & 0x01) != 0; }
   bool IsHidden() const { return (attributes & 0x02) != 0; }
   bool IsSystem() const { return (attributes & 0x04) != 0; }
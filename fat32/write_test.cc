@@ -0,0 +1,379 @@
+// Checks the write support on generated TeslaCam images. After a sequence
+// of create, write, truncate, mkdir and unlink, the image read back from
+// scratch must be consistent, also when writes to the image start failing
+// at any point of the sequence.
+//
+// Linked with -Wl,--wrap=pwrite, which every write to the image goes
+// through, so that writes can be made to fail.
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/str_cat.h"
+#include "fat32.h"
+#include "readahead.h"
+#include "spdlog/spdlog.h"
+#include "teslacam_image.h"
+#include "tree_diff.h"
+
+namespace {
+
+// Writes left before they fail with EIO, or -1 for no limit.
+int64_t writes_left = -1;
+// Writes done, failed or not.
+uint64_t writes_done = 0;
+
+}  // namespace
+
+extern "C" {
+
+ssize_t __real_pwrite(int fd, const void* buf, size_t count, off_t offset);
+ssize_t __real_pwrite64(int fd, const void* buf, size_t count,
+                        off64_t offset);
+
+ssize_t __wrap_pwrite(int fd, const void* buf, size_t count, off_t offset) {
+  writes_done++;
+  if (writes_left == 0) {
+    errno = EIO;
+    return -1;
+  }
+  if (writes_left > 0) {
+    writes_left--;
+  }
+  return __real_pwrite(fd, buf, count, offset);
+}
+
+ssize_t __wrap_pwrite64(int fd, const void* buf, size_t count,
+                        off64_t offset) {
+  writes_done++;
+  if (writes_left == 0) {
+    errno = EIO;
+    return -1;
+  }
+  if (writes_left > 0) {
+    writes_left--;
+  }
+  return __real_pwrite64(fd, buf, count, offset);
+}
+
+}  // extern "C"
+
+namespace {
+
+constexpr char kUploads[] = "TeslaCam/Uploads";
+
+fat32::TeslaCamImageOptions ImageOptions() {
+  fat32::TeslaCamImageOptions options;
+  options.size = 64 << 20;
+  // Small clusters, so that directories and files span several.
+  options.cluster_size = 512;
+  options.clip_size = 16 << 10;
+  options.fill = 0.1;
+  return options;
+}
+
+bool MakeImage(const std::string& path, fat32::TeslaCamImage* image) {
+  unlink(path.c_str());
+  return fat32::WriteTeslaCamImage(path, ImageOptions(), image);
+}
+
+// The bytes written at `offset` by WriteAt.
+char Pattern(uint64_t offset) { return static_cast<char>(offset * 7 + 1); }
+
+bool WriteAt(fat32::FileSystem* fs, const std::string& path, uint32_t offset,
+             uint32_t size) {
+  fat32::FileLayout layout;
+  if (!fs->GetFileLayout(path, &layout)) {
+    return false;
+  }
+  std::vector<char> data(size);
+  for (uint32_t i = 0; i < size; i++) {
+    data[i] = Pattern(offset + i);
+  }
+  return fs->WriteFile(&layout, offset, size, data.data()) == size;
+}
+
+// Changes the image the way the mount does, stopping at the first failure.
+// Sizes are in clusters of 512 bytes.
+bool Change(fat32::FileSystem* fs, const fat32::TeslaCamImage& image) {
+  const std::string big = absl::StrCat(kUploads, "/big.bin");
+  const std::string small = absl::StrCat(kUploads, "/café.txt");
+  if (!fs->MakeDirectory(kUploads) || !fs->CreateFile(big) ||
+      !WriteAt(fs, big, 0, 3 * 512 + 100) || !fs->Flush() ||
+      !fs->CreateFile(small) || !WriteAt(fs, small, 0, 10) ||
+      // Shrinks within the last cluster, then frees clusters, then grows.
+      !fs->Truncate(big, 3 * 512 + 10) || !fs->Truncate(big, 512 + 10) ||
+      !fs->Truncate(big, 2 * 512 + 300) || !fs->Flush()) {
+    return false;
+  }
+  // Enough long names to grow the directory past its cluster.
+  for (int i = 0; i < 8; i++) {
+    const std::string path =
+        absl::StrCat(kUploads, "/upload number ", i, ".mp4");
+    if (!fs->CreateFile(path) || !WriteAt(fs, path, 0, 700)) {
+      return false;
+    }
+  }
+  return fs->Unlink(absl::StrCat(kUploads, "/upload number 3.mp4")) &&
+         fs->Unlink(image.clips.front()) && fs->Flush();
+}
+
+// Checks the image as read from scratch: every entry points at clusters
+// allocated on the image, no cluster belongs to two entries, and no chain
+// is shorter than its entry. With `exact`, chains are also not longer than
+// their entry and every allocated cluster belongs to an entry.
+bool CheckImage(const std::string& path, bool exact, std::string* error) {
+  fat32::FileSystem fs(path);
+  fat32::TreeSnapshot snapshot;
+  if (!fs.IsValid() || !fs.Snapshot("", &snapshot)) {
+    *error = "cannot read the image";
+    return false;
+  }
+  const fat32::SpaceStats space = fs.GetSpaceStats();
+  absl::flat_hash_set<uint32_t> free;
+  for (const fat32::Extent& extent : fs.GetFreeExtents()) {
+    for (uint32_t i = 0; i < extent.length; i++) {
+      free.insert(extent.start_cluster + i);
+    }
+  }
+
+  absl::flat_hash_map<uint32_t, std::string> owners;
+  const auto claim = [&](const std::string& owner,
+                         const std::vector<fat32::Extent>& extents) {
+    for (const fat32::Extent& extent : extents) {
+      for (uint32_t i = 0; i < extent.length; i++) {
+        const uint32_t cluster = extent.start_cluster + i;
+        if (free.contains(cluster)) {
+          *error = absl::StrCat(owner, " uses free cluster ", cluster);
+          return false;
+        }
+        const auto [it, inserted] = owners.emplace(cluster, owner);
+        if (!inserted) {
+          *error = absl::StrCat(owner, " and ", it->second,
+                                " share cluster ", cluster);
+          return false;
+        }
+      }
+    }
+    return true;
+  };
+
+  for (const auto& [directory_path, directory] : snapshot.directories) {
+    if (!claim(directory_path.empty() ? "/" : directory_path,
+               directory->Extents())) {
+      return false;
+    }
+    for (const fat32::DirectoryEntry& entry : directory->Entries()) {
+      // Directories are checked from their own listing.
+      if (entry.IsDirectory() || entry.IsVolumeIdEntry()) {
+        continue;
+      }
+      const std::string file_path =
+          directory_path.empty()
+              ? entry.name
+              : absl::StrCat(directory_path, "/", entry.name);
+      fat32::FileLayout layout;
+      if (!fs.GetFileLayout(file_path, &layout)) {
+        *error = absl::StrCat("cannot resolve ", file_path);
+        return false;
+      }
+      uint64_t clusters = 0;
+      for (const fat32::Extent& extent : layout.extents) {
+        clusters += extent.length;
+      }
+      const uint64_t needed =
+          (entry.size + space.cluster_size - 1) / space.cluster_size;
+      if (clusters < needed || (exact && clusters > needed)) {
+        *error = absl::StrCat(file_path, " of ", entry.size, " bytes has ",
+                              clusters, " clusters");
+        return false;
+      }
+      if (!claim(file_path, layout.extents)) {
+        return false;
+      }
+    }
+  }
+
+  if (exact && owners.size() + free.size() != space.clusters) {
+    *error = absl::StrCat(space.clusters - owners.size() - free.size(),
+                          " clusters allocated to no entry");
+    return false;
+  }
+  return true;
+}
+
+#define CHECK(condition)                                                \
+  do {                                                                  \
+    if (!(condition)) {                                                 \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " #condition "\n"; \
+      return false;                                                     \
+    }                                                                   \
+  } while (false)
+
+// Runs the changes without failures and checks what they left.
+bool TestChanges(const std::string& image_path, uint64_t* writes) {
+  fat32::TeslaCamImage image;
+  CHECK(MakeImage(image_path, &image));
+  fat32::FileSystem fs(image_path, fat32::BlockDeviceType::kMmap, 16 << 20,
+                       /*writable=*/true);
+  CHECK(fs.IsValid());
+
+  writes_done = 0;
+  CHECK(Change(&fs, image));
+  *writes = writes_done;
+  CHECK(fs.Refresh());
+
+  // Truncating to 512 + 10 bytes then growing zeroed the rest.
+  fat32::FileLayout layout;
+  CHECK(fs.GetFileLayout(absl::StrCat(kUploads, "/big.bin"), &layout));
+  CHECK(layout.entry.size == 2 * 512 + 300);
+  std::string content(layout.entry.size, '\xff');
+  CHECK(fs.ReadFile(layout, 0, content.size(), content.data()) ==
+        content.size());
+  for (uint32_t i = 0; i < content.size(); i++) {
+    CHECK(content[i] == (i < 512 + 10 ? Pattern(i) : '\0'));
+  }
+  fat32::DirectoryEntry entry;
+  CHECK(fs.GetEntry(absl::StrCat(kUploads, "/café.txt"), &entry));
+  CHECK(entry.size == 10);
+  CHECK(!fs.GetEntry(absl::StrCat(kUploads, "/upload number 3.mp4"), &entry));
+  CHECK(!fs.GetEntry(image.clips.front(), &entry));
+
+  // Names FAT forbids are refused.
+  for (const char* name : {"a:b", "a?", "trailing.", "trailing ", "\x01",
+                           "\xff"}) {
+    CHECK(!fs.CreateFile(absl::StrCat(kUploads, "/", name)));
+    CHECK(!fs.MakeDirectory(absl::StrCat(kUploads, "/", name)));
+  }
+
+  // FAT keeps times to 2 seconds.
+  const time_t mtime = 1713516372;
+  CHECK(fs.SetModificationTime(absl::StrCat(kUploads, "/café.txt"), mtime));
+  CHECK(fs.Flush());
+
+  std::string error;
+  if (!CheckImage(image_path, /*exact=*/true, &error)) {
+    std::cerr << "after the changes: " << error << "\n";
+    return false;
+  }
+  fat32::FileSystem reopened(image_path);
+  CHECK(reopened.GetEntry(absl::StrCat(kUploads, "/café.txt"), &entry));
+  CHECK(entry.LastModificationDatetime().ToTimestamp() == mtime);
+  return true;
+}
+
+// Fails every write after the `k`-th, for each k. Whatever was written,
+// the image must stay consistent, and once writes succeed again the next
+// flush must succeed.
+bool TestFailures(const std::string& image_path, uint64_t writes) {
+  for (uint64_t k = 0; k < writes; k++) {
+    fat32::TeslaCamImage image;
+    CHECK(MakeImage(image_path, &image));
+    fat32::FileSystem fs(image_path, fat32::BlockDeviceType::kMmap, 16 << 20,
+                         /*writable=*/true);
+    CHECK(fs.IsValid());
+
+    writes_left = k;
+    const bool changed = Change(&fs, image);
+    const bool flushed = fs.Flush();
+    writes_left = -1;
+    CHECK(!changed || !flushed);
+
+    std::string error;
+    if (!CheckImage(image_path, /*exact=*/false, &error)) {
+      std::cerr << "failing after write " << k << ": " << error << "\n";
+      return false;
+    }
+    CHECK(fs.Flush());
+    CHECK(fs.Refresh());
+    if (!CheckImage(image_path, /*exact=*/false, &error)) {
+      std::cerr << "flushing after write " << k << " failed: " << error
+                << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// A shrink must make the layouts resolved before it stale, even if no
+// cluster is freed, and a write must drop what another handle read ahead.
+bool TestTwoHandles(const std::string& image_path) {
+  fat32::TeslaCamImage image;
+  CHECK(MakeImage(image_path, &image));
+  fat32::FileSystem fs(image_path, fat32::BlockDeviceType::kMmap, 16 << 20,
+                       /*writable=*/true);
+  const std::string path = absl::StrCat(kUploads, "/shared.bin");
+  CHECK(fs.MakeDirectory(kUploads) && fs.CreateFile(path));
+  CHECK(WriteAt(&fs, path, 0, 8192) && fs.Flush());
+
+  // The reader reads sequentially, so that the next chunk is read ahead.
+  constexpr uint32_t kWindow = 2048;
+  auto writes = std::make_shared<std::atomic<uint64_t>>(0);
+  fat32::ReadaheadWorker worker;
+  auto reader = std::make_shared<fat32::FileReadahead>(&fs, &worker, kWindow,
+                                                       writes);
+  auto layout = std::make_shared<fat32::FileLayout>();
+  CHECK(fs.GetFileLayout(path, layout.get()));
+  std::vector<char> buffer(kWindow);
+  for (uint32_t offset = 0; offset < 2 * kWindow; offset += kWindow) {
+    CHECK(reader->Read(layout, offset, kWindow, buffer.data()) == kWindow);
+  }
+
+  // The writer overwrites the next chunks in place.
+  fat32::FileLayout writer;
+  CHECK(fs.GetFileLayout(path, &writer));
+  const std::vector<char> zeros(2 * kWindow, 0);
+  CHECK(fs.WriteFile(&writer, 2 * kWindow, zeros.size(), zeros.data()) ==
+        zeros.size());
+  writes->fetch_add(1);
+  CHECK(reader->Read(layout, 2 * kWindow, kWindow, buffer.data()) == kWindow);
+  for (char c : buffer) {
+    CHECK(c == 0);
+  }
+
+  // Shrinking within the last cluster frees nothing.
+  const uint64_t generation = fs.Generation();
+  CHECK(fs.Truncate(path, 8192 - 100));
+  CHECK(fs.Generation() != generation);
+  CHECK(fs.GetFileLayout(path, layout.get()));
+  CHECK(fs.ReadFile(*layout, 8000, 1000, buffer.data()) == 8192 - 100 - 8000);
+  return true;
+}
+
+}  // namespace
+
+int main() {
+  spdlog::set_level(spdlog::level::off);
+
+  const char* tmpdir = getenv("TMPDIR");
+  std::string directory = absl::StrCat(tmpdir != nullptr ? tmpdir : "/tmp",
+                                       "/fat32_write_test.XXXXXX");
+  if (mkdtemp(directory.data()) == nullptr) {
+    std::cerr << "failed to create a temporary directory\n";
+    return 1;
+  }
+  const std::string image_path = directory + "/image";
+
+  uint64_t writes = 0;
+  const bool passed = TestChanges(image_path, &writes) &&
+                      TestFailures(image_path, writes) &&
+                      TestTwoHandles(image_path);
+  unlink(image_path.c_str());
+  rmdir(directory.c_str());
+  if (!passed) {
+    return 1;
+  }
+  std::cout << "passed, with failures after each of " << writes
+            << " writes\n";
+  return 0;
+}
@@ -45,7 +45,7 @@
         Type = "exec";
         User = "root";
         Group = "root";
-        ExecStart = "${pkgs.simple-http-server}/bin/simple-http-server --port ${builtins.toString staticFileServerPort} --cors ${mountPath}";
+        ExecStart = "${pkgs.fat32}/bin/fat32 -f ${path} --port ${builtins.toString staticFileServerPort} http";
         Restart = "on-failure";
         RestartSec = 2;
       };
@@ -89,6 +89,7 @@ def mount(path: Path, mount_path: Path, readwrite: bool, fuse: bool = True):
                 str(path),
                 "--mount-path",
                 str(mount_path),
+                *(["--read-write"] if readwrite else []),
                 "mount",
             ]
         )